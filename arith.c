@@ -0,0 +1,224 @@
+//
+// Arithmetic expansion, $((...)), for the parser.
+//
+// A Pratt parser: each binary operator has a binding power, and an operand
+// takes the operators after it as long as they bind tighter than the one
+// before it. The expression is evaluated as it is read, straight from the
+// text, so an evaluation allocates nothing. Both sides of &&, || and ?: are
+// read, the side not taken with errors off (a division by zero there is
+// not one).
+//
+// Overflow wraps around as in two's complement, instead of being undefined.
+//
+
+#include "arith.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define NAME_MAX_LEN 255
+#define MAX_DEPTH 1024  /* nested parentheses, unary operators and ?: */
+
+struct arith {
+    const char *p;
+    const char *(*lookup)(void *arg, const char *name);
+    void *arg;
+    const char *err;   /* the first error */
+    int skip;          /* in a side not taken */
+    int depth;
+};
+
+enum { OP_NONE, OP_TERNARY, OP_OR, OP_AND, OP_BOR, OP_XOR, OP_BAND, OP_EQ, OP_NE, OP_LT, OP_LE,
+       OP_GT, OP_GE, OP_SHL, OP_SHR, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD };
+
+/* Text and binding power of the binary operators, two-character ones first */
+static const struct {
+    const char *text;
+    int op;
+    int power;
+} binary[] = {
+    {"||", OP_OR, 3}, {"&&", OP_AND, 4}, {"==", OP_EQ, 8}, {"!=", OP_NE, 8}, {"<=", OP_LE, 9},
+    {">=", OP_GE, 9}, {"<<", OP_SHL, 10}, {">>", OP_SHR, 10}, {"?", OP_TERNARY, 2}, {"|", OP_BOR, 5},
+    {"^", OP_XOR, 6}, {"&", OP_BAND, 7}, {"<", OP_LT, 9}, {">", OP_GT, 9}, {"+", OP_ADD, 11},
+    {"-", OP_SUB, 11}, {"*", OP_MUL, 12}, {"/", OP_DIV, 12}, {"%", OP_MOD, 12},
+};
+
+static void fail(struct arith *a, const char *err)
+{
+    if (a->err == 0) a->err = err;
+}
+
+static void skip_blanks(struct arith *a)
+{
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+}
+
+/* The operator at a->p, OP_NONE if there is none */
+static int peek_binary(struct arith *a, int *power, size_t *len)
+{
+    skip_blanks(a);
+    for (size_t k = 0; k < sizeof(binary) / sizeof(binary[0]); k++) {
+        if (*a->p != binary[k].text[0]) continue;
+        size_t n = binary[k].text[1] ? 2 : 1;
+        if (n == 2 && a->p[1] != binary[k].text[1]) continue;
+        *power = binary[k].power;
+        *len = n;
+        return binary[k].op;
+    }
+    return OP_NONE;
+}
+
+/* Value of a variable: its text must be a number */
+static long long variable(struct arith *a, const char *name)
+{
+    const char *value = a->lookup ? a->lookup(a->arg, name) : 0;
+    char *end;
+
+    if (value == 0) return 0;
+    while (isspace((unsigned char)*value)) value++;
+    if (*value == 0) return 0;
+    errno = 0;
+    long long v = strtoll(value, &end, 0);
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != 0 || errno == ERANGE) fail(a, "arithmetic: variable is not a number");
+    return v;
+}
+
+static long long expr(struct arith *a, int min_power);
+
+static long long operand(struct arith *a)
+{
+    char name[NAME_MAX_LEN + 1];
+    long long v;
+    char *end;
+
+    skip_blanks(a);
+    if (++a->depth > MAX_DEPTH) {
+        fail(a, "arithmetic: expression too deep");
+        return 0;
+    }
+    char c = *a->p;
+    if (c == '(') {
+        a->p++;
+        v = expr(a, 0);
+        skip_blanks(a);
+        if (*a->p == ')') a->p++;
+        else fail(a, "arithmetic: missing )");
+    } else if (c == '+' || c == '-' || c == '!' || c == '~') {
+        a->p++;
+        v = operand(a);
+        if (c == '-') v = (long long)(0ULL - (unsigned long long)v);
+        else if (c == '!') v = !v;
+        else if (c == '~') v = ~v;
+    } else if (isdigit((unsigned char)c)) {
+        errno = 0;
+        v = strtoll(a->p, &end, 0);
+        if (errno == ERANGE || isalnum((unsigned char)*end) || *end == '_') fail(a, "arithmetic: bad number");
+        a->p = end;
+        while (isalnum((unsigned char)*a->p) || *a->p == '_') a->p++;
+    } else if (c == '$' || c == '_' || isalpha((unsigned char)c)) {
+        int brace = c == '$' && a->p[1] == '{';
+        size_t n = 0;
+        a->p += c == '$' ? 1 + brace : 0;
+        while ((isalnum((unsigned char)*a->p) || *a->p == '_') && n < NAME_MAX_LEN) name[n++] = *a->p++;
+        name[n] = 0;
+        if (brace && *a->p == '}') a->p++;
+        else if (brace) fail(a, "arithmetic: missing }");
+        if (n == 0) fail(a, "arithmetic: syntax error");
+        v = variable(a, name);
+    } else {
+        fail(a, "arithmetic: syntax error");
+        v = 0;
+    }
+    a->depth--;
+    return v;
+}
+
+static long long apply(struct arith *a, int op, long long x, long long y)
+{
+    unsigned long long ux = x, uy = y;
+
+    switch (op) {
+        case OP_OR: return x || y;
+        case OP_AND: return x && y;
+        case OP_BOR: return x | y;
+        case OP_XOR: return x ^ y;
+        case OP_BAND: return x & y;
+        case OP_EQ: return x == y;
+        case OP_NE: return x != y;
+        case OP_LT: return x < y;
+        case OP_LE: return x <= y;
+        case OP_GT: return x > y;
+        case OP_GE: return x >= y;
+        case OP_SHL: return (long long)(ux << (y & 63));
+        case OP_SHR: return x >> (y & 63);
+        case OP_ADD: return (long long)(ux + uy);
+        case OP_SUB: return (long long)(ux - uy);
+        case OP_MUL: return (long long)(ux * uy);
+        case OP_DIV:
+        case OP_MOD:
+            if (y == 0) {
+                if (!a->skip) fail(a, "arithmetic: division by zero");
+                return 0;
+            }
+            if (x == LLONG_MIN && y == -1) return op == OP_DIV ? x : 0;
+            return op == OP_DIV ? x / y : x % y;
+    }
+    return 0;
+}
+
+/* An operand and the operators after it binding tighter than min_power */
+static long long expr(struct arith *a, int min_power)
+{
+    long long x;
+    int op, power;
+    size_t len;
+
+    if (++a->depth > MAX_DEPTH) {
+        fail(a, "arithmetic: expression too deep");
+        return 0;
+    }
+    x = operand(a);
+    while (a->err == 0 && (op = peek_binary(a, &power, &len)) != OP_NONE && power > min_power) {
+        a->p += len;
+        if (op == OP_TERNARY) {
+            long long y, z;
+            a->skip += !x;
+            y = expr(a, 0);
+            a->skip -= !x;
+            skip_blanks(a);
+            if (*a->p != ':') {
+                fail(a, "arithmetic: missing : after ?");
+                break;
+            }
+            a->p++;
+            a->skip += !!x;
+            z = expr(a, power - 1);  /* right associative */
+            a->skip -= !!x;
+            x = x ? y : z;
+            continue;
+        }
+        int not_taken = (op == OP_AND && !x) || (op == OP_OR && x);
+        a->skip += not_taken;
+        long long y = expr(a, power);  /* left associative */
+        a->skip -= not_taken;
+        x = apply(a, op, x, y);
+    }
+    a->depth--;
+    return x;
+}
+
+int arith_eval(const char *text, const char *(*lookup)(void *arg, const char *name), void *arg,
+               long long *value, const char **err)
+{
+    struct arith a = {text, lookup, arg, 0, 0, 0};
+
+    *value = expr(&a, 0);
+    skip_blanks(&a);
+    if (a.err == 0 && *a.p != 0) fail(&a, "arithmetic: syntax error");
+    *err = a.err;
+    return a.err ? -1 : 0;
+}
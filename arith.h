@@ -0,0 +1,17 @@
+//
+// Arithmetic expansion, $((...)), for the parser.
+//
+
+#ifndef ARITH_H
+#define ARITH_H
+
+/* Evaluate the expression text with 64-bit integers: numbers (decimal, 0x
+   hexadecimal, 0 octal), variables (NAME, $NAME or ${NAME}, whose value
+   lookup() gives, 0 if unset or empty), parentheses and the operators of
+   C, with their precedence: unary + - ! ~, * / %, + -, << >>, < <= > >=,
+   == !=, &, ^, |, &&, || and ?:. Nothing is allocated. Returns 0 with the
+   result in *value, or -1 with *err a static message. */
+int arith_eval(const char *text, const char *(*lookup)(void *arg, const char *name), void *arg,
+               long long *value, const char **err);
+
+#endif //ARITH_H
@@ -0,0 +1,187 @@
+//
+// The command lines of the shell, parsed by libshparse with the allocation
+// functions of utils.h, so memstats counts the parser too.
+//
+
+#include "cmdline.h"
+#include "utils.h"
+
+#include <string.h>
+
+static void *shell_alloc(void *opaque, size_t size)
+{
+    (void)opaque;
+    return xmalloc(size);
+}
+
+static void *shell_realloc(void *opaque, void *p, size_t size)
+{
+    (void)opaque;
+    return xrealloc(p, size);
+}
+
+static void shell_free(void *opaque, void *p)
+{
+    (void)opaque;
+    xfree(p);
+}
+
+static const struct shparse_allocator shell_allocator = {shell_alloc, shell_realloc, shell_free, 0};
+static struct shparse_ctx *ctx = 0;
+static struct shparse_stream *stream = 0;
+static struct cmdline *parsed_cmdline = 0;  /* of parsecmd() */
+static struct cmdline *read_cmdline = 0;    /* of readcmd() */
+static char read_buf[4096];
+static size_t read_used = 0, read_len = 0;  /* what is left of read_buf after a line ended */
+static char *(*substitute)(const char *cmd) = 0;
+static const char *(*variable)(const char *name) = 0;
+
+static char *run_substitution(void *arg, const char *cmd)
+{
+    (void)arg;
+    return substitute ? substitute(cmd) : 0;
+}
+
+static struct shparse_ctx *context(void)
+{
+    if (ctx == 0) {
+        ctx = shparse_new(&shell_allocator);
+        shparse_set_substitution(ctx, run_substitution, 0);
+    }
+    return ctx;
+}
+
+void parser_set_substitution(char *(*run)(const char *cmd))
+{
+    substitute = run;
+}
+
+static const char *lookup(void *arg, const char *name)
+{
+    (void)arg;
+    return variable ? variable(name) : 0;
+}
+
+void parser_set_variables(const char *(*lookup)(const char *name))
+{
+    variable = lookup;
+}
+
+int cmdline_expand(struct cmdline *l)
+{
+    return shparse_expand(context(), l, lookup, 0);
+}
+
+/* Make parsed the static structure *kept, freeing the previous line. The
+   previous line is kept until the new one is parsed and expanded: a $(...)
+   in it runs its command line through parsecmd() again. readcmd() has its
+   own, expanded after it returns. */
+static struct cmdline *keep(struct cmdline **kept, struct cmdline *parsed)
+{
+    if (*kept == 0) *kept = xmalloc(sizeof(struct cmdline));
+    else shparse_clear(context(), *kept);
+    **kept = *parsed;
+    return *kept;
+}
+
+struct cmdline *parsecmd(char **pline)
+{
+    char *line = *pline;
+    struct cmdline parsed;
+
+    if (line == NULL) {
+        if (parsed_cmdline) {
+            shparse_clear(context(), parsed_cmdline);
+            xfree(parsed_cmdline);
+        }
+        return parsed_cmdline = 0;
+    }
+
+    shparse_parse(context(), line, &parsed);
+    xfree(line);
+    *pline = NULL;
+    shparse_expand(context(), &parsed, lookup, 0);
+    return keep(&parsed_cmdline, &parsed);
+}
+
+struct cmdline *readcmd(size_t (*read)(char *buf, size_t size, int more))
+{
+    struct cmdline parsed;
+
+    if (stream == 0) stream = shparse_stream_new(context());
+    while (!shparse_stream_next(stream, &parsed)) {
+        if (read_used == read_len) {
+            read_used = 0;
+            read_len = read(read_buf, sizeof(read_buf), shparse_stream_pending(stream));
+            if (read_len == 0 && !shparse_stream_end(stream)) return NULL;
+        }
+        read_used += shparse_feed(stream, read_buf + read_used, read_len - read_used);
+    }
+    return keep(&read_cmdline, &parsed);
+}
+
+int readcmd_buffered(void)
+{
+    for (size_t k = read_used; k < read_len; k++)
+        if (!strchr(" \t\n;", read_buf[k])) return 1;
+    return 0;
+}
+
+int shift_words(struct cmdline *l, int n)
+{
+    char **cmd = l->seq[0];
+    int len = 0;
+
+    while (cmd[len] != 0) len++;
+    if (len < n || (len == n && l->seq[1] != 0)) return -1;
+    for (int k = 0; k < n; k++) xfree(cmd[k]);
+    memmove(cmd, cmd + n, (len - n + 1) * sizeof(char *));
+    if (cmd[0] == 0) {  /* nothing left, as for an empty line */
+        xfree(cmd);
+        l->seq[0] = 0;
+    }
+    return 0;
+}
+
+static char *copy_string(const char *s)
+{
+    return s ? xstrdup(s) : 0;
+}
+
+/* Copy of a NULL terminated array of strings */
+static char **copy_words(char **words)
+{
+    size_t n = 0;
+
+    while (words[n]) n++;
+    char **copy = xmalloc((n + 1) * sizeof(char *));
+    for (size_t k = 0; k < n; k++) copy[k] = xstrdup(words[k]);
+    copy[n] = 0;
+    return copy;
+}
+
+struct cmdline *cmdline_copy(const struct cmdline *l)
+{
+    struct cmdline *copy = xmalloc(sizeof(struct cmdline));
+    size_t n = 0;
+
+    *copy = *l;  /* err is static, bg and fanout are values */
+    copy->in = copy_string(l->in);
+    copy->out = copy_string(l->out);
+    copy->here = copy_string(l->here);
+    copy->here_end = copy_string(l->here_end);
+    copy->tee_out = l->tee_out ? copy_words(l->tee_out) : 0;
+    if (l->seq) {
+        while (l->seq[n]) n++;
+        copy->seq = xmalloc((n + 1) * sizeof(char **));
+        for (size_t k = 0; k < n; k++) copy->seq[k] = copy_words(l->seq[k]);
+        copy->seq[n] = 0;
+    }
+    return copy;
+}
+
+void cmdline_free(struct cmdline *l)
+{
+    shparse_clear(context(), l);
+    xfree(l);
+}
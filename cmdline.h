@@ -0,0 +1,50 @@
+//
+// The command lines of the shell, parsed by libshparse with the allocation
+// functions of utils.h.
+//
+
+#ifndef CMDLINE_H
+#define CMDLINE_H
+
+#include "parser.h"
+
+/* Parse the line *pline, free it and set *pline to NULL, and expand its
+   variables. Returns a static structure, valid until the next call. With *pline NULL, frees the
+   structure and returns NULL. Not thread-safe: threads of the shell
+   calling it hold a lock (see server.c). */
+struct cmdline *parsecmd(char **pline);
+
+/* Read the next command line with read() and parse it as it comes. read()
+   puts up to size bytes of input in buf and returns how many, 0 at the
+   end; more is set when they continue a line. Returns a static structure,
+   as parsecmd(), or NULL at the end of the input. Its variables are not
+   expanded yet, see cmdline_expand(). */
+struct cmdline *readcmd(size_t (*read)(char *buf, size_t size, int more));
+
+/* Whether input read by readcmd() is left for the next lines */
+int readcmd_buffered(void);
+
+/* Drop the first n words of the first command of l, those of a builtin
+   running the rest as a command line (exec, timeout). Returns -1 if there
+   are not enough words, or none left before a pipe. */
+int shift_words(struct cmdline *l, int n);
+
+/* Copy of l, allocated with xmalloc() and kept until cmdline_free(), for a
+   command line run after the next one is read (a queued job) */
+struct cmdline *cmdline_copy(const struct cmdline *l);
+void cmdline_free(struct cmdline *l);
+
+/* Expand the variables of l, with the values of the function given to
+   parser_set_variables(). Returns -1 with only l->err set when its
+   arithmetic fails, else 0. */
+int cmdline_expand(struct cmdline *l);
+
+/* Set the function giving the value of a variable, NULL if it is not set */
+void parser_set_variables(const char *(*lookup)(const char *name));
+
+/* Set the function running the command line of a $(...) substitution. It
+   returns what the command wrote on its standard output, in a string
+   allocated with xmalloc(), or 0 on failure. */
+void parser_set_substitution(char *(*run)(const char *cmd));
+
+#endif //CMDLINE_H
@@ -0,0 +1,257 @@
+//
+// Conditions: the test and [ builtins, evaluated in the shell.
+//
+// An expression is read by recursive descent, -o binding looser than -a,
+// itself looser than !. As in POSIX, a word followed by a binary operator
+// and another word is a comparison first, so [ ! = x ] compares strings.
+//
+// The results of stat() and lstat() are kept for the command line, by path:
+// [ -e f -a -s f -a ! -d f ] costs one system call. The cache goes with
+// the line, so a file changed by the next command is seen as it is then.
+//
+
+#include "cond.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_SIZE 8   /* paths kept, most lines test one or two */
+#define MAX_DEPTH 256  /* nested ! and ( */
+
+struct stat_entry {
+    const char *path;
+    int link;          /* lstat() rather than stat() */
+    int failed;
+    struct stat st;
+};
+
+struct cond {
+    char **args;
+    int pos, len;
+    int depth;
+    const char *err;   /* the first error */
+    struct stat_entry cache[CACHE_SIZE];
+    int cached, next;  /* entries used, the one replaced next when all are */
+};
+
+static const char *binary_ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                   "-nt", "-ot", "-ef", 0};
+static const char unary_ops[] = "efdsrwxLhpSbcugktzn";
+
+static int is_binary(const char *w)
+{
+    for (int k = 0; binary_ops[k]; k++)
+        if (!strcmp(w, binary_ops[k])) return 1;
+    return 0;
+}
+
+static int is_unary(const char *w)
+{
+    return w[0] == '-' && w[1] != 0 && w[2] == 0 && strchr(unary_ops, w[1]) != 0;
+}
+
+static void fail(struct cond *c, const char *err)
+{
+    if (c->err == 0) c->err = err;
+}
+
+/* stat() (lstat() if link is set) of path, from the cache when it was
+   already asked for. Returns NULL if it failed. */
+static const struct stat *file(struct cond *c, const char *path, int link)
+{
+    struct stat_entry *e;
+
+    for (int k = 0; k < c->cached; k++) {
+        e = &c->cache[k];
+        if (e->link == link && !strcmp(e->path, path)) return e->failed ? 0 : &e->st;
+    }
+    if (c->cached < CACHE_SIZE) {
+        e = &c->cache[c->cached++];
+    } else {
+        e = &c->cache[c->next];
+        c->next = (c->next + 1) % CACHE_SIZE;
+    }
+    e->path = path;
+    e->link = link;
+    e->failed = (link ? lstat(path, &e->st) : stat(path, &e->st)) == -1;
+    return e->failed ? 0 : &e->st;
+}
+
+static long long integer(struct cond *c, const char *w)
+{
+    char *end;
+
+    errno = 0;
+    long long n = strtoll(w, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == w || *end != 0 || errno == ERANGE) fail(c, "integer expected");
+    return n;
+}
+
+static int unary(struct cond *c, char op, const char *arg)
+{
+    const struct stat *st;
+
+    switch (op) {
+        case 'z': return arg[0] == 0;
+        case 'n': return arg[0] != 0;
+        case 't': return isatty((int)integer(c, arg));
+        case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+        case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+        case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+        case 'L':
+        case 'h':
+            st = file(c, arg, 1);
+            return st && S_ISLNK(st->st_mode);
+    }
+    if ((st = file(c, arg, 0)) == 0) return 0;
+    switch (op) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st->st_mode);
+        case 'd': return S_ISDIR(st->st_mode);
+        case 's': return st->st_size > 0;
+        case 'p': return S_ISFIFO(st->st_mode);
+        case 'S': return S_ISSOCK(st->st_mode);
+        case 'b': return S_ISBLK(st->st_mode);
+        case 'c': return S_ISCHR(st->st_mode);
+        case 'u': return (st->st_mode & S_ISUID) != 0;
+        case 'g': return (st->st_mode & S_ISGID) != 0;
+        case 'k': return (st->st_mode & S_ISVTX) != 0;
+    }
+    return 0;
+}
+
+/* Whether the modification time of a is after the one of b */
+static int newer(const struct stat *a, const struct stat *b)
+{
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+    return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+}
+
+static int binary(struct cond *c, const char *x, const char *op, const char *y)
+{
+    const struct stat *a, *b;
+
+    if (!strcmp(op, "=") || !strcmp(op, "==")) return !strcmp(x, y);
+    if (!strcmp(op, "!=")) return strcmp(x, y) != 0;
+    if (!strcmp(op, "<")) return strcmp(x, y) < 0;
+    if (!strcmp(op, ">")) return strcmp(x, y) > 0;
+    if (!strcmp(op, "-ef") || !strcmp(op, "-nt") || !strcmp(op, "-ot")) {
+        a = file(c, x, 0);
+        b = file(c, y, 0);
+        if (op[1] == 'e') return a && b && a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+        if (op[1] == 'n') return a && (!b || newer(a, b));
+        return b && (!a || newer(b, a));
+    }
+    long long m = integer(c, x), n = integer(c, y);
+    if (!strcmp(op, "-eq")) return m == n;
+    if (!strcmp(op, "-ne")) return m != n;
+    if (!strcmp(op, "-lt")) return m < n;
+    if (!strcmp(op, "-le")) return m <= n;
+    if (!strcmp(op, "-gt")) return m > n;
+    return m >= n;
+}
+
+static int or_expr(struct cond *c);
+
+static int primary(struct cond *c)
+{
+    char **w = c->args + c->pos;
+    int left = c->len - c->pos;
+
+    if (left == 0) {
+        fail(c, "argument expected");
+        return 0;
+    }
+    if (left >= 3 && is_binary(w[1])) {
+        c->pos += 3;
+        return binary(c, w[0], w[1], w[2]);
+    }
+    if ((!strcmp(w[0], "!") || !strcmp(w[0], "(")) && left >= 2) {
+        if (++c->depth > MAX_DEPTH) {
+            c->pos = c->len;
+            fail(c, "expression too deep");
+            return 0;
+        }
+        c->pos++;
+        int v;
+        if (w[0][0] == '!') {
+            v = !primary(c);
+        } else {
+            v = or_expr(c);
+            if (c->pos < c->len && !strcmp(c->args[c->pos], ")")) c->pos++;
+            else fail(c, "missing )");
+        }
+        c->depth--;
+        return v;
+    }
+    if (is_unary(w[0]) && left >= 2) {
+        c->pos += 2;
+        return unary(c, w[0][1], w[1]);
+    }
+    if (left == 2 && is_binary(w[1])) {  /* [ 1 -eq ] */
+        c->pos = c->len;
+        fail(c, "argument expected");
+        return 0;
+    }
+    c->pos++;
+    return w[0][0] != 0;  /* a lone word: is it not empty */
+}
+
+static int and_expr(struct cond *c)
+{
+    int v = primary(c);
+
+    while (c->pos < c->len && !strcmp(c->args[c->pos], "-a")) {
+        c->pos++;
+        v = primary(c) && v;  /* both sides are read */
+    }
+    return v;
+}
+
+static int or_expr(struct cond *c)
+{
+    int v = and_expr(c);
+
+    while (c->pos < c->len && !strcmp(c->args[c->pos], "-o")) {
+        c->pos++;
+        v = and_expr(c) || v;
+    }
+    return v;
+}
+
+int cond_test(char **argv)
+{
+    struct cond c;
+    int len = 0;
+
+    while (argv[len + 1]) len++;
+    if (!strcmp(argv[0], "[")) {
+        if (len == 0 || strcmp(argv[len], "]")) {
+            printf("[: missing ]\n");
+            return 2 << 8;
+        }
+        len--;
+    }
+    c.args = argv + 1;
+    c.pos = 0;
+    c.len = len;
+    c.depth = 0;
+    c.err = 0;
+    c.cached = c.next = 0;
+    if (len == 0) return 1 << 8;  /* no expression is false */
+
+    int v = or_expr(&c);
+    if (c.err == 0 && c.pos < c.len) c.err = "too many arguments";
+    if (c.err) {
+        printf("%s: %s\n", argv[0], c.err);
+        return 2 << 8;
+    }
+    return v ? 0 : 1 << 8;
+}
@@ -0,0 +1,17 @@
+//
+// Conditions: the test and [ builtins, evaluated in the shell.
+//
+
+#ifndef COND_H
+#define COND_H
+
+/* Evaluate test ARGS or [ ARGS ] (argv[0] is "test" or "[") without
+   running a program: the file predicates -e -f -d -s -r -w -x -L -h -p
+   -S -b -c -u -g -k -t, -nt -ot -ef, the string ones -z -n = == != < >,
+   the integer ones -eq -ne -lt -le -gt -ge, and ! ( ) -a -o. A path is
+   stat()ed once for the command line, however many predicates test it.
+   Returns the wait status: 0 if true, 1 if false, 2 after printing an
+   error. */
+int cond_test(char **argv);
+
+#endif //COND_H
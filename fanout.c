@@ -0,0 +1,225 @@
+//
+// Fan-out: copies the output of one command to several files and pipes,
+// in the kernel with tee(2) and splice(2), from a helper thread.
+//
+// tee() duplicates the pages of the input pipe into each output pipe
+// without consuming them; once every output has its copy, the input is
+// consumed by splicing it to /dev/null. Files are not pipes, so their copy
+// goes through a private pipe first and is spliced from there. When an
+// output pipe was too full to take the whole chunk, the chunk is read in
+// userspace to give that output the rest.
+//
+
+#define _GNU_SOURCE
+
+#include "fanout.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHUNK (1 << 20)  /* pipe size asked for, and most bytes copied per round */
+
+struct target {
+    int fd;
+    int spill[2];   /* a file's copy goes through this pipe, {-1, -1} for a pipe */
+    ssize_t got;    /* bytes of the current chunk it received */
+    int dead;       /* its reader is gone or it failed, not written any more */
+};
+
+struct fanout {
+    int in;
+    struct target *t;
+    int n;
+    pid_t owner;
+    pthread_t tid;
+    struct fanout *next;
+};
+
+/* Copies that fanout_join() may wait for */
+static struct fanout *joinable = 0;
+static pthread_mutex_t joinable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int read_all(int fd, char *buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t r = read(fd, buf, n);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        buf += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Move n bytes from the pipe from to to, through buf if to does not
+   support splice() (a terminal for instance) */
+static int splice_all(int from, int to, size_t n, char *buf)
+{
+    while (n > 0) {
+        ssize_t r = splice(from, 0, to, 0, n, SPLICE_F_MOVE);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1 && errno == EINVAL) {
+            size_t k = n < CHUNK ? n : CHUNK;
+            if (read_all(from, buf, k) == -1 || write_all(to, buf, k) == -1) return -1;
+            r = k;
+        }
+        if (r <= 0) return -1;
+        n -= r;
+    }
+    return 0;
+}
+
+static void *copy_loop(void *arg)
+{
+    struct fanout *f = arg;
+    char *buf = xmalloc(CHUNK);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    sigset_t pipe_sig;
+
+    /* a reader that exits must only fail our writes, not kill the shell */
+    sigemptyset(&pipe_sig);
+    sigaddset(&pipe_sig, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_sig, 0);
+
+    while (1) {
+        ssize_t m = -1;
+        int live = 0, short_target = 0;
+
+        for (int i = 0; i < f->n; i++) {
+            struct target *t = &f->t[i];
+            int dst = t->spill[1] != -1 ? t->spill[1] : t->fd;
+            ssize_t r;
+
+            t->got = 0;
+            if (t->dead) continue;
+            do r = tee(f->in, dst, m == -1 ? CHUNK : (size_t)m, 0);
+            while (r == -1 && errno == EINTR);
+            if (r == 0) goto done;  /* end of the input */
+            if (r == -1 || (t->spill[1] != -1 && splice_all(t->spill[0], t->fd, r, buf) == -1)) {
+                t->dead = 1;
+                continue;
+            }
+            t->got = r;
+            if (m == -1) m = r;  /* the others get at most what the first one got */
+            live++;
+        }
+        if (live == 0) break;  /* every reader is gone, the writer gets SIGPIPE */
+
+        for (int i = 0; i < f->n; i++)
+            if (!f->t[i].dead && f->t[i].got < m) short_target = 1;
+        if (!short_target) {
+            if (splice_all(f->in, devnull, m, buf) == -1) break;
+            continue;
+        }
+        if (read_all(f->in, buf, m) == -1) break;
+        for (int i = 0; i < f->n; i++) {
+            struct target *t = &f->t[i];
+            if (!t->dead && t->got < m && write_all(t->fd, buf + t->got, m - t->got) == -1) t->dead = 1;
+        }
+    }
+
+done:
+    close(f->in);
+    for (int i = 0; i < f->n; i++) {
+        close(f->t[i].fd);
+        if (f->t[i].spill[0] != -1) {
+            close(f->t[i].spill[0]);
+            close(f->t[i].spill[1]);
+        }
+    }
+    if (devnull != -1) close(devnull);
+    xfree(buf);
+    if (f->owner == -1) {
+        xfree(f->t);
+        xfree(f);
+    }
+    return 0;
+}
+
+int fanout_start(int in, const int *outs, int n, pid_t owner)
+{
+    struct fanout *f = xmalloc(sizeof(struct fanout));
+    struct stat st;
+
+    f->in = in;
+    f->n = n;
+    f->owner = owner;
+    f->t = xmalloc(n * sizeof(struct target));
+    fcntl(in, F_SETPIPE_SZ, CHUNK);  /* best effort, bigger rounds */
+    for (int i = 0; i < n; i++) {
+        struct target *t = &f->t[i];
+        t->fd = outs[i];
+        t->dead = 0;
+        t->spill[0] = t->spill[1] = -1;
+        if (fstat(t->fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+            fcntl(t->fd, F_SETPIPE_SZ, CHUNK);
+        } else if (pipe2(t->spill, O_CLOEXEC) == -1) {
+            t->spill[0] = t->spill[1] = -1;
+            t->dead = 1;
+        } else {
+            fcntl(t->spill[1], F_SETPIPE_SZ, CHUNK);
+        }
+    }
+
+    if (pthread_create(&f->tid, 0, copy_loop, f) != 0) {
+        close(in);
+        for (int i = 0; i < n; i++) {
+            close(f->t[i].fd);
+            if (f->t[i].spill[0] != -1) {
+                close(f->t[i].spill[0]);
+                close(f->t[i].spill[1]);
+            }
+        }
+        xfree(f->t);
+        xfree(f);
+        return -1;
+    }
+
+    if (owner == -1) {
+        pthread_detach(f->tid);
+    } else {
+        pthread_mutex_lock(&joinable_lock);
+        f->next = joinable;
+        joinable = f;
+        pthread_mutex_unlock(&joinable_lock);
+    }
+    return 0;
+}
+
+void fanout_join(pid_t owner)
+{
+    struct fanout **p, *found = 0;
+
+    pthread_mutex_lock(&joinable_lock);
+    for (p = &joinable; *p; p = &(*p)->next) {
+        if ((*p)->owner == owner) {
+            found = *p;
+            *p = found->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&joinable_lock);
+
+    if (found) {
+        pthread_join(found->tid, 0);
+        xfree(found->t);
+        xfree(found);
+    }
+}
@@ -0,0 +1,21 @@
+//
+// Fan-out: copies the output of one command to several files and pipes,
+// in the kernel with tee(2) and splice(2), from a helper thread.
+//
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <sys/types.h>
+
+/* Copy everything read from the pipe in to the n fds of outs (pipes or
+   files) until in reaches end of file. The helper thread owns in and outs
+   and closes them. It is joined by fanout_join(owner), or runs detached
+   when owner is -1. Returns -1 if the thread could not be started, the fds
+   are then closed. */
+int fanout_start(int in, const int *outs, int n, pid_t owner);
+
+/* Wait until the copies started for owner are complete */
+void fanout_join(pid_t owner);
+
+#endif //FANOUT_H
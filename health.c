@@ -0,0 +1,133 @@
+//
+// Health of a long-running shell.
+//
+// The latencies of the command lines are kept for the current window of
+// commands only. When it is full, it is reduced to its percentiles and the
+// shell is sampled: resident memory from /proc/self/status, open fds and
+// bytes allocated through xmalloc(). The last MAX_WINDOWS windows are kept.
+//
+// A metric keeps growing when each window of the recent half of them is
+// above every window of the older half, by more than the tolerance of the
+// metric: noise goes up and down, a leak only goes up.
+//
+
+#include "health.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_WINDOW 1000
+#define MAX_WINDOWS 64
+#define MIN_WINDOWS 8   /* kept before growth is judged */
+
+struct window {
+    long long p50, p90, p99;  /* latency, ns */
+    long rss;                 /* KB */
+    long fds;
+    long live;                /* bytes */
+};
+
+static struct window windows[MAX_WINDOWS];  /* ring, windows[closed % MAX_WINDOWS] is the next */
+static unsigned long long closed = 0;
+static unsigned window = DEFAULT_WINDOW;
+static long long *latencies = 0;  /* of the current window */
+static unsigned count = 0;
+
+void health_set_window(unsigned n)
+{
+    window = n ? n : DEFAULT_WINDOW;
+    xfree(latencies);
+    latencies = 0;
+    count = 0;
+    closed = 0;  /* windows of another size do not compare */
+}
+
+unsigned health_window(void)
+{
+    return window;
+}
+
+static long rss_kb(void)
+{
+    FILE *f = fopen("/proc/self/status", "re");
+    char line[256];
+    long kb = -1;
+
+    if (f == 0) return -1;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "VmRSS:", 6)) kb = atol(line + 6);
+    fclose(f);
+    return kb;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void close_window(void)
+{
+    struct window *w = &windows[closed++ % MAX_WINDOWS];
+
+    qsort(latencies, count, sizeof(long long), by_value);
+    w->p50 = latencies[(count - 1) * 50 / 100];
+    w->p90 = latencies[(count - 1) * 90 / 100];
+    w->p99 = latencies[(count - 1) * 99 / 100];
+    w->rss = rss_kb();
+    w->fds = open_fds();
+    w->live = memstats_live_bytes();
+    count = 0;
+}
+
+void health_command(long long ns)
+{
+    if (latencies == 0) latencies = xmalloc(window * sizeof(long long));
+    latencies[count++] = ns;
+    if (count == window) close_window();
+}
+
+/* Value of a metric in a window */
+static long long metric(const struct window *w, int m)
+{
+    switch (m) {
+        case 0: return w->rss;
+        case 1: return w->fds;
+        case 2: return w->live;
+        default: return w->p99;
+    }
+}
+
+int health_report(FILE *out)
+{
+    static const char *names[] = {"rss", "fds", "live bytes", "p99 latency"};
+    static const int tolerance[] = {5, 0, 5, 20};  /* percent */
+    unsigned n = closed < MAX_WINDOWS ? closed : MAX_WINDOWS;
+    unsigned long long first = closed - n;
+    int growing = 0;
+
+    fprintf(out, "------------------Health------------------\n");
+    fprintf(out, "windows of %u commands: %llu closed, %u commands in the current one\n", window, closed, count);
+    if (n > 0) fprintf(out, "%8s %10s %10s %10s %10s %6s %12s\n", "window", "p50 us", "p90 us", "p99 us", "rss KB", "fds", "live bytes");
+    for (unsigned i = 0; i < n; i++) {
+        const struct window *w = &windows[(first + i) % MAX_WINDOWS];
+        fprintf(out, "%8llu %10.1f %10.1f %10.1f %10ld %6ld %12ld\n", first + i + 1,
+                w->p50 / 1e3, w->p90 / 1e3, w->p99 / 1e3, w->rss, w->fds, w->live);
+    }
+    if (n < MIN_WINDOWS) return 0;
+
+    for (int m = 0; m < 4; m++) {
+        long long old_max = 0, recent_min = -1;
+        for (unsigned i = 0; i < n; i++) {
+            long long v = metric(&windows[(first + i) % MAX_WINDOWS], m);
+            if (i < n / 2 && v > old_max) old_max = v;
+            if (i >= n / 2 && (recent_min == -1 || v < recent_min)) recent_min = v;
+        }
+        if (recent_min > old_max + old_max * tolerance[m] / 100) {
+            fprintf(out, "growing: %s, from at most %lld to at least %lld\n", names[m], old_max, recent_min);
+            growing++;
+        }
+    }
+    return growing;
+}
@@ -0,0 +1,25 @@
+//
+// Health of a long-running shell: latency of the command lines, memory and
+// fds of the shell, sampled by windows of commands, and whether they keep
+// growing.
+//
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdio.h>
+
+/* Record a command line that took ns nanoseconds, from parsed to done (or
+   started, in the background). Closes a window every health_window()
+   commands, sampling the shell then. */
+void health_command(long long ns);
+
+/* Commands per window, 1000 by default */
+void health_set_window(unsigned n);
+unsigned health_window(void);
+
+/* Print the windows kept so far, then the metrics that kept growing over
+   them. Returns the number of such metrics. */
+int health_report(FILE *out);
+
+#endif //HEALTH_H
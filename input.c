@@ -0,0 +1,290 @@
+//
+// The read builtin: a line of input split into variables.
+//
+// Input is read in blocks, not a byte at a time, yet a read takes no more
+// than its line from a file descriptor that the commands it runs share.
+// On a file, the blocks are read with pread() and the offset is set just
+// after the line, and a block stays valid for the next read as long as
+// nothing moved the offset. On a pipe or a terminal, where the line cannot
+// be given back, the rest of the block is kept for the next read from that
+// descriptor: only the shell reads it then. Standard input carrying the command lines of the shell is read
+// through stdio, whose buffer the command lines come from too.
+//
+
+#include "input.h"
+#include "utils.h"
+#include "vars.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOCK 65536
+#define MAX_FD 1024   /* beyond, input is not kept between reads */
+
+/* Input read ahead from a file descriptor */
+struct lookahead {
+    char *buf;
+    size_t pos, len, cap;   /* the unread input is buf[pos, len) */
+    off_t offset;           /* on a file, its offset at buf[pos]; -1 on a pipe */
+    dev_t dev;              /* the pipe of the unread input */
+    ino_t ino;
+};
+
+static struct lookahead *ahead[MAX_FD];
+
+/* The line read, without its newline, and whether each character of it
+   was escaped by a backslash */
+struct line {
+    char *text;
+    char *escaped;
+    size_t len, cap;
+};
+
+static int valid_name(const char *name)
+{
+    if (!isalpha((unsigned char)*name) && *name != '_') return 0;
+    while (*++name)
+        if (!isalnum((unsigned char)*name) && *name != '_') return 0;
+    return 1;
+}
+
+/* Drop what a was given by another file, or by the same one at another
+   offset, than fd is now */
+static void check_ahead(int fd, struct lookahead *a)
+{
+    off_t at = lseek(fd, 0, SEEK_CUR);
+    struct stat st;
+
+    if (at != -1) {
+        if (at != a->offset) a->pos = a->len = 0;
+        a->offset = at;
+        return;
+    }
+    if (a->offset != -1) a->pos = a->len = 0;  /* was a file */
+    a->offset = -1;
+    if (a->pos < a->len && (fstat(fd, &st) == -1 || st.st_dev != a->dev || st.st_ino != a->ino))
+        a->pos = a->len = 0;
+}
+
+/* Read one more block after the unread input, on a file without moving its
+   offset. Returns the number of bytes read, 0 at the end of the input or
+   on error. */
+static size_t fill(int fd, struct lookahead *a)
+{
+    struct stat st;
+    ssize_t n;
+
+    if (fd == -1) return 0;  /* a here-document, all in buf */
+    if (a->pos > 0) {
+        memmove(a->buf, a->buf + a->pos, a->len - a->pos);
+        a->len -= a->pos;
+        a->pos = 0;
+    }
+    if (a->cap - a->len < BLOCK) {
+        a->cap = a->len + BLOCK;
+        a->buf = xrealloc(a->buf, a->cap);
+    }
+    do {
+        if (a->offset == -1) n = read(fd, a->buf + a->len, a->cap - a->len);
+        else n = pread(fd, a->buf + a->len, a->cap - a->len, a->offset + (off_t)a->len);  /* the offset stays */
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (n == -1) perror("read failed");
+        return 0;
+    }
+    if (a->len == 0 && a->offset == -1 && fstat(fd, &st) == 0) {
+        a->dev = st.st_dev;
+        a->ino = st.st_ino;
+    }
+    a->len += n;
+    return n;
+}
+
+/* Take the next line of fd from a into *raw, of *n bytes, newline included
+   if there is one. Returns -1 at the end of the input. */
+static int next_line(int fd, struct lookahead *a, const char **raw, size_t *n)
+{
+    size_t seen = 0;
+    char *nl;
+
+    while ((nl = memchr(a->buf + a->pos + seen, '\n', a->len - a->pos - seen)) == 0) {
+        seen = a->len - a->pos;
+        if (fill(fd, a) == 0) break;
+    }
+    *raw = a->buf + a->pos;
+    *n = nl ? (size_t)(nl - *raw) + 1 : a->len - a->pos;
+    a->pos += *n;
+    if (a->offset != -1) {
+        a->offset += *n;
+        if (lseek(fd, a->offset, SEEK_SET) == -1) a->pos = a->len = 0;
+    }
+    return *n == 0 ? -1 : 0;
+}
+
+/* Same from the stdio buffer of the standard input */
+static int next_stdin_line(struct lookahead *a, const char **raw, size_t *n)
+{
+    a->len = 0;
+    do {
+        if (a->cap - a->len < 256) {
+            a->cap = a->cap ? 2 * a->cap : 256;
+            a->buf = xrealloc(a->buf, a->cap);
+        }
+        if (fgets(a->buf + a->len, a->cap - a->len, stdin) == NULL) break;
+        a->len += strlen(a->buf + a->len);
+    } while (a->buf[a->len - 1] != '\n');
+    *raw = a->buf;
+    *n = a->len;
+    return *n == 0 ? -1 : 0;
+}
+
+static void put(struct line *line, char c, char escaped)
+{
+    if (line->len + 1 >= line->cap) {
+        line->cap = line->cap ? 2 * line->cap : 256;
+        line->text = xrealloc(line->text, line->cap);
+        line->escaped = xrealloc(line->escaped, line->cap);
+    }
+    line->text[line->len] = c;
+    line->escaped[line->len++] = escaped;
+}
+
+/* Read a line into line, its backslashes removed unless raw is set.
+   Returns -1 at the end of the input, 1 if it ended before a newline. */
+static int read_line(int fd, struct lookahead *a, int from_stdio, int raw, struct line *line)
+{
+    const char *p;
+    size_t n;
+    int status;
+
+    line->len = 0;
+    while ((status = from_stdio ? next_stdin_line(a, &p, &n) : next_line(fd, a, &p, &n)) == 0) {
+        int ended = p[n - 1] == '\n';
+        size_t k;
+        n -= ended;
+        for (k = 0; k < n; k++) {
+            if (p[k] != '\\' || raw) put(line, p[k], 0);
+            else if (k + 1 < n) put(line, p[++k], 1);
+            else break;  /* backslash-newline: the line goes on */
+        }
+        if (k == n) return ended ? 0 : 1;
+        if (!ended) return 1;
+    }
+    return line->len > 0 ? 1 : -1;
+}
+
+static int is_ifs(const struct line *line, size_t k, const char *ifs)
+{
+    return !line->escaped[k] && line->text[k] != 0 && strchr(ifs, line->text[k]) != 0;
+}
+
+static int is_blank_ifs(const struct line *line, size_t k, const char *ifs)
+{
+    return is_ifs(line, k, ifs) && isspace((unsigned char)line->text[k]);
+}
+
+/* Set the variables names to the fields of line split on the characters of
+   ifs, the last one to the rest of the line */
+static void split(struct line *line, char **names, const char *ifs)
+{
+    size_t k = 0, end = line->len;
+
+    while (k < end && is_blank_ifs(line, k, ifs)) k++;
+    for (; *names; names++) {
+        size_t start = k;
+        if (names[1] == 0) {  /* the rest, without the blanks after it */
+            while (end > k && is_blank_ifs(line, end - 1, ifs)) end--;
+            k = end;
+        } else {
+            while (k < end && !is_ifs(line, k, ifs)) k++;
+        }
+        char saved = line->text[k];
+        line->text[k] = 0;
+        vars_set(*names, line->text + start, 0);
+        line->text[k] = saved;
+
+        while (k < end && is_blank_ifs(line, k, ifs)) k++;
+        if (k < end && is_ifs(line, k, ifs)) {  /* a separator other than blanks */
+            k++;
+            while (k < end && is_blank_ifs(line, k, ifs)) k++;
+        }
+    }
+}
+
+static int usage(void)
+{
+    printf("usage: read [-r] [-u FD] [NAME ...]\n");
+    return 2 << 8;
+}
+
+int input_read(struct cmdline *l, int stdin_commands)
+{
+    char **args = l->seq[0] + 1, *reply[] = {"REPLY", 0};
+    int raw = 0, fd = 0, opened = 0;
+    char *end;
+
+    for (; *args && (*args)[0] == '-'; args++) {
+        if (!strcmp(*args, "-r")) {
+            raw = 1;
+        } else if (!strcmp(*args, "-u") && args[1] != 0) {
+            long n = strtol(*++args, &end, 10);
+            if (*end != 0 || n < 0 || n > INT_MAX) return usage();
+            fd = n;
+        } else {
+            return usage();
+        }
+    }
+    for (char **name = args; *name; name++) {
+        if (!valid_name(*name)) {
+            printf("read: %s: not a valid name\n", *name);
+            return 2 << 8;
+        }
+    }
+    if (l->seq[1] != 0 || l->bg) {
+        printf("read: runs in the shell, not in a pipeline nor in the background\n");
+        return 2 << 8;
+    }
+
+    struct lookahead once = {0, 0, 0, 0, -1, 0, 0}, *a = &once;
+    if (l->here != 0) {
+        fd = -1;
+        once.buf = l->here;
+        once.len = strlen(l->here);
+    } else if (l->in != 0) {
+        if ((fd = open(l->in, O_RDONLY | O_CLOEXEC)) == -1) {
+            perror("Error opening input file");
+            return 1 << 8;
+        }
+        opened = 1;
+        check_ahead(fd, a);
+    } else if (fd < MAX_FD) {
+        if (ahead[fd] == 0) {
+            ahead[fd] = xmalloc(sizeof(struct lookahead));
+            *ahead[fd] = once;
+        }
+        a = ahead[fd];
+        if (!(fd == 0 && stdin_commands)) check_ahead(fd, a);
+    } else {
+        check_ahead(fd, a);
+    }
+
+    struct line line = {0, 0, 0, 0};
+    const char *ifs = vars_get("IFS");
+    int status = read_line(fd, a, fd == 0 && stdin_commands && l->in == 0 && l->here == 0, raw, &line);
+    put(&line, 0, 0);  /* room for the NUL of the last field */
+    line.len--;
+    split(&line, *args ? args : reply, ifs ? ifs : " \t\n");
+
+    xfree(line.text);
+    xfree(line.escaped);
+    if (fd != -1 && a == &once) xfree(once.buf);
+    if (opened) close(fd);
+    return status == 0 ? 0 : 1 << 8;
+}
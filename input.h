@@ -0,0 +1,23 @@
+//
+// The read builtin: a line of input split into variables.
+//
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "cmdline.h"
+
+/* read [-r] [-u FD] [NAME ...]: read a line from the standard input, from
+   FD, or from the input file or here-document of l, and set the variables
+   NAME (REPLY if none) to its fields, split on the characters of IFS, the
+   last one taking the rest of the line. A backslash quotes the next
+   character and a backslash-newline continues the line, unless -r is given.
+   The input is read in blocks, and what comes after the line is kept for
+   the next read from the same fd when the fd cannot seek back: commands
+   run between two reads of a pipe do not see it. stdin_commands is set
+   when the shell reads its command lines from the standard input, through
+   stdio, so read takes its line from there. Returns the wait status, 1 at
+   the end of the input. */
+int input_read(struct cmdline *l, int stdin_commands);
+
+#endif //INPUT_H
@@ -0,0 +1,430 @@
+//
+// Output of background jobs: each job writes to its own pipe, drained by an
+// event thread into a buffer, and replayed once the job is complete.
+//
+// The buffer is an anonymous memory file (memfd) filled with splice(); past
+// the spill size it is copied to an unnamed temporary file (O_TMPFILE) which
+// takes the rest. A job is complete when all its commands closed the pipe.
+// Its buffer is then sent to the standard output of the shell with
+// sendfile(), after the jobs started before it when replaying in start
+// order, at once when replaying in completion order.
+//
+// In ring mode the output is not replayed: the thread keeps the last bytes
+// of each job in a ring buffer of at most the ring size, grown as needed,
+// for "jobs -o". The buffers of the last KEEP_RINGS complete jobs are kept.
+//
+// The thread polls the pipes of the jobs and a wake pipe, written when a job
+// is added. The complete jobs are replayed by a second thread, in the order
+// it is given them, so that a slow or stopped terminal does not keep the
+// first one from draining the other pipes. Both are started with the first
+// grouped job.
+//
+
+#define _GNU_SOURCE
+
+#include "jobout.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#define DEFAULT_SPILL (4 << 20)
+#define DEFAULT_RING (256 << 10)
+#define KEEP_RINGS 16
+#define MAX_SINKS 1024
+
+/* The buffer of one job */
+struct sink {
+    int id;
+    int in;         /* read end of the job's pipe, -1 once complete */
+    int buf;        /* memfd, or the temporary file once spilled */
+    size_t size;
+    int spilled;
+    int order;      /* replay order when the job started, or JOBOUT_RING */
+    char *ring;     /* JOBOUT_RING: the last bytes written, size counts all of them */
+    size_t ring_len;
+    size_t ring_max;
+    struct sink *next;  /* in start order */
+};
+
+static struct sink *sinks = 0, **sinks_tail = &sinks;
+static struct sink *replays = 0, **replays_tail = &replays;  /* complete, to replay in this order */
+static int replaying = 0;  /* the replay thread is writing sinks it took */
+static int replay_started = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;  /* a job completed or was replayed */
+static pthread_cond_t replay_ready = PTHREAD_COND_INITIALIZER;  /* replays is not empty */
+static int group = JOBOUT_OFF;
+static size_t spill_size = DEFAULT_SPILL;
+static size_t ring_size = DEFAULT_RING;
+static int wake_fds[2] = {-1, -1};
+static unsigned flushes = 0;  /* the thread does not touch what it polled if this changed */
+static pthread_t thread, replay_thread;
+
+void jobout_set_group(int order, size_t spill)
+{
+    pthread_mutex_lock(&lock);
+    group = order;
+    spill_size = spill ? spill : DEFAULT_SPILL;
+    pthread_mutex_unlock(&lock);
+}
+
+int jobout_group(void)
+{
+    return group;
+}
+
+void jobout_set_ring(size_t size)
+{
+    pthread_mutex_lock(&lock);
+    ring_size = size ? size : DEFAULT_RING;
+    pthread_mutex_unlock(&lock);
+}
+
+static void free_sink(struct sink *s)
+{
+    if (s->buf != -1) close(s->buf);
+    xfree(s->ring);
+    xfree(s);
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Send the buffer of s to the standard output of the shell */
+static void replay(struct sink *s)
+{
+    off_t off = 0;
+    char data[65536];
+
+    fflush(stdout);  /* what the shell printed before comes first */
+    while ((size_t)off < s->size) {
+        ssize_t n = sendfile(STDOUT_FILENO, s->buf, &off, s->size - off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EINVAL) {  /* output not supported by sendfile() */
+            n = pread(s->buf, data, sizeof(data), off);
+            if (n > 0 && write(STDOUT_FILENO, data, n) != n) n = -1;
+            if (n > 0) off += n;
+        }
+        if (n <= 0) break;
+    }
+}
+
+/* Give s, taken out of sinks, to the replay thread, with the lock held */
+static void queue_replay(struct sink *s)
+{
+    s->next = 0;
+    *replays_tail = s;
+    replays_tail = &s->next;
+    pthread_cond_signal(&replay_ready);
+}
+
+/* Hand the complete jobs allowed by the order of each to the replay thread,
+   with the lock held */
+static void replay_complete(void)
+{
+    struct sink **p = &sinks;
+    int blocked = 0;  /* a job started earlier is not complete */
+
+    while (*p) {
+        struct sink *s = *p;
+        if (s->order == JOBOUT_RING) {  /* never replayed */
+            p = &s->next;
+            continue;
+        }
+        if (s->in != -1 || (s->order == JOBOUT_START && blocked)) {
+            blocked = 1;
+            p = &s->next;
+            continue;
+        }
+        *p = s->next;
+        if (sinks_tail == &s->next) sinks_tail = p;
+        queue_replay(s);
+    }
+}
+
+/* Replay and free the queued sinks, out of the lock */
+static void *replay_loop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (replays == 0) pthread_cond_wait(&replay_ready, &lock);
+        struct sink *s = replays;
+        replays = 0;
+        replays_tail = &replays;
+        replaying = 1;
+        pthread_mutex_unlock(&lock);
+        while (s) {
+            struct sink *next = s->next;
+            replay(s);
+            free_sink(s);
+            s = next;
+        }
+        pthread_mutex_lock(&lock);
+        replaying = 0;
+        pthread_cond_broadcast(&changed);
+    }
+    return 0;
+}
+
+/* Free the ring buffers of the oldest complete jobs past KEEP_RINGS, with
+   the lock held */
+static void drop_old_rings(void)
+{
+    struct sink **p = &sinks;
+    int complete = 0;
+
+    for (struct sink *s = sinks; s; s = s->next)
+        complete += s->order == JOBOUT_RING && s->in == -1;
+    while (*p && complete > KEEP_RINGS) {
+        struct sink *s = *p;
+        if (s->order != JOBOUT_RING || s->in != -1) {
+            p = &s->next;
+            continue;
+        }
+        *p = s->next;
+        if (sinks_tail == &s->next) sinks_tail = p;
+        free_sink(s);
+        complete--;
+    }
+}
+
+/* Keep the last ring_max bytes of the output of s */
+static void ring_put(struct sink *s, const char *data, size_t n)
+{
+    if (n > s->ring_max) {
+        s->size += n - s->ring_max;
+        data += n - s->ring_max;
+        n = s->ring_max;
+    }
+    if (s->ring_len < s->ring_max && s->size + n > s->ring_len) {  /* not wrapped yet, grow */
+        size_t len = s->ring_len ? s->ring_len : 4096;
+        while (len < s->size + n && len < s->ring_max) len *= 2;
+        s->ring_len = len < s->ring_max ? len : s->ring_max;
+        s->ring = xrealloc(s->ring, s->ring_len);
+    }
+    size_t pos = s->size % s->ring_len, first = s->ring_len - pos < n ? s->ring_len - pos : n;
+    memcpy(s->ring + pos, data, first);
+    memcpy(s->ring, data + first, n - first);
+    s->size += n;
+}
+
+/* Past the spill size, move the buffer to a temporary file */
+static void spill(struct sink *s)
+{
+    const char *dir = getenv("TMPDIR");
+    int fd = open(dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    off_t off = 0;
+
+    if (fd == -1) return;  /* keep it in memory */
+    while ((size_t)off < s->size)
+        if (sendfile(fd, s->buf, &off, s->size - off) <= 0 && errno != EINTR) break;
+    if ((size_t)off != s->size) {
+        close(fd);
+        return;
+    }
+    close(s->buf);
+    s->buf = fd;
+    s->spilled = 1;
+}
+
+/* Move what the pipe of s holds to its buffer. Returns 0 at end of file. */
+static int drain(struct sink *s)
+{
+    char data[65536];
+
+    while (1) {
+        ssize_t n;
+        if (s->order == JOBOUT_RING) {
+            if ((n = read(s->in, data, sizeof(data))) > 0) ring_put(s, data, n);
+            if (n > 0) continue;
+            if (n == -1 && errno == EINTR) continue;
+            return n == 0 ? 0 : 1;
+        }
+        if (!s->spilled && s->size >= spill_size) spill(s);
+        n = splice(s->in, 0, s->buf, 0, sizeof(data), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EINVAL) {  /* file system without splice() */
+            n = read(s->in, data, sizeof(data));
+            if (n > 0 && write(s->buf, data, n) != n) n = -1;
+        }
+        if (n > 0) {
+            s->size += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        return n == 0 ? 0 : 1;  /* EAGAIN: empty for now. A write error drops the rest. */
+    }
+}
+
+static void *event_loop(void *arg)
+{
+    struct pollfd pfds[MAX_SINKS + 1];
+    struct sink *polled[MAX_SINKS + 1];
+    char drop[64];
+    (void)arg;
+
+    while (1) {
+        int n = 1;
+        unsigned epoch;
+
+        pthread_mutex_lock(&lock);
+        epoch = flushes;
+        pfds[0] = (struct pollfd){wake_fds[0], POLLIN, 0};
+        for (struct sink *s = sinks; s && n <= MAX_SINKS; s = s->next) {
+            if (s->in == -1) continue;
+            pfds[n] = (struct pollfd){s->in, POLLIN, 0};
+            polled[n++] = s;
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (poll(pfds, n, -1) == -1) continue;
+        if (pfds[0].revents) while (read(wake_fds[0], drop, sizeof(drop)) > 0);
+
+        pthread_mutex_lock(&lock);
+        int complete = 0;
+        for (int i = 1; i < n && epoch == flushes; i++) {
+            struct sink *s = polled[i];
+            if (!pfds[i].revents || drain(s)) continue;
+            close(s->in);
+            s->in = -1;
+            complete = 1;
+        }
+        if (complete) {
+            replay_complete();
+            drop_old_rings();
+            pthread_cond_broadcast(&changed);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return 0;
+}
+
+int jobout_open(int id)
+{
+    int pipe_fds[2];
+    struct sink *s;
+
+    pthread_mutex_lock(&lock);
+    if (!replay_started) {  /* one replay thread only, which keeps the order */
+        if (pthread_create(&replay_thread, 0, replay_loop, 0) != 0) goto fail;
+        pthread_detach(replay_thread);
+        replay_started = 1;
+    }
+    if (wake_fds[0] == -1) {
+        if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) goto fail;
+        if (pthread_create(&thread, 0, event_loop, 0) != 0) {
+            close(wake_fds[0]);
+            close(wake_fds[1]);
+            wake_fds[0] = wake_fds[1] = -1;
+            goto fail;
+        }
+        pthread_detach(thread);
+    }
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) goto fail;
+
+    s = xmalloc(sizeof(struct sink));
+    s->id = id;
+    s->in = pipe_fds[0];
+    s->buf = group == JOBOUT_RING ? -1 : memfd_create("job-output", MFD_CLOEXEC);
+    s->size = 0;
+    s->spilled = 0;
+    s->order = group;
+    s->ring = 0;
+    s->ring_len = 0;
+    s->ring_max = ring_size;
+    s->next = 0;
+    if ((s->buf == -1 && group != JOBOUT_RING) || fcntl(s->in, F_SETFL, O_NONBLOCK) == -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        free_sink(s);
+        goto fail;
+    }
+    *sinks_tail = s;
+    sinks_tail = &s->next;
+    pthread_mutex_unlock(&lock);
+
+    while (write(wake_fds[1], "", 1) == -1 && errno == EINTR);
+    return pipe_fds[1];
+
+fail:
+    pthread_mutex_unlock(&lock);
+    return -1;
+}
+
+void jobout_wait(int id)
+{
+    pthread_mutex_lock(&lock);
+    while (1) {
+        struct sink *s = sinks;
+        while (s && s->id != id) s = s->next;
+        if ((s == 0 || s->in == -1) && replays == 0 && !replaying) break;
+        pthread_cond_wait(&changed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int jobout_tail(int id, int fd)
+{
+    struct sink *s;
+    int r = -1;
+
+    pthread_mutex_lock(&lock);
+    for (s = sinks; s && (s->id != id || s->order != JOBOUT_RING); s = s->next);
+    if (s) {
+        size_t pos = s->size > s->ring_len ? s->size % s->ring_len : 0;
+        size_t len = s->size < s->ring_len ? s->size : s->ring_len;
+        r = 0;
+        if (write_all(fd, s->ring + pos, len - pos) == -1 || write_all(fd, s->ring, pos) == -1) r = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+int jobout_pending(void)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&lock);
+    for (struct sink *s = sinks; s; s = s->next) n += s->order != JOBOUT_RING;
+    for (struct sink *s = replays; s; s = s->next) n++;
+    n += replaying;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void jobout_flush(void)
+{
+    pthread_mutex_lock(&lock);
+    while (sinks) {
+        struct sink *s = sinks;
+        if (s->in != -1) {
+            drain(s);
+            close(s->in);  /* the job gets SIGPIPE if it writes more */
+        }
+        sinks = s->next;
+        if (s->order != JOBOUT_RING) queue_replay(s);
+        else free_sink(s);
+    }
+    sinks_tail = &sinks;
+    flushes++;
+    while (replays != 0 || replaying) pthread_cond_wait(&changed, &lock);
+    pthread_mutex_unlock(&lock);
+}
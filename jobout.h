@@ -0,0 +1,48 @@
+//
+// Output of background jobs: each job writes to its own pipe, drained by an
+// event thread into a buffer, and replayed once the job is complete.
+//
+
+#ifndef JOBOUT_H
+#define JOBOUT_H
+
+#include <stddef.h>
+
+/* Replay order of grouped jobs, or JOBOUT_RING to keep only their last
+   bytes */
+enum { JOBOUT_OFF, JOBOUT_START, JOBOUT_DONE, JOBOUT_RING };
+
+/* Group the output of the background jobs started from now on. With
+   JOBOUT_START the outputs are replayed in the order the jobs started, with
+   JOBOUT_DONE in the order they complete, not at all with JOBOUT_OFF (jobs
+   write straight to the terminal). Buffers bigger than spill bytes go to a
+   temporary file. With JOBOUT_RING the outputs are not replayed, the last
+   bytes of each are kept for jobout_tail(). */
+void jobout_set_group(int order, size_t spill);
+int jobout_group(void);
+
+/* Bytes kept at most for each job in ring mode, from the next job on */
+void jobout_set_ring(size_t size);
+
+/* Make the buffer of job id and return the write end of its pipe, to be
+   the standard output and error of its commands (close-on-exec, the caller
+   closes it once they are started). Returns -1 on failure. */
+int jobout_open(int id);
+
+/* Wait until every command of job id has closed its output, and the output
+   of the complete jobs was replayed */
+void jobout_wait(int id);
+
+/* Write the last bytes of the output of job id, in ring mode, to fd.
+   Returns -1 if there are none, for a job started in another mode or
+   dropped after KEEP_RINGS other jobs completed. */
+int jobout_tail(int id, int fd);
+
+/* Number of jobs whose output was not replayed yet */
+int jobout_pending(void);
+
+/* Replay what was buffered so far, complete or not, and drop the buffers,
+   before the shell exits or is replaced */
+void jobout_flush(void);
+
+#endif //JOBOUT_H
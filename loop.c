@@ -0,0 +1,215 @@
+//
+// The for and while loops of the shell.
+//
+// The lines of a loop are parsed as they are read, like any other, and the
+// copies kept are its body: an iteration runs them again without reading
+// nor parsing anything. Their variables are still references ($NAME kept
+// by the parser), so each run expands a fresh copy with the current values,
+// the variable of a for among them.
+//
+// The redirections of the "done" line are those of the whole loop: the
+// shell itself reads and writes there while it runs, so the read builtin
+// and the commands of the body share the input of done < file.
+//
+
+#include "loop.h"
+#include "shell.h"
+#include "utils.h"
+#include "vars.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A command of a body, or a loop in it */
+struct step {
+    struct cmdline *line;   /* as parsed, NULL for a loop */
+    struct loop *loop;
+};
+
+struct loop {
+    int is_for;
+    struct cmdline *head;   /* "for NAME in WORDS", or the condition of a while */
+    struct step *body;
+    size_t len;
+    struct cmdline *done;   /* the redirections of the loop, NULL if none */
+};
+
+/* Whether the first word of l is w */
+static int first_word(const struct cmdline *l, const char *w)
+{
+    return l->err == 0 && l->seq[0] != 0 && !strcmp(l->seq[0][0], w);
+}
+
+int loop_starts(const struct cmdline *l)
+{
+    return first_word(l, "for") || first_word(l, "while");
+}
+
+static int valid_name(const char *name)
+{
+    if (!isalpha((unsigned char)*name) && *name != '_') return 0;
+    while (*++name)
+        if (!isalnum((unsigned char)*name) && *name != '_') return 0;
+    return 1;
+}
+
+/* Error in the line starting a loop, or NULL */
+static const char *check_head(const struct cmdline *l)
+{
+    char **w = l->seq[0];
+
+    if (l->bg) return "a loop runs in the foreground";
+    if (!strcmp(w[0], "while")) return w[1] ? 0 : "usage: while COMMAND; do COMMANDS; done";
+    if (w[1] == 0 || !valid_name(w[1]) || w[2] == 0 || strcmp(w[2], "in") || l->seq[1] != 0 ||
+        l->in != 0 || l->out != 0 || l->here != 0)
+        return "usage: for NAME in WORDS; do COMMANDS; done";
+    return 0;
+}
+
+static void add_step(struct loop *loop, struct cmdline *line, struct loop *inner)
+{
+    loop->body = xrealloc(loop->body, (loop->len + 1) * sizeof(struct step));
+    loop->body[loop->len++] = (struct step){line, inner};
+}
+
+struct loop *loop_read(const struct cmdline *l, struct cmdline *(*next)(void))
+{
+    struct loop *loop = xmalloc(sizeof(struct loop));
+    const char *err = check_head(l);
+    int failed = err != 0, seen_do = 0;
+    struct cmdline *line;
+
+    loop->is_for = !strcmp(l->seq[0][0], "for");
+    loop->head = cmdline_copy(l);
+    loop->body = 0;
+    loop->len = 0;
+    loop->done = 0;
+    if (!loop->is_for && !failed && shift_words(loop->head, 1) != 0) {  /* the condition */
+        err = "misplaced pipe";
+        failed = 1;
+    }
+
+    while ((line = next()) != 0) {
+        if (line->err != 0) {
+            printf("error: %s\n", line->err);
+            failed = 1;
+            continue;
+        }
+        if (line->seq[0] == 0) continue;
+        if (!seen_do) {
+            seen_do = 1;
+            if (!first_word(line, "do")) {
+                if (!failed) err = "do expected";
+                failed = 1;
+            } else if (shift_words(line, 1) != 0) {  /* the first command of the body, if any */
+                if (!failed) err = "misplaced pipe";
+                failed = 1;
+                continue;
+            }
+            if (line->seq[0] == 0) continue;
+        }
+        if (first_word(line, "done")) {
+            if ((line->seq[0][1] != 0 || line->seq[1] != 0 || line->bg || line->tee_out != 0) && !failed) {
+                err = "done ends a loop alone, with its redirections";
+                failed = 1;
+            }
+            if (line->in != 0 || line->out != 0 || line->here != 0) loop->done = cmdline_copy(line);
+            break;
+        }
+        if (loop_starts(line)) {
+            struct loop *inner = loop_read(line, next);  /* it printed its error */
+            if (inner) add_step(loop, 0, inner);
+            else failed = 1;
+            continue;
+        }
+        add_step(loop, cmdline_copy(line), 0);
+    }
+    if (line == 0 && !failed) {
+        err = "missing done";
+        failed = 1;
+    }
+
+    if (!failed) return loop;
+    if (err) printf("error: %s\n", err);
+    loop_free(loop);
+    return 0;
+}
+
+/* Run a copy of line with its variables expanded */
+static int run_line(const struct cmdline *line, int (*run)(struct cmdline *l))
+{
+    struct cmdline *l = cmdline_copy(line);
+
+    cmdline_expand(l);
+    int status = run(l);
+    cmdline_free(l);
+    return status;
+}
+
+static int run_body(struct loop *loop, int (*run)(struct cmdline *l))
+{
+    int status = 0;
+
+    for (size_t k = 0; k < loop->len; k++) {
+        if (loop->body[k].loop) status = loop_run(loop->body[k].loop, run);
+        else status = run_line(loop->body[k].line, run);
+    }
+    return status;
+}
+
+static int run_loop(struct loop *loop, int (*run)(struct cmdline *l))
+{
+    int status = 0;
+
+    if (!loop->is_for) {
+        while (run_line(loop->head, run) == 0) status = run_body(loop, run);
+        return status;
+    }
+
+    /* the words are those of this run, for a loop in another one */
+    struct cmdline *head = cmdline_copy(loop->head);
+    if (cmdline_expand(head) != 0) {
+        printf("error: %s\n", head->err);
+        cmdline_free(head);
+        return 1 << 8;
+    }
+    char **words = head->seq[0];
+    for (int k = 3; words[k] != 0; k++) {
+        vars_set(words[1], words[k], 0);
+        status = run_body(loop, run);
+    }
+    cmdline_free(head);
+    return status;
+}
+
+int loop_run(struct loop *loop, int (*run)(struct cmdline *l))
+{
+    if (loop->done == 0) return run_loop(loop, run);
+
+    struct cmdline *done = cmdline_copy(loop->done);
+    int saved[2], status;
+    if (cmdline_expand(done) != 0) {
+        printf("error: %s\n", done->err);
+        status = 1 << 8;
+    } else if (redirect_shell(done, saved) == -1) {
+        status = 1 << 8;
+    } else {
+        status = run_loop(loop, run);
+        restore_shell(done, saved);
+    }
+    cmdline_free(done);
+    return status;
+}
+
+void loop_free(struct loop *loop)
+{
+    for (size_t k = 0; k < loop->len; k++) {
+        if (loop->body[k].loop) loop_free(loop->body[k].loop);
+        else cmdline_free(loop->body[k].line);
+    }
+    xfree(loop->body);
+    cmdline_free(loop->head);
+    if (loop->done) cmdline_free(loop->done);
+    xfree(loop);
+}
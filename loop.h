@@ -0,0 +1,35 @@
+//
+// The for and while loops of the shell. A loop is read once into parsed
+// commands and run from them: an iteration only expands their variables.
+//
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "cmdline.h"
+
+struct loop;
+
+/* Whether the command line l starts a loop: "for NAME in WORDS" or
+   "while COMMAND" */
+int loop_starts(const struct cmdline *l);
+
+/* Read the loop started by l, which is copied first, up to its "done". The
+   command lines after l are taken from next(), NULL at the end of the
+   input. The first one starts with "do", alone or before a command. A loop
+   in the body is read as well. The <, <<, <<< and > of the "done" are
+   those of the whole loop. Returns NULL after printing an error, once
+   every line up to the "done" is read. */
+struct loop *loop_read(const struct cmdline *l, struct cmdline *(*next)(void));
+
+/* Run the loop. Each command of its body, and the condition of a while,
+   is a copy with its variables expanded, given to run(), which may change
+   it and returns its wait status. The variable of a for is set (not
+   exported) to each word in turn. The standard input and output of the
+   shell are redirected as done asks while it runs. Returns the wait
+   status of the last command of the body run, 0 if none. */
+int loop_run(struct loop *loop, int (*run)(struct cmdline *l));
+
+void loop_free(struct loop *loop);
+
+#endif //LOOP_H
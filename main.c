@@ -1,91 +1,695 @@
+#define _GNU_SOURCE     // for memfd_create()
+
+#include <errno.h>
 #include <fcntl.h>   // For open()
 #include <limits.h>  // for INT_MAX
+#include <math.h>    // for isfinite(), timeout
+#include <pthread.h>  // for the jobs lock, shared with the server workers
+#include <signal.h>   // for kill(), timeout
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>     // for wait, several pidfds at once
 #include <string.h>
+#include <sys/mman.h>   // for memfd_create()
+#include <sys/syscall.h>  // for pidfd_open()
+#include <sys/timerfd.h>  // for timeout
 #include <sys/types.h>  // for pid_t
 #include <sys/wait.h>   // for wait()
-#include <unistd.h>     // for fork(), execvp(), dup(), dup2(), close()
+#include <time.h>       // for the timeout of wait
+#include <unistd.h>     // for fork(), execve(), dup(), dup2(), close()
 
-#include "parser.h"
+#include "fanout.h"
+#include "health.h"
+#include "input.h"
+#include "jobout.h"
+#include "loop.h"
+#include "memo.h"
+#include "cmdline.h"
+#include "cond.h"
+#include "server.h"
+#include "shell.h"
+#include "stats.h"
+#include "textcmd.h"
 #include "utils.h"
+#include "vars.h"
+#include "zygote.h"
+
+#define KILL_GRACE 2  // seconds between SIGTERM and SIGKILL for timeout
+
+int verbose = 1;  // print the parsed command line and the children, as in the original assignment
+int interactive = 1;  // 0 when running the commands of -c, no prompt and no "bye"
+static const char *script = 0;  // the commands of -c not read yet
+static int last_status = 0;  // wait status of the last foreground command, exit status with -c
+static int loop_depth = 0;   // reading or running a loop
+static int input_redirected = 0;  // standard input is a loop's < file, not the command lines
 
 //----------------------------------------PART2-------------------------------------------------
 #define MAX_JOBS 100
 
-// Structure to keep track of background jobs
+// Structure to keep track of background jobs, one entry per command of a pipeline
 struct job {
     pid_t pid;      // process ID
     char *command;  // Process command
-    int status;     // Flag to check if running or finished
+    int status;     // 1 running, 0 finished, 2 queued, 3 being started
+    int id;         // job number, the same for all the commands of a pipeline
+    int last;       // last command of its pipeline, gives the status of the job
+    int wstatus;    // wait status once finished
+    struct cmdline *queued;  // the command line of a queued pipeline, one entry for all of it
 };
 
 // Global array to store background jobs
 struct job jobs[MAX_JOBS];
 int job_count = 0;  // Track number of jobs and position in table
+int next_job_id = 1;
+pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;  // server workers share the table
+
+// Number for a new background pipeline, "%n" in wait
+int new_job_id() {
+    pthread_mutex_lock(&jobs_lock);
+    int id = next_job_id++;
+    pthread_mutex_unlock(&jobs_lock);
+    return id;
+}
+
+static int finish_job(int id);
+
+// Entries of the table, counting those the queued jobs need once started, with the lock held
+static int used_entries() {
+    int n = job_count;
+
+    for (int i = 0; i < job_count; i++)
+        if (jobs[i].status == 2) n += seq_len(jobs[i].queued) - 1;
+    return n;
+}
+
+// Make room for n more entries by reporting the oldest complete jobs, with the lock held
+static void make_room(int n) {
+    for (int i = 0; i < job_count && used_entries() + n > MAX_JOBS; i++)
+        if (jobs[i].last && finish_job(jobs[i].id) != -1) i = -1;  // the table changed, look again
+}
 
 // Add a new job to the jobs array
-void add_job(pid_t pid, char *command) {
-    if (job_count < MAX_JOBS) {
-        jobs[job_count].pid = pid;
-        jobs[job_count].command = strdup(command);
-        jobs[job_count].status = 1;  // 1 For running process
-        job_count++;
-        printf("[JOB ID = %d] Added in background list\n", pid);
+void add_job(pid_t pid, char *command, int id, int last) {
+    pthread_mutex_lock(&jobs_lock);
+    int i = job_count;
+    // the first command of a queued job takes the entry of the job
+    for (int k = 0; k < job_count && i == job_count; k++)
+        if (jobs[k].id == id && jobs[k].status == 3) i = k;
+    if (i == job_count) make_room(1);
+    if (i < MAX_JOBS) {
+        if (i < job_count) xfree(jobs[i].command);
+        jobs[i].pid = pid;
+        jobs[i].command = xstrdup(command);
+        jobs[i].status = 1;  // 1 For running process
+        jobs[i].id = id;
+        jobs[i].last = last;
+        jobs[i].wstatus = 0;
+        jobs[i].queued = 0;
+        if (i == job_count) job_count++;
+        if (verbose) printf("[JOB ID = %d] Added in background list as %%%d\n", pid, id);
     } else {
         printf("Maximum number of background jobs reached.\n");
     }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// Delete job i in array by shifting all jobs left by one position, with the lock held
+static void remove_job(int i) {
+    // free memory for command string
+    xfree(jobs[i].command);
+    if (jobs[i].queued) cmdline_free(jobs[i].queued);
+    for (int j = i; j < job_count - 1; j++) {
+        jobs[j] = jobs[j + 1];
+    }
+    job_count--;
 }
 
 // Update job statuses and display them
 void print_jobs() {
+    pthread_mutex_lock(&jobs_lock);
     printf("------------------Background jobs------------------\n");
     for (int i = 0; i < job_count; i++) {
         // Check if job finished before printing
         //  Waitpid options: WNOHANG makes call non blocking, return if process not finished
         int status;
-        pid_t result = waitpid(jobs[i].pid, &status, WNOHANG);
+        if (jobs[i].status >= 2) {
+            printf("[%d] Queued: %s\n", jobs[i].id, jobs[i].command);
+            continue;
+        }
+        pid_t result = jobs[i].status ? wait_child(jobs[i].pid, &status, WNOHANG) : jobs[i].pid;
         if (result == 0) {
             // Job still running
-            printf("[JOB ID = %d] Running: %s\n", jobs[i].pid, jobs[i].command);
+            printf("[%d] [JOB ID = %d] Running: %s\n", jobs[i].id, jobs[i].pid, jobs[i].command);
         } else if (result == jobs[i].pid) {
             // Job has finished
             jobs[i].status = 0;
-            printf("[JOB ID = %d] Finished: %s\n", jobs[i].pid, jobs[i].command);
+            printf("[%d] [JOB ID = %d] Finished: %s\n", jobs[i].id, jobs[i].pid, jobs[i].command);
+
+            // Decrease job count, and look at the job shifted into slot i
+            remove_job(i);
+            i--;
+
+        } else if (result == -1) {
+            perror("Check of job status failed");
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// Collect the commands of background jobs that exited, so none is left a
+// zombie. The jobs are reported by jobs or wait, or when the table is full.
+void reap_jobs(void) {
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < job_count; i++) {
+        int status;
+        if (jobs[i].status == 1 && wait_child(jobs[i].pid, &status, WNOHANG) == jobs[i].pid) {
+            jobs[i].status = 0;
+            jobs[i].wstatus = status;
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+// jobs -o %n: print the end of the output of job n, kept in ring mode
+int job_output(char **args) {
+    char *end;
+    long id = args[0] && args[1] && !args[2] && args[1][0] == '%' ? strtol(args[1] + 1, &end, 10) : 0;
+
+    if (strcmp(args[0], "-o") || id <= 0 || *end != 0) {
+        printf("usage: jobs [-o %%n]\n");
+        return 2 << 8;
+    }
+    fflush(stdout);
+    if (jobout_tail(id, STDOUT_FILENO) == -1) {
+        printf("jobs: no output kept for %%%ld (set group ring)\n", id);
+        return 1 << 8;
+    }
+    return 0;
+}
+
+// Exit code of a wait status, as a shell reports it
+int exit_code(int wstatus) {
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+}
+
+// Report job id and remove it if all its commands are finished, with the lock held.
+// Returns the wait status of its last command, or -1 if it is still running.
+static int finish_job(int id) {
+    int wstatus = -1;
+
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].id != id) continue;
+        if (jobs[i].status) return -1;
+        if (jobs[i].last || wstatus == -1) wstatus = jobs[i].wstatus;
+    }
+    if (wstatus == -1) return -1;  // no such job
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].id != id) continue;
+        if (jobs[i].last) printf("[%d] Done (%d): %s\n", id, exit_code(wstatus), jobs[i].command);
+        remove_job(i);
+        i--;
+    }
+    return wstatus;
+}
+
+static int pidfd_open(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+//----------------------------------------ADMISSION------------------------------------------
+// With set maxjobs or set maxload, a background pipeline started while the
+// limit is reached is queued in the job table, status 2, with a copy of its
+// command line. A thread starts the queued jobs in order as the running ones
+// exit, watched through pidfds, or as the load average drops, looked at
+// every second.
+
+static int max_jobs = 0;        // background jobs running at once, 0 for no limit
+static double max_load = 0;     // no job starts above this 1 minute load average, 0 for no limit
+static int admit_wake[2] = {-1, -1};  // wakes the admission thread
+
+// Number of jobs running or being started, with the lock held
+static int running_jobs() {
+    int n = 0;
+
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].status != 1 && jobs[i].status != 3) continue;
+        int seen = 0;  // another command of the same job, counted already
+        for (int j = 0; j < i && !seen; j++) seen = jobs[j].id == jobs[i].id && (jobs[j].status & 1);
+        n += !seen;
+    }
+    return n;
+}
+
+// Number of jobs queued or being started, with the lock held
+static int queued_count() {
+    int n = 0;
+
+    for (int i = 0; i < job_count; i++) n += jobs[i].status >= 2;
+    return n;
+}
+
+// Whether a job may start now, with the lock held
+static int may_start() {
+    double load;
 
-            // free memory for command string
-            free(jobs[i].command);
+    if (max_jobs > 0 && running_jobs() >= max_jobs) return 0;
+    return max_load <= 0 || getloadavg(&load, 1) != 1 || load < max_load;
+}
+
+// Start the queued jobs, oldest first, while the limits allow it
+static void start_queued() {
+    while (1) {
+        struct cmdline *l = 0;
+        int id = 0;
 
-            // Delete job in array by shifting all jobs left by one position
-            for (int j = i; j < job_count; j++) {
-                jobs[j] = jobs[j + 1];
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < job_count; i++) {
+            if (jobs[i].status != 2) continue;
+            if (may_start()) {
+                l = jobs[i].queued;
+                id = jobs[i].id;
+                jobs[i].queued = 0;
+                jobs[i].status = 3;  // counts as running until its commands are added
             }
+            break;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        if (l == 0) return;
 
-            // Decrease job count
-            job_count--;
+        pid_t *pids = xmalloc(seq_len(l) * sizeof(pid_t));
+        launch_pipeline(l, 0, pids, 0, id);
+        xfree(pids);
+        cmdline_free(l);
 
-        } else if (result == -1) {
-            perror("Check of job status failed");
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < job_count; i++) {
+            if (jobs[i].id != id || jobs[i].status != 3) continue;
+            remove_job(i);
+            break;
         }
+        pthread_mutex_unlock(&jobs_lock);
+    }
+}
+
+static void *admission_loop(void *arg) {
+    (void)arg;
+    while (1) {
+        struct pollfd pfds[MAX_JOBS + 1];
+        int n = 1, queued = 0;
+        char drop[64];
+
+        reap_jobs();
+        start_queued();
+
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < job_count && !queued; i++) queued = jobs[i].status == 2;
+        for (int i = 0; i < job_count && queued; i++)
+            if (jobs[i].status == 1 && (pfds[n].fd = pidfd_open(jobs[i].pid)) != -1) pfds[n++].events = POLLIN;
+        pthread_mutex_unlock(&jobs_lock);
+
+        // woken by a new queued job or a new limit, else a job exiting; a
+        // command reaped by another thread before its pidfd was opened is
+        // seen at the next second
+        pfds[0].fd = admit_wake[0];
+        pfds[0].events = POLLIN;
+        if (poll(pfds, n, queued ? 1000 : -1) > 0 && pfds[0].revents)
+            while (read(admit_wake[0], drop, sizeof(drop)) > 0);
+        for (int k = 1; k < n; k++) close(pfds[k].fd);
     }
+    return 0;
+}
+
+// Wait for a running background job to exit, with the lock held (released
+// meanwhile), then reap the jobs and start the queued ones that may start.
+// A command reaped by another thread before its pidfd was opened, or a job
+// waiting for the load to fall, is seen at the next second.
+static void wait_job_exit() {
+    struct pollfd pfds[MAX_JOBS];
+    int n = 0;
+
+    for (int i = 0; i < job_count; i++)
+        if (jobs[i].status == 1 && (pfds[n].fd = pidfd_open(jobs[i].pid)) != -1) pfds[n++].events = POLLIN;
+    pthread_mutex_unlock(&jobs_lock);
+    poll(pfds, n, 1000);
+    for (int k = 0; k < n; k++) close(pfds[k].fd);
+    reap_jobs();
+    start_queued();
+    pthread_mutex_lock(&jobs_lock);
+}
+
+static void admission_wake() {
+    if (admit_wake[1] != -1)
+        while (write(admit_wake[1], "", 1) == -1 && errno == EINTR);
+}
+
+// Queue the background pipeline l if the limits are reached, or if jobs
+// queued before it wait. Returns 0 if it may start now, 1 if it was queued
+// or refused because the job table is full.
+int queue_job(struct cmdline *l) {
+    int n = seq_len(l);
+    pthread_t thread;
+
+    pthread_mutex_lock(&jobs_lock);
+    make_room(n);
+    // full with limits set: the jobs in it start in turn, wait until one is done
+    while (used_entries() + n > MAX_JOBS && (queued_count() > 0 || ((max_jobs > 0 || max_load > 0) && running_jobs() > 0))) {
+        wait_job_exit();
+        make_room(n);
+    }
+    if (used_entries() + n > MAX_JOBS) {
+        pthread_mutex_unlock(&jobs_lock);
+        printf("Maximum number of background jobs reached.\n");
+        return 1;
+    }
+    if (queued_count() == 0 && may_start()) {
+        pthread_mutex_unlock(&jobs_lock);
+        return 0;
+    }
+    if (admit_wake[0] == -1) {  // the first queued job starts the thread
+        if (pipe2(admit_wake, O_CLOEXEC | O_NONBLOCK) == -1 ||
+            pthread_create(&thread, 0, admission_loop, 0) != 0) {
+            if (admit_wake[0] != -1) {
+                close(admit_wake[0]);
+                close(admit_wake[1]);
+            }
+            admit_wake[0] = admit_wake[1] = -1;
+            pthread_mutex_unlock(&jobs_lock);
+            perror("Error starting job admission, not queued");
+            return 0;
+        }
+        pthread_detach(thread);
+    }
+    jobs[job_count].pid = 0;
+    jobs[job_count].command = xstrdup(l->seq[0][0]);
+    jobs[job_count].status = 2;
+    jobs[job_count].id = next_job_id++;
+    jobs[job_count].last = 1;
+    jobs[job_count].wstatus = 0;
+    jobs[job_count].queued = cmdline_copy(l);
+    if (verbose) printf("[%d] Queued in background list\n", jobs[job_count].id);
+    job_count++;
+    pthread_mutex_unlock(&jobs_lock);
+    admission_wake();
+    return 1;
+}
+
+// Number of jobs queued and not started yet
+int queued_jobs() {
+    pthread_mutex_lock(&jobs_lock);
+    int n = queued_count();
+    pthread_mutex_unlock(&jobs_lock);
+    return n;
+}
+
+/* set NAME VALUE: change a shell option, set alone lists them.
+       group start|done|off   buffer the output of each background job and
+                              replay it in start or completion order
+       group ring             keep the end of the output of each background
+                              job, for jobs -o
+       spill BYTES            size of a job buffer kept in memory
+       ring BYTES             size of the end kept in ring mode
+       health N               commands per window of the health builtin
+       maxjobs N              background jobs running at once, the next
+                              ones are queued (0 for no limit)
+       maxload X              queue background jobs while the 1 minute
+                              load average is above X (0 for no limit)
+       memodir PATH           cache directory of memo
+       memosize BYTES         size of that cache, the least recently used
+                              outputs are removed beyond it
+       statsfile PATH|none    add the latency histograms of PATH to those of
+                              the stats builtin, and save them there on exit */
+int set_option(char *args) {
+    static const char *orders[] = {"off", "start", "done", "ring"};
+    static size_t spill = 0, ring = 0;
+    char *save, *name = strtok_r(args, " \t", &save), *value = strtok_r(0, " \t", &save), *end;
+
+    if (name == 0) {
+        printf("group %s\n", orders[jobout_group()]);
+        if (spill) printf("spill %zu\n", spill);
+        else printf("spill default\n");
+        if (ring) printf("ring %zu\n", ring);
+        else printf("ring default\n");
+        printf("health %u\n", health_window());
+        printf("maxjobs %d\n", max_jobs);
+        printf("maxload %g\n", max_load);
+        printf("memodir %s\n", memo_dir());
+        printf("memosize %llu\n", memo_limit());
+        printf("statsfile %s\n", stats_file() ? stats_file() : "none");
+        return 0;
+    }
+    if (value != 0 && !strcmp(name, "group")) {
+        for (int k = 0; k < 4; k++) {
+            if (strcmp(value, orders[k])) continue;
+            jobout_set_group(k, spill);
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "spill")) {
+        unsigned long long bytes = strtoull(value, &end, 10);
+        if (end != value && *end == 0) {
+            spill = bytes;
+            jobout_set_group(jobout_group(), spill);
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "ring")) {
+        unsigned long long bytes = strtoull(value, &end, 10);
+        if (end != value && *end == 0) {
+            ring = bytes;
+            jobout_set_ring(ring);
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "health")) {
+        unsigned long n = strtoul(value, &end, 10);
+        if (end != value && *end == 0 && n > 0 && n <= 1000000) {
+            health_set_window(n);
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "maxjobs")) {
+        long n = strtol(value, &end, 10);
+        if (end != value && *end == 0 && n >= 0 && n <= MAX_JOBS) {
+            pthread_mutex_lock(&jobs_lock);
+            max_jobs = n;
+            pthread_mutex_unlock(&jobs_lock);
+            admission_wake();  // a higher limit starts queued jobs now
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "maxload")) {
+        double load = strtod(value, &end);
+        if (end != value && *end == 0 && load >= 0) {
+            pthread_mutex_lock(&jobs_lock);
+            max_load = load;
+            pthread_mutex_unlock(&jobs_lock);
+            admission_wake();
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "memodir")) {
+        memo_set_dir(value);
+        return 0;
+    } else if (value != 0 && !strcmp(name, "memosize")) {
+        unsigned long long bytes = strtoull(value, &end, 10);
+        if (end != value && *end == 0) {
+            memo_set_limit(bytes);
+            return 0;
+        }
+    } else if (value != 0 && !strcmp(name, "statsfile")) {
+        stats_set_file(strcmp(value, "none") ? value : 0);
+        return 0;
+    }
+    printf("usage: set [group start|done|ring|off] [spill BYTES] [ring BYTES] [health N]\n"
+           "           [maxjobs N] [maxload X] [memodir PATH] [memosize BYTES] [statsfile PATH|none]\n");
+    return 2 << 8;
+}
+
+/* export [NAME[=VALUE] ...]: set and export variables, for the commands
+   started from now on. Without arguments, list the exported variables. */
+int export_vars(char **args) {
+    int status = 0;
+
+    if (args[0] == 0) {
+        struct env *env = vars_env();
+        for (size_t k = 0; k < env->count; k++) printf("export %s\n", env->envp[k]);
+        vars_release(env);
+        return 0;
+    }
+    for (; *args; args++) {
+        char *eq = strchr(*args, '=');
+        if (eq) *eq = 0;
+        if (vars_set(*args, eq ? eq + 1 : 0, 1) == -1) {
+            printf("export: %s: not a valid name\n", *args);
+            status = 1 << 8;
+        }
+        if (eq) *eq = '=';
+    }
+    return status;
+}
+
+/* wait [-n] [-t SECONDS] [%n ...]: wait until the given background jobs (all
+   of them by default) are complete, or only the first of them with -n, or
+   give up after SECONDS. Each complete job is reported with its exit code.
+   All the commands are watched at once through pidfds in a single poll(), so
+   the shell sleeps until one exits, whether the shell or the zygote started
+   it. Returns the wait status of the last complete job, 124 on timeout. */
+int wait_jobs(char *args) {
+    int ids[MAX_JOBS], nids = 0, any = 0, result = 0;
+    double timeout = -1;
+    struct timespec now, deadline;
+    char *save, *arg;
+
+    for (arg = strtok_r(args, " \t", &save); arg; arg = strtok_r(0, " \t", &save)) {
+        char *end;
+        if (!strcmp(arg, "-n")) {
+            any = 1;
+        } else if (!strcmp(arg, "-t") && (arg = strtok_r(0, " \t", &save)) != 0 &&
+                   (timeout = strtod(arg, &end)) >= 0 && *end == 0) {
+            continue;
+        } else if (arg[0] == '%' && nids < MAX_JOBS && (ids[nids] = strtol(arg + 1, &end, 10)) > 0 && *end == 0) {
+            nids++;
+        } else {
+            printf("usage: wait [-n] [-t SECONDS] [%%n ...]\n");
+            return 2 << 8;
+        }
+    }
+
+    // every job given must exist now
+    pthread_mutex_lock(&jobs_lock);
+    for (int k = 0; k < nids; k++) {
+        int found = 0;
+        for (int i = 0; i < job_count && !found; i++) found = jobs[i].id == ids[k];
+        if (!found) {
+            printf("wait: no such job %%%d\n", ids[k]);
+            ids[k--] = ids[--nids];
+            result = 127 << 8;
+        }
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    if (result != 0 && nids == 0) return result;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)timeout;
+    deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (1) {
+        struct pollfd pfds[MAX_JOBS];
+        pid_t pids[MAX_JOBS];
+        int complete[MAX_JOBS];
+        int n = 0, ms = -1, done = 0, ncomplete = 0, queued = 0;
+
+        // the commands still running in the jobs waited for, after the
+        // jobs already complete (collected by reap_jobs()) are reported
+        pthread_mutex_lock(&jobs_lock);
+        for (int i = 0; i < job_count; i++) {
+            int wanted = nids == 0, wstatus;
+            for (int k = 0; k < nids && !wanted; k++) wanted = jobs[i].id == ids[k];
+            if (!wanted) continue;
+            if (jobs[i].status == 1) {
+                pids[n++] = jobs[i].pid;
+            } else if (jobs[i].status) {
+                queued++;
+            } else if (jobs[i].last && (wstatus = finish_job(complete[ncomplete] = jobs[i].id)) != -1) {
+                result = wstatus;
+                done = 1;
+                ncomplete++;
+                i = -1;  // the table changed, look again
+                n = queued = 0;
+            }
+        }
+        pthread_mutex_unlock(&jobs_lock);
+        for (int k = 0; k < ncomplete; k++) jobout_wait(complete[k]);
+        if ((n == 0 && queued == 0) || (any && done)) break;
+
+        for (int k = 0; k < n; k++) {
+            pfds[k].fd = pidfd_open(pids[k]);
+            pfds[k].events = POLLIN;
+            pfds[k].revents = pfds[k].fd == -1 ? POLLIN : 0;  // no pidfd, wait for it below
+        }
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (ms < 0) ms = 0;
+        }
+        // a queued job has no pid yet, look again once it may have started
+        int expired = ms != -1 && (!queued || ms <= 100);
+        if (queued && (ms == -1 || ms > 100)) ms = 100;
+        int ready = 0;
+        for (int k = 0; k < n; k++) ready |= pfds[k].revents != 0;
+        if (!ready && poll(pfds, n, ms) == 0 && expired) {
+            for (int k = 0; k < n; k++) close(pfds[k].fd);
+            printf("wait: timed out\n");
+            return 124 << 8;
+        }
+
+        for (int k = 0; k < n; k++) {
+            int wstatus;
+            if (pfds[k].fd != -1) close(pfds[k].fd);
+            if (pfds[k].revents == 0 || wait_child(pids[k], &wstatus, 0) != pids[k]) continue;
+
+            int id = 0;
+            pthread_mutex_lock(&jobs_lock);
+            for (int i = 0; i < job_count; i++) {
+                if (jobs[i].pid != pids[k] || jobs[i].status != 1) continue;
+                jobs[i].status = 0;
+                jobs[i].wstatus = wstatus;
+                id = jobs[i].id;
+                if ((wstatus = finish_job(id)) != -1) {
+                    result = wstatus;
+                    done = 1;
+                } else {
+                    id = 0;
+                }
+                break;
+            }
+            pthread_mutex_unlock(&jobs_lock);
+            if (id != 0) jobout_wait(id);  // its buffered output is complete too
+        }
+        if (any && done) break;
+    }
+    return result;
 }
 
 //-------------------------------------------------------------------------------------------
 
-void terminate(char *line) {
-    if (line) free(line);  // release memory allocated to line pointer
-    printf("bye\n");
-    exit(0);
+void terminate(void) {
+    int queued = queued_jobs();
+    if (queued > 0) printf("%d queued background jobs not started\n", queued);
+    jobout_flush();  // grouped output of the jobs still running
+    stats_exit();
+    if (interactive) {
+        printf("bye\n");
+        exit(0);
+    }
+    exit(exit_code(last_status));
+}
+
+/* Next line of the -c commands, or NULL after the last one */
+static char *script_line(void) {
+    if (*script == 0) return NULL;
+    size_t n = strcspn(script, "\n");
+    char *buf = xmalloc(n + 1);
+    memcpy(buf, script, n);
+    buf[n] = 0;
+    script += script[n] ? n + 1 : n;
+    return buf;
 }
 
-/* Read a line from standard input and put it in a char[] */
+/* Whether the line just read is the last command of -c */
+static int script_done(void) {
+    return script != 0 && script[strspn(script, " \t\n;")] == 0 && !readcmd_buffered();
+}
+
+/* Read a line from standard input (or from -c) and put it in a char[] */
 char *readline(const char *prompt) {
     size_t buf_len = 16;
+
+    if (script) return script_line();
     char *buf = xmalloc(buf_len * sizeof(char));
 
     printf("%s", prompt);
     if (fgets(buf, buf_len, stdin) == NULL) {
-        free(buf);
+        xfree(buf);
         return NULL;
     }
 
@@ -103,145 +707,798 @@ char *readline(const char *prompt) {
     } while (1);
 }
 
-int main(void) {
-    while (1) {
-        struct cmdline *l;
-        char *line = 0;
-        int i, j;
-        char *prompt = "\nmyshell>";
-
-        /* Readline use some internal memory structure that
-        can not be cleaned at the end of the program. Thus one memory
-        leak per command seems unavoidable*/
-        line = readline(prompt);
-        if (line == 0 || !strncmp(line, "exit", 4)) {
-            terminate(line);
-        } else if (!strncmp(line, "jobs", 4)) {
-            print_jobs();  // PART 2: Print list of bg jobs  when "jobs" command is entered
+/* Value of variable name for the parser, $? being the exit code of the last command */
+static const char *variable(const char *name) {
+    static char status[16];
+
+    if (strcmp(name, "?")) return vars_get(name);
+    snprintf(status, sizeof(status), "%d", exit_code(last_status));
+    return status;
+}
+
+/* Input of readcmd(): the next line of -c, or what fgets() gives, after
+   the prompt when a line starts ("> " when it continues a command line) */
+static size_t read_input(char *buf, size_t size, int more) {
+    static int line_start = 1, eof = 0;
+    size_t n;
+
+    if (script) {
+        n = strcspn(script, "\n");
+        if (script[n]) n++;
+        if (n > size) n = size;
+        memcpy(buf, script, n);
+        script += n;
+        return n;
+    }
+    if (eof) return 0;
+    if (line_start) printf("%s", more || loop_depth ? "> " : "\nmyshell>");
+    if (fgets(buf, size, stdin) == NULL) {
+        eof = 1;
+        return 0;
+    }
+    n = strlen(buf);
+    line_start = n > 0 && buf[n - 1] == '\n';
+    return n;
+}
+
+/* The arguments of a builtin as one string, for the builtins parsing it */
+static char *join_words(char **words) {
+    size_t len = 1;
+    for (int k = 0; words[k]; k++) len += strlen(words[k]) + 1;
+
+    char *args = xmalloc(len), *p = args;
+    for (int k = 0; words[k]; k++) p += sprintf(p, " %s", words[k]);
+    *p = 0;
+    return args;
+}
+
+/* Read the lines of a here-document up to its delimiter into l->here */
+void read_here_document(struct cmdline *l) {
+    size_t len = 0;
+    char *body = xmalloc(1);
+    char *line;
+
+    body[0] = 0;
+    while ((line = readline("> ")) != NULL && strcmp(line, l->here_end) != 0) {
+        size_t n = strlen(line);
+        body = xrealloc(body, len + n + 2);
+        memcpy(body + len, line, n);
+        body[len + n] = '\n';
+        len += n + 1;
+        body[len] = 0;
+        xfree(line);
+    }
+    if (line) xfree(line);
+    l->here = body;
+}
+
+/* Next command line of a loop being read, with its here-document */
+static struct cmdline *loop_line(void) {
+    struct cmdline *l = readcmd(read_input);
+
+    if (l != 0 && l->err == 0 && l->here_end != 0) read_here_document(l);
+    return l;
+}
+
+/* Put text in a sealed anonymous memory file and return it open at offset 0,
+   so here-documents never touch the filesystem nor need a writer process */
+int here_fd(const char *text) {
+    size_t len = strlen(text);
+    int fd = memfd_create("here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) return -1;
+
+    while (len > 0) {
+        ssize_t n = write(fd, text, len);
+        if (n == -1) {
+            close(fd);
+            return -1;
+        }
+        text += n;
+        len -= n;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+        lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//------------------------------------------------------PART 1 to 5 -----------------------------------
+
+int redirect_shell(const struct cmdline *l, int *saved) {
+    int in = -1, out = -1;
+
+    saved[STDIN_FILENO] = saved[STDOUT_FILENO] = -1;
+    if (l->here != 0 && (in = here_fd(l->here)) == -1) {
+        perror("Error creating here-document");
+        return -1;
+    }
+    if (l->in != 0 && (in = open(l->in, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("Error opening input file");
+        return -1;
+    }
+    if (l->out != 0 && (out = open(l->out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        perror("Error opening output file");
+        if (in != -1) close(in);
+        return -1;
+    }
+
+    fflush(stdout);  // what the shell printed goes to the old output
+    if (in != -1) {
+        saved[STDIN_FILENO] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(in, STDIN_FILENO);
+        close(in);
+        input_redirected++;
+    }
+    if (out != -1) {
+        saved[STDOUT_FILENO] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    return 0;
+}
+
+void restore_shell(const struct cmdline *l, const int *saved) {
+    fflush(stdout);
+    for (int k = 0; k < 2; k++) {
+        if (k == STDIN_FILENO ? l->in == 0 && l->here == 0 : l->out == 0) continue;
+        if (saved[k] == -1) {
+            close(k);  // it was closed before
             continue;
+        }
+        dup2(saved[k], k);
+        close(saved[k]);
+    }
+    if (l->in != 0 || l->here != 0) input_redirected--;
+}
+
+/* Redirect the standard input and output of the shell itself as asked by l,
+   then replace the shell by the command of l. With no command (exec > file)
+   the redirections stay for the rest of the session. Returns if there is no
+   command or if it could not be executed, the redirections are then undone. */
+void exec_command(struct cmdline *l) {
+    int saved[2];
+
+    if (l->seq[0] != 0 && (l->seq[1] != 0 || l->bg || l->tee_out != 0)) {
+        printf("error: exec only runs a simple command\n");
+        return;
+    }
+    if (redirect_shell(l, saved) == -1) {
+        last_status = (l->seq[0] != 0 ? 127 : EXIT_FAILURE) << 8;
+        return;
+    }
+
+    if (l->seq[0] == 0) {
+        for (int k = 0; k < 2; k++)
+            if (saved[k] != -1) close(saved[k]);
+        if (l->in != 0 || l->here != 0) input_redirected--;  // the command lines come from it now
+        last_status = 0;
+        return;
+    }
+    jobout_flush();
+    if (textcmd_supported(l->seq[0])) exit(textcmd_run(l->seq[0]));
+    char path[PATH_MAX];
+    struct env *env = vars_env();
+    vars_exec(vars_resolve(l->seq[0][0], path, sizeof(path)) == 0 ? path : 0, l->seq[0], env->envp);
+    perror("exec failed");
+    vars_release(env);
+
+    restore_shell(l, saved);
+    last_status = 127 << 8;
+}
+
+/* Start one command with the given standard input, output and error (-1
+   keeps the shell's own), in process group pgid (0 for a new one, -1 for
+   the shell's). Through the zygote when there is one, so the cost does not
+   depend on the size of the shell; otherwise fork and exec here. A text
+   builtin (wc -l, grep -F, head -n) is forked here and runs without exec. */
+pid_t spawn_command(char **command, const int *stage_fds, pid_t pgid) {
+    int builtin = textcmd_supported(command);  // runs in the child, without exec
+    if (zygote_active() && !builtin) {
+        int own[3];  // the zygote has the fds of the shell at startup, not those of exec > file or a loop
+        for (int k = 0; k < 3; k++) own[k] = stage_fds[k] != -1 || fcntl(k, F_GETFD) == -1 ? stage_fds[k] : k;
+        pid_t pid = zygote_spawn(command, own, pgid);
+        if (pid > 0) return pid;
+    }
+
+    // resolved and built before the fork, from the caches most of the time
+    char path[PATH_MAX];
+    int found = builtin ? -1 : vars_resolve(command[0], path, sizeof(path));
+    struct env *env = vars_env();
+
+    fflush(stdout);  // the child must not inherit (and flush again) our pending output
+    pid_t pid = fork();
+    if (pid == 0) {  // In Child process
+        if (pgid != -1) setpgid(0, pgid);
+        for (int k = 0; k < 3; k++) {
+            if (stage_fds[k] == -1) continue;
+            if (stage_fds[k] == k) fcntl(k, F_SETFD, 0);  // already in place, keep it open at exec
+            else if (dup2(stage_fds[k], k) == -1) {
+                child_error("Error redirecting input or output");  // no stdio: other threads may hold its locks
+                _exit(EXIT_FAILURE);
+            }
+        }
+        close_range(3, ~0U, 0);  // nothing but 0, 1 and 2, even fds the shell inherited without close-on-exec
+        if (builtin) _exit(textcmd_run(command));
+        // PART1: Execute the command and return error if failed
+        vars_exec(found == 0 ? path : 0, command, env->envp);
+        child_error("execvp failed");
+        _exit(EXIT_FAILURE);
+    } else if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    vars_release(env);
+    if (pgid != -1) setpgid(pid, pgid ? pgid : pid);  // also here, the group exists before we signal it
+    return pid;
+}
+
+/* waitpid() for a command, whether the shell or the zygote started it */
+pid_t wait_child(pid_t pid, int *status, int options) {
+    if (zygote_owns(pid)) return zygote_wait(pid, status, options);
+    return waitpid(pid, status, options);
+}
+
+/* Open the outputs of the producer of a fan-out: its output files, then one
+   pipe per branch, whose read end is left in branch_in. Returns the number
+   of fds put in targets, and sets *failed if an output file could not be
+   opened. */
+static int open_fanout_targets(struct cmdline *l, int nbranch, int *targets, int *branch_in,
+                               int *failed) {
+    int n = 0;
+    int pipe_fds[2];
+
+    for (int k = -1; k == -1 || (l->tee_out && l->tee_out[k] != 0); k++) {
+        char *name = k == -1 ? l->out : l->tee_out[k];
+        if (name == 0) continue;
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror("Error opening output file");
+            *failed = 1;
         } else {
-            l = parsecmd(&line);
-            if (l == 0) {
-                terminate(0);
-            } else if (l->err != 0) {
-                printf("error: %s\n", l->err);
-                continue;
-            } else {
-                // Print input and output redirections if specified
-                if (l->in != 0) printf("in: %s\n", l->in);
-                if (l->out != 0) printf("out: %s\n", l->out);
-                printf("bg: %d\n", l->bg);
+            targets[n++] = fd;
+        }
+    }
+    for (int b = 0; b < nbranch; b++) {
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            exit(EXIT_FAILURE);
+        }
+        branch_in[b] = pipe_fds[0];
+        targets[n++] = pipe_fds[1];
+    }
+    return n;
+}
 
-// ---------------------------------------------------PART 4-5----------------------------------------
+/* Start every command of l, each one reading the output of the previous one
+   through a pipe. fds replaces, when not 0 and for the entries that are not
+   -1, the standard input of the first command, the standard output of the
+   last one and the standard error of all of them. The pids of the started
+   commands are stored in pids (one per command, -1 if its redirection
+   failed) and their number is returned.
+   Every fd is prepared here in the parent and is close-on-exec, the child
+   only moves them to 0, 1 and 2. The producer of a fan-out writes to a pipe
+   copied by fanout_start() to its output files and to one pipe per branch;
+   the branches write to the standard output of the pipeline. With group,
+   the commands are put in a new process group led by the first one. A
+   background pipeline is job job_id, a new one when it is 0. */
+int launch_pipeline(struct cmdline *l, const int *fds, pid_t *pids, int group, int job_id) {
+    int i, j;
 
-                /*To hold pipe file descriptors:
-                        pipe_fds[0]:  Read part of pipe
-                        pipe_fds[1]: Write part of pipe*/
-                int pipe_fds[2];
-                int prev_cmd = -1;  // Previous read end for chaining pipes
-                                    // Initialized at -1 bcs first command don't have previous
+    /*To hold pipe file descriptors:
+            pipe_fds[0]:  Read part of pipe
+            pipe_fds[1]: Write part of pipe*/
+    int pipe_fds[2];
+    int prev_cmd = -1;  // Previous read end for chaining pipes
+                        // Initialized at -1 bcs first command don't have previous
 
-//------------------------------------------------------PART 1 to 5 -----------------------------------
+    // FAN-OUT: commands from nmain on are branches, the output of seq[nmain - 1] is copied
+    int n = seq_len(l);
+    int nmain = l->fanout ? l->fanout : n;
+    int nbranch = n - nmain;
+    int split = nbranch > 0 || l->tee_out != 0;
+    int ntee = 0;
+    while (l->tee_out && l->tee_out[ntee] != 0) ntee++;
+    int *targets = split ? xmalloc((1 + ntee + nbranch) * sizeof(int)) : 0;
+    int *branch_in = nbranch ? xmalloc(nbranch * sizeof(int)) : 0;
+    int ntargets = 0, fan_pipe[2] = {-1, -1};
+    if (l->bg && job_id == 0) job_id = new_job_id();
+    pid_t pgid = group ? 0 : -1;  // 0 until the first command leads the new group
+
+    // PART 3: HERE-DOCUMENT OR HERE-STRING, one memory file read by the first command
+    int fd_here = -1;
+    if (l->here != 0 && (fd_here = here_fd(l->here)) == -1) {
+        perror("Error creating here-document");
+        xfree(targets);
+        xfree(branch_in);
+        return 0;
+    }
 
-                // loop through each command in sequence and print it once
-                for (i = 0; l->seq[i] != 0; i++) {
-                    char **command = l->seq[i];
-                    // Print sequence
-                    printf("seq[%d]: ", i);
-                    for (j = 0; command[j] != 0; j++) {
-                        printf("'%s' ", command[j]);
-                    }
-                    printf("\n");
-                    printf("PARENT ID = %d\n", (int)getppid());
+    // GROUPED OUTPUT: a background job writes to its own buffer, replayed once it is complete
+    int job_fds[3] = {-1, -1, -1};
+    if (l->bg && fds == 0 && jobout_group() != JOBOUT_OFF &&
+        (job_fds[STDOUT_FILENO] = jobout_open(job_id)) != -1) {
+        job_fds[STDERR_FILENO] = job_fds[STDOUT_FILENO];
+        fds = job_fds;
+    }
+
+    // loop through each command in sequence and print it once
+    for (i = 0; l->seq[i] != 0; i++) {
+        char **command = l->seq[i];
+        int branch = i >= nmain;
+        int last = i == nmain - 1;  // last of the pipeline, the producer of a fan-out
+        int stage_fds[3] = {-1, -1, fds ? fds[STDERR_FILENO] : -1};
+        int fd_in = -1, fd_out = -1, failed = 0;
+
+        // Print sequence
+        if (verbose) {
+            printf("seq[%d]: ", i);
+            for (j = 0; command[j] != 0; j++) {
+                printf("'%s' ", command[j]);
+            }
+            printf("\n");
+            printf("PARENT ID = %d\n", (int)getppid());
+        }
 
         // PART 4-5: CREATE PIPE IF THERE'S ANOTHER COMMAND IN SEQUENCE
-                    if (l->seq[i + 1] != 0) {
-                        // Create a pipe and return error if failed
-                        if (pipe(pipe_fds) == -1) {
-                            perror("pipe failed");
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-
-                    pid_t pid = fork();
-                    if (pid == 0) {  // In Child process
-
-        // PART 4-5: SIMPLE PIPE: for cmnd1 | cmd2
-
-                        // Currently at cmd1
-                        if (l->seq[i + 1] != 0) {
-                            // Redirects output of cmd1 to write end of pipe instead ofterminal
-                            dup2(pipe_fds[1], STDOUT_FILENO);
-                            close(pipe_fds[0]);  // Close read end of cmd1 because using read end of pipe
-                            close(pipe_fds[1]);  // Close original write end after duplicating it
-                        }
-                        // Currently at cmd2
-                        if (i > 0) {  // Not at the first command of the sequence
-                            // Redirects input of cmd2 to read end of cmd1 instead of keyboard
-                            dup2(prev_cmd, STDIN_FILENO);
-                            close(prev_cmd);  // Close file descriptor for previous pipe
-                        }
-
-        // PART 3: HANDLE INPUT REDIRECTION
-                        if (l->in != 0) {
-                            int fd_in = open(l->in, O_RDONLY);
-                            if (fd_in == -1) {
-                                perror("Error opening input file");
-                                exit(EXIT_FAILURE);
-                            }
-                            if (dup2(fd_in, STDIN_FILENO) == -1) {
-                                perror("Error redirecting input");
-                                exit(EXIT_FAILURE);
-                            }
-                            close(fd_in);
-                        }
-
-        // PART 3: HANDLE OUTPUT REDIRECTION
-                        if (l->out != 0) {
-                            int fd_out = open(l->out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                            if (fd_out == -1) {
-                                perror("Error opening output file");
-                                exit(EXIT_FAILURE);
-                            }
-                            if (dup2(fd_out, STDOUT_FILENO) == -1) {
-                                perror("Error redirecting output");
-                                exit(EXIT_FAILURE);
-                            }
-                            close(fd_out);
-                        }
+        if (!last && !branch) {
+            // Create a pipe and return error if failed
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe failed");
+                exit(EXIT_FAILURE);
+            }
+        }
 
-        // PART1: Execute the command and return error if failed
-                        if (execvp(command[0], command) == -1) {
-                            perror("execvp failed");
-                            exit(EXIT_FAILURE);
-                        }
-                    } else if (pid > 0) {  // In Parent process
-
-        // PART 2: Handle background processes
-                        if (!l->bg) {  // Not a background process
-                            int status;
-                            printf("Command being executed by Child %d\n", pid);
-                            waitpid(pid, &status, 0);
-                            printf("Command completed by Child %d\n", pid);
-                        } else {
-                            // bg = 0: Background process since entered command followed by &
-                            printf("[JOB ID = %d]Started in background\n", pid);
-                            add_job(pid, command[0]);  // Add the background job
-                        }
-
-        // PART 4-5: CLOSE
-                        // currently at cmd1
-                        if (l->seq[i + 1] != 0) {
-                            close(pipe_fds[1]);     // Close write part of cmd1
-                            prev_cmd = pipe_fds[0];  // Save read end for next command
-                        }
-
-                    } else {
-                        perror("fork failed");
-                        exit(1);
-                    }
+        // PART 4-5: SIMPLE PIPE: cmd2 reads the read end of cmd1's pipe instead of keyboard
+        if (branch) {
+            stage_fds[STDIN_FILENO] = branch_in[i - nmain];
+        } else if (i > 0) {
+            stage_fds[STDIN_FILENO] = prev_cmd;
+        } else {
+            // PART 3: HANDLE INPUT REDIRECTION (first command only)
+            if (fd_here != -1) {
+                stage_fds[STDIN_FILENO] = fd_here;
+            } else if (l->in != 0) {
+                fd_in = open(l->in, O_RDONLY | O_CLOEXEC);
+                if (fd_in == -1) {
+                    perror("Error opening input file");
+                    failed = 1;
                 }
+                stage_fds[STDIN_FILENO] = fd_in;
+            } else if (fds) {
+                stage_fds[STDIN_FILENO] = fds[STDIN_FILENO];
+            }
+        }
+
+        // PART 4-5: cmd1 writes to the write end of the pipe instead of terminal
+        if (branch) {
+            stage_fds[STDOUT_FILENO] = fds ? fds[STDOUT_FILENO] : -1;
+        } else if (!last) {
+            stage_fds[STDOUT_FILENO] = pipe_fds[1];
+        } else if (split) {
+            // FAN-OUT: the producer writes to a pipe, copied to every output
+            if (pipe2(fan_pipe, O_CLOEXEC) == -1) {
+                perror("pipe failed");
+                exit(EXIT_FAILURE);
+            }
+            // like a single output file, the producer does not start if one fails
+            ntargets = open_fanout_targets(l, nbranch, targets, branch_in, &failed);
+            stage_fds[STDOUT_FILENO] = fan_pipe[1];
+        } else if (l->out != 0) {
+            // PART 3: HANDLE OUTPUT REDIRECTION (last command only)
+            fd_out = open(l->out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd_out == -1) {
+                perror("Error opening output file");
+                failed = 1;
+            }
+            stage_fds[STDOUT_FILENO] = fd_out;
+        } else if (fds) {
+            // Last command, its output may be captured by the caller
+            stage_fds[STDOUT_FILENO] = fds[STDOUT_FILENO];
+        }
+
+        if (failed) {
+            pids[i] = -1;  // not started, the next command reads an empty pipe
+        } else {
+            pids[i] = spawn_command(command, stage_fds, pgid);
+            if (pgid == 0) pgid = pids[i];
+
+            // PART 2: Handle background processes
+            if (l->bg) {
+                // bg = 0: Background process since entered command followed by &
+                if (verbose) printf("[JOB ID = %d]Started in background\n", pids[i]);
+                add_job(pids[i], command[0], job_id, i == n - 1);  // Add the background job
             }
         }
+
+        // PART 4-5: CLOSE, the child has its own copies
+        if (fd_in != -1) close(fd_in);
+        if (fd_out != -1) close(fd_out);
+        if (branch) close(branch_in[i - nmain]);
+        else if (i > 0) close(prev_cmd);
+        // currently at cmd1
+        if (!last && !branch) {
+            close(pipe_fds[1]);     // Close write part of cmd1
+            prev_cmd = pipe_fds[0];  // Save read end for next command
+        }
+        if (last && split) {
+            // FAN-OUT: the copy runs until the producer closes its output
+            close(fan_pipe[1]);
+            if (fanout_start(fan_pipe[0], targets, ntargets, l->bg || pids[i] == -1 ? -1 : pids[i]) == -1)
+                perror("Error starting fan-out");
+        }
+    }
+    if (fd_here != -1) close(fd_here);
+    if (job_fds[STDOUT_FILENO] != -1) close(job_fds[STDOUT_FILENO]);
+    xfree(targets);
+    xfree(branch_in);
+    return i;
+}
+
+/* Wait for the n commands of a foreground pipeline. They are all started
+   before the first wait, so a command filling its pipe is never blocked by a
+   reader that was not forked yet. Returns the status of the last one. */
+int wait_pipeline(pid_t *pids, int n) {
+    int status = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (pids[i] == -1) {
+            status = EXIT_FAILURE << 8;  // same status as a child failing its redirection
+            continue;
+        }
+        if (verbose) printf("Command being executed by Child %d\n", pids[i]);
+        wait_child(pids[i], &status, 0);
+        fanout_join(pids[i]);  // the copies of its output, if it is a producer
+        if (verbose) printf("Command completed by Child %d\n", pids[i]);
+    }
+    return status;
+}
+
+/* wait_pipeline() with a time limit. When it expires the process group of
+   the pipeline gets SIGTERM, then SIGKILL if some process is still there
+   KILL_GRACE seconds later. The limit is a timerfd polled along with pidfds
+   of the commands, so no process sleeps on our behalf. Returns the wait
+   status of the last command, or 124 << 8 if the time limit was reached. */
+int wait_pipeline_timeout(pid_t *pids, int n, pid_t pgid, double seconds) {
+    struct pollfd *pfds = xmalloc((n + 1) * sizeof(struct pollfd));
+    struct itimerspec when;
+    int status = 0, expired = 0, left = 0;
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = (time_t)seconds;
+    when.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+    if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0) when.it_value.tv_nsec = 1;  // 0 disarms
+    if (tfd != -1) timerfd_settime(tfd, 0, &when, 0);
+
+    for (int k = 0; k < n; k++) {
+        pfds[k].fd = pids[k] == -1 ? -1 : pidfd_open(pids[k]);
+        pfds[k].events = POLLIN;
+        if (pfds[k].fd != -1) left++;
+        else if (pids[k] != -1) pfds[k].fd = -2;  // no pidfd, waited for at the end
+    }
+    pfds[n].fd = tfd;
+    pfds[n].events = POLLIN;
+
+    while (left > 0) {
+        if (poll(pfds, n + 1, -1) == -1) continue;
+        if (pfds[n].revents & POLLIN) {
+            uint64_t ticks;
+            if (read(tfd, &ticks, sizeof(ticks)) == -1) continue;
+            if (expired++ == 0) {
+                kill(-pgid, SIGTERM);
+                when.it_value.tv_sec = KILL_GRACE;
+                when.it_value.tv_nsec = 0;
+                timerfd_settime(tfd, 0, &when, 0);
+            } else {
+                kill(-pgid, SIGKILL);
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            int wstatus;
+            if (pfds[k].fd < 0 || !pfds[k].revents) continue;
+            wait_child(pids[k], &wstatus, 0);
+            if (k == n - 1) status = wstatus;
+            fanout_join(pids[k]);
+            close(pfds[k].fd);
+            pfds[k].fd = -1;  // ignored by poll() from now on
+            left--;
+        }
+    }
+
+    // without a pidfd (old kernel) the limit cannot be enforced, plain wait
+    for (int k = 0; k < n; k++) {
+        int wstatus = EXIT_FAILURE << 8;  // same status as a child failing its redirection
+        if (pfds[k].fd == -2) {
+            wait_child(pids[k], &wstatus, 0);
+            fanout_join(pids[k]);
+        } else if (pids[k] != -1) {
+            continue;
+        }
+        if (k == n - 1) status = wstatus;
+    }
+    if (tfd != -1) close(tfd);
+    xfree(pfds);
+    if (expired) {
+        printf("timeout: command timed out after %g s\n", seconds);
+        return 124 << 8;
+    }
+    return status;
+}
+
+/* timeout DURATION pipeline: run the pipeline in the foreground, in its own
+   process group, and stop it once DURATION (seconds, or with a suffix s, m,
+   h or d) has elapsed. The group gets the terminal meanwhile, so that ^C
+   and reads from the terminal go to it. */
+int run_timeout(struct cmdline *l) {
+    const char *duration = l->seq[0][1];
+    char *end = 0;
+    double seconds = duration ? strtod(duration, &end) : -1;
+    int valid = duration != 0 && end != duration && isfinite(seconds) && seconds >= 0;  // not "s", "nan" nor "inf"
+
+    switch (valid ? *end : 0) {
+        case 'd': seconds *= 24;  // fall through
+        case 'h': seconds *= 60;  // fall through
+        case 'm': seconds *= 60;  // fall through
+        case 's': end++;
+        default: break;
+    }
+    if (!valid || !isfinite(seconds) || *end != 0 || shift_words(l, 2) != 0 || l->seq[0] == 0) {
+        printf("usage: timeout DURATION COMMAND\n");
+        return 2 << 8;
+    }
+    if (l->bg) {
+        printf("usage: timeout DURATION COMMAND, in the foreground\n");
+        return 2 << 8;
+    }
+
+    pid_t *pids = xmalloc(seq_len(l) * sizeof(pid_t));
+    int n = launch_pipeline(l, 0, pids, 1, 0);
+    pid_t pgid = -1;
+    for (int k = 0; k < n && pgid == -1; k++) pgid = pids[k];
+
+    int tty = interactive && pgid != -1 && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    if (tty) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+        kill(-pgid, SIGCONT);  // in case one read the terminal before it was theirs
+    }
+    int status = wait_pipeline_timeout(pids, n, pgid, seconds);
+    if (tty) {
+        signal(SIGTTOU, SIG_IGN);  // we are in the background until we take it back
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        signal(SIGTTOU, SIG_DFL);
+    }
+    xfree(pids);
+    return status;
+}
+
+/* Nanoseconds since start */
+static long long elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+/* Count the commands of a sequence */
+int seq_len(struct cmdline *l) {
+    int n = 0;
+    while (l->seq[n] != 0) n++;
+    return n;
+}
+
+/* Run the command line of a $(...) and return what it writes on its standard
+   output, read straight from a pipe and without the trailing newlines */
+char *command_output(const char *cmd) {
+    char *line = xstrdup(cmd);
+    struct cmdline *l = parsecmd(&line);
+    size_t len = 0, cap = 256;
+    char *out = xmalloc(cap);
+    int pipe_fds[2];
+
+    out[0] = 0;
+    if (l == 0) return out;
+    if (l->err != 0) {
+        printf("error: %s\n", l->err);
+        return out;
+    }
+    if (l->seq[0] == 0) return out;
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        return out;
+    }
+
+    int fds[3] = {-1, pipe_fds[1], -1};
+    pid_t *pids = xmalloc(seq_len(l) * sizeof(pid_t));
+    int n = launch_pipeline(l, fds, pids, 0, 0);
+    close(pipe_fds[1]);
+
+    while (1) {
+        if (len + 1 == cap) {
+            cap *= 2;
+            out = xrealloc(out, cap);
+        }
+        ssize_t r = read(pipe_fds[0], out + len, cap - len - 1);
+        if (r <= 0) break;
+        len += r;
+    }
+    close(pipe_fds[0]);
+    if (!l->bg) wait_pipeline(pids, n);
+    xfree(pids);
+
+    while (len > 0 && out[len - 1] == '\n') len--;
+    out[len] = 0;
+    return out;
+}
+
+/* Whether name is a builtin of run_command() or starts a loop, run by the
+   shell itself. wc -l, grep -F and head -n are not: they run in the child
+   like the programs. */
+int is_builtin(const char *name) {
+    static const char *names[] = {"exit", "jobs", "memstats", "health", "wait", "set", "export", "unset", "test",
+                                  "[", "stats", "memo", "read", "timeout", "exec", "do", "done", "for", "while", 0};
+
+    for (int i = 0; names[i]; i++)
+        if (!strcmp(name, names[i])) return 1;
+    return 0;
+}
+
+/* Run the command line l, a builtin or a pipeline, its variables expanded.
+   Returns its wait status, kept in last_status. */
+int run_command(struct cmdline *l) {
+    char *name, *args;
+
+    if (l->err != 0) {  // its expansion failed
+        printf("error: %s\n", l->err);
+        return last_status = 1 << 8;
+    }
+    name = l->seq[0] ? l->seq[0][0] : "";
+    if (!strcmp(name, "exit")) {
+        terminate();
+    } else if (!strcmp(name, "jobs")) {
+        if (l->seq[0][1] != 0) {
+            last_status = job_output(l->seq[0] + 1);  // jobs -o %n
+        } else {
+            print_jobs();  // PART 2: Print list of bg jobs  when "jobs" command is entered
+            last_status = 0;
+        }
+    } else if (!strcmp(name, "memstats")) {
+        memstats_print(stdout);
+        fdstats_print(stdout);
+        last_status = 0;
+    } else if (!strcmp(name, "health")) {
+        last_status = health_report(stdout) ? 1 << 8 : 0;  // fails when something keeps growing
+    } else if (!strcmp(name, "wait")) {
+        args = join_words(l->seq[0] + 1);
+        last_status = wait_jobs(args);  // PART 2: synchronize on bg jobs
+        xfree(args);
+    } else if (!strcmp(name, "set")) {
+        args = join_words(l->seq[0] + 1);
+        last_status = set_option(args);
+        xfree(args);
+    } else if (!strcmp(name, "export")) {
+        last_status = export_vars(l->seq[0] + 1);
+    } else if (!strcmp(name, "unset")) {
+        for (char **arg = l->seq[0] + 1; *arg; arg++) vars_unset(*arg);
+        last_status = 0;
+    } else if ((!strcmp(name, "test") || !strcmp(name, "[")) && l->seq[1] == 0 && !l->bg) {
+        last_status = cond_test(l->seq[0]);  // in a pipeline or in the background, the program runs
+    } else if (!strcmp(name, "stats")) {
+        last_status = stats_builtin(l->seq[0] + 1);
+    } else if (!strcmp(name, "memo")) {
+        last_status = memo_run(l);
+    } else if (!strcmp(name, "read")) {
+        last_status = input_read(l, script == 0 && input_redirected == 0);
+    } else if (!strcmp(name, "timeout")) {
+        last_status = run_timeout(l);
+    } else if (!strcmp(name, "exec")) {
+        if (shift_words(l, 1) != 0) {  // the command line without "exec"
+            printf("error: misplaced pipe\n");
+            return last_status;
+        }
+        exec_command(l);
+    } else if (!strcmp(name, "do") || !strcmp(name, "done")) {
+        printf("error: %s without for or while\n", name);
+        last_status = 2 << 8;
+    } else {
+        // Print input and output redirections if specified
+        if (verbose) {
+            if (l->in != 0) printf("in: %s\n", l->in);
+            if (l->here != 0) printf("here: %zu bytes\n", strlen(l->here));
+            if (l->out != 0) printf("out: %s\n", l->out);
+            printf("bg: %d\n", l->bg);
+        }
+
+        if (l->seq[0] == 0) return last_status;
+
+        // PART 1: the last command of -c replaces the shell, no fork and no wait
+        if (script_done() && loop_depth == 0 && l->seq[1] == 0 && !l->bg && l->tee_out == 0 &&
+            jobout_pending() == 0 && queued_jobs() == 0 && stats_file() == 0) {  // the stats are saved on exit
+            exec_command(l);
+            return last_status;
+        }
+
+// ---------------------------------------------------PART 4-5----------------------------------------
+
+        // PART 2: over set maxjobs or maxload, a background pipeline waits its turn
+        if (l->bg && queue_job(l)) {
+            last_status = 0;
+            return last_status;
+        }
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        pid_t *pids = xmalloc(seq_len(l) * sizeof(pid_t));
+        int n = launch_pipeline(l, 0, pids, 0, 0);
+        // PART 2: foreground, wait for all commands
+        last_status = l->bg ? 0 : wait_pipeline(pids, n);
+        xfree(pids);
+        if (!l->bg) stats_record(l->seq[0][0], elapsed_ns(&started));
+    }
+    return last_status;
+}
+
+int main(int argc, char **argv) {
+    const char *serve_path = 0;
+    int workers = 0, zygote = 0;
+
+    for (int a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-c") && a + 1 < argc) {
+            script = argv[++a];  // run these commands instead of reading them
+            interactive = 0;
+            verbose = 0;
+        } else if (!strcmp(argv[a], "--zygote")) {
+            zygote = 1;
+        } else if (!strcmp(argv[a], "--serve") && a + 1 < argc) {
+            serve_path = argv[++a];
+        } else if (!strcmp(argv[a], "--workers") && a + 1 < argc) {
+            workers = atoi(argv[++a]);
+        } else {
+            fprintf(stderr, "usage: %s [-c COMMANDS] [--zygote] [--serve PATH [--workers N]]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    vars_init();
+    // Fork the zygote first, while the shell is as small as it will ever be
+    if (zygote && zygote_start() == -1) perror("Error starting zygote");
+    parser_set_substitution(command_output);
+    parser_set_variables(variable);
+
+    if (serve_path) {
+        verbose = 0;
+        return serve(serve_path, workers);
+    }
+
+    struct timespec started;
+    int timing = 0;
+
+    while (1) {
+        if (timing) health_command(elapsed_ns(&started));  // the previous line is done
+        reap_jobs();
+        start_queued();  // as the admission thread does, before the next line sees the table
+
+        /* The line is parsed as it is read. It is freed by the next call to
+        readcmd() or parsecmd(). memstats shows what is left.*/
+        struct cmdline *l = readcmd(read_input);
+
+        if (l == 0) terminate();
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        timing = l->err != 0 || l->seq[0] != 0;
+        if (l->err != 0) {
+            printf("error: %s\n", l->err);
+            continue;
+        }
+        if (l->here_end != 0) read_here_document(l);
+
+        if (loop_starts(l)) {
+            loop_depth++;  // the lines of a loop are read and run without a prompt
+            struct loop *loop = loop_read(l, loop_line);
+            last_status = loop ? loop_run(loop, run_command) : 2 << 8;
+            if (loop) loop_free(loop);
+            loop_depth--;
+            continue;
+        }
+        cmdline_expand(l);
+        run_command(l);
     }
 }
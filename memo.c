@@ -0,0 +1,288 @@
+//
+// Memoization of deterministic command lines: memo COMMAND serves the
+// output of an earlier identical run from a cache directory.
+//
+// An output is kept in a file of the cache directory named after the
+// 128-bit FNV-1a hash of its key, so the same command line finds it from
+// any session. A run writes to a temporary file, renamed into place if it
+// succeeds: a reader sees a complete output or none. An output served has
+// its modification time set to now, and once the directory is over its
+// limit the least recently used outputs are removed.
+//
+// Outputs are copied in the kernel with copy_file_range(); to a pipe or a
+// terminal, where it is not supported, with read() and write().
+//
+
+#define _GNU_SOURCE     // for copy_file_range() and mkostemp()
+
+#include "memo.h"
+#include "shell.h"
+#include "utils.h"
+#include "vars.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEFAULT_LIMIT (256ULL << 20)
+#define BLOCK 65536
+
+typedef unsigned __int128 hash_t;
+
+#define FNV_OFFSET (((hash_t)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+
+static char *cache_dir = 0;
+static unsigned long long limit = DEFAULT_LIMIT;
+
+/* One cached output, when the directory is cleaned */
+struct entry {
+    char *name;
+    struct timespec used;
+    off_t size;
+};
+
+/* FNV-1a, its prime being 2^88 + 0x13b */
+static void hash_bytes(hash_t *h, const void *p, size_t n)
+{
+    const unsigned char *b = p;
+    hash_t x = *h;
+
+    for (size_t k = 0; k < n; k++) {
+        x ^= b[k];
+        x = (x << 88) + x * 0x13b;
+    }
+    *h = x;
+}
+
+/* Hash s with its NUL, so that words do not run into each other */
+static void hash_string(hash_t *h, const char *s)
+{
+    hash_bytes(h, s, strlen(s) + 1);
+}
+
+static int hash_file(hash_t *h, const char *path)
+{
+    char buf[BLOCK];
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) return -1;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) hash_bytes(h, buf, n);
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+void memo_set_dir(const char *dir)
+{
+    xfree(cache_dir);
+    cache_dir = xstrdup(dir);
+}
+
+const char *memo_dir(void)
+{
+    const char *base = vars_get("XDG_CACHE_HOME"), *home = vars_get("HOME");
+    char path[PATH_MAX];
+
+    if (cache_dir) return cache_dir;
+    if (base && *base) snprintf(path, sizeof(path), "%s/unix_shell/memo", base);
+    else if (home && *home) snprintf(path, sizeof(path), "%s/.cache/unix_shell/memo", home);
+    else snprintf(path, sizeof(path), "/tmp/unix_shell-memo-%u", (unsigned)getuid());
+    return cache_dir = xstrdup(path);
+}
+
+void memo_set_limit(unsigned long long bytes)
+{
+    limit = bytes;
+}
+
+unsigned long long memo_limit(void)
+{
+    return limit;
+}
+
+/* mkdir -p */
+static int make_dirs(const char *dir)
+{
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) return -1;
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = 0;
+        if (mkdir(path, 0700) == -1 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(path, 0700) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+/* Copy the file in to out, from its start */
+static void copy_output(int in, int out)
+{
+    char buf[BLOCK];
+    struct stat st;
+    off_t off = 0;
+    ssize_t n;
+
+    fstat(in, &st);
+    while (off < st.st_size && (n = copy_file_range(in, &off, out, 0, st.st_size - off, 0)) > 0);
+    while ((n = pread(in, buf, sizeof(buf), off)) > 0) {  /* not supported, or what is left */
+        for (ssize_t w, done = 0; done < n; done += w) {
+            if ((w = write(out, buf + done, n - done)) == -1) {
+                if (errno == EINTR) w = 0;
+                else return;
+            }
+        }
+        off += n;
+    }
+}
+
+static int by_use(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec) return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+/* Remove the least recently used outputs, other than keep, until the
+   directory is within the limit */
+static void evict(const char *dir, const char *keep)
+{
+    DIR *d = opendir(dir);
+    struct entry *entries = 0;
+    size_t len = 0, cap = 0;
+    unsigned long long total = 0;
+    struct dirent *e;
+    struct stat st;
+
+    if (d == 0) return;
+    while ((e = readdir(d)) != 0) {
+        if (e->d_name[0] == '.' || fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+        if (len == cap) {
+            cap = cap ? 2 * cap : 64;
+            entries = xrealloc(entries, cap * sizeof(struct entry));
+        }
+        entries[len++] = (struct entry){xstrdup(e->d_name), st.st_mtim, st.st_size};
+        total += st.st_size;
+    }
+    if (total > limit) {
+        qsort(entries, len, sizeof(struct entry), by_use);
+        for (size_t k = 0; k < len && total > limit; k++) {
+            if (!strcmp(entries[k].name, keep)) continue;
+            if (unlinkat(dirfd(d), entries[k].name, 0) == 0 || errno == ENOENT) total -= entries[k].size;
+        }
+    }
+    for (size_t k = 0; k < len; k++) xfree(entries[k].name);
+    xfree(entries);
+    closedir(d);
+}
+
+/* Run the pipeline of l with its output to fd */
+static int run_to(struct cmdline *l, int fd)
+{
+    int fds[3] = {-1, fd, -1};
+    char *out = l->out;
+
+    l->out = 0;  /* it would replace fd */
+    pid_t *pids = xmalloc(seq_len(l) * sizeof(pid_t));
+    int n = launch_pipeline(l, fds, pids, 0, 0);
+    int status = wait_pipeline(pids, n);
+    xfree(pids);
+    l->out = out;
+    return status;
+}
+
+static int usage(void)
+{
+    printf("usage: memo [-h] [-e NAME]... COMMAND, in the foreground\n");
+    return 2 << 8;
+}
+
+int memo_run(struct cmdline *l)
+{
+    char **args = l->seq[0];
+    hash_t h = FNV_OFFSET;
+    int content = 0, k;
+
+    hash_string(&h, "memo 1");
+    for (k = 1; args[k] && args[k][0] == '-'; k++) {
+        if (!strcmp(args[k], "-h")) {
+            content = 1;
+        } else if (!strcmp(args[k], "-e") && args[k + 1] != 0) {
+            const char *value = vars_get(args[++k]);
+            hash_string(&h, args[k]);
+            hash_string(&h, value ? value : "\001");  /* unset is not empty */
+        } else {
+            return usage();
+        }
+    }
+    if (l->bg || l->tee_out != 0 || shift_words(l, k) != 0 || l->seq[0] == 0) return usage();
+
+    for (int i = 0; l->seq[i]; i++) {
+        for (int w = 0; l->seq[i][w]; w++) hash_string(&h, l->seq[i][w]);
+        hash_string(&h, "|");
+    }
+    char cwd[PATH_MAX];
+    hash_string(&h, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+
+    int cacheable = 1;
+    struct stat st;
+    if (l->here != 0) {
+        hash_string(&h, "<<");
+        hash_string(&h, l->here);
+    } else if (l->in != 0) {
+        hash_string(&h, "<");
+        if (stat(l->in, &st) == -1) {
+            cacheable = 0;  /* the pipeline reports it */
+        } else if (content) {
+            cacheable = hash_file(&h, l->in) == 0;
+        } else {
+            hash_bytes(&h, &st.st_dev, sizeof(st.st_dev));
+            hash_bytes(&h, &st.st_ino, sizeof(st.st_ino));
+            hash_bytes(&h, &st.st_size, sizeof(st.st_size));
+            hash_bytes(&h, &st.st_mtim, sizeof(st.st_mtim));
+        }
+    }
+
+    int out = STDOUT_FILENO;
+    fflush(stdout);
+    if (l->out != 0 && (out = open(l->out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        perror("Error opening output file");
+        return 1 << 8;
+    }
+
+    const char *dir = memo_dir();
+    char name[33], path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long)(h >> 64), (unsigned long long)h);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp, sizeof(tmp), "%s/.run-XXXXXX", dir);
+
+    int status, fd = cacheable ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd != -1) {  /* a hit */
+        futimens(fd, 0);  /* used now */
+        copy_output(fd, out);
+        close(fd);
+        status = 0;
+    } else if (!cacheable || make_dirs(dir) == -1 || (fd = mkostemp(tmp, O_CLOEXEC)) == -1) {
+        if (cacheable) perror("memo: cache not usable, not kept");
+        status = run_to(l, out);
+    } else {
+        status = run_to(l, fd);
+        copy_output(fd, out);
+        if (status == 0 && fstat(fd, &st) == 0 && (unsigned long long)st.st_size <= limit &&
+            rename(tmp, path) == 0) {
+            evict(dir, name);
+        } else {
+            unlink(tmp);
+        }
+        close(fd);
+    }
+    if (out != STDOUT_FILENO) close(out);
+    return status;
+}
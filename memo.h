@@ -0,0 +1,31 @@
+//
+// Memoization of deterministic command lines: memo COMMAND serves the
+// output of an earlier identical run from a cache directory.
+//
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "cmdline.h"
+
+/* memo [-h] [-e NAME]... PIPELINE: run the pipeline of l with its standard
+   output kept in the cache, or copy the output kept by an earlier run. The
+   key is made of the words of the pipeline, the current directory, the
+   here-document or the identity of the < input file (device, inode, size
+   and modification time, or its content with -h), and the values of the
+   variables NAME. Files named in the arguments and an inherited standard
+   input are not part of it. Only a run whose status is 0 is kept. Returns
+   the wait status. */
+int memo_run(struct cmdline *l);
+
+/* The cache directory, created when needed; by default memo in
+   $XDG_CACHE_HOME or ~/.cache */
+void memo_set_dir(const char *dir);
+const char *memo_dir(void);
+
+/* The size of the cache, beyond which the least recently used outputs are
+   removed */
+void memo_set_limit(unsigned long long bytes);
+unsigned long long memo_limit(void);
+
+#endif //MEMO_H
@@ -3,203 +3,632 @@
 //
 
 #include "parser.h"
-#include "utils.h"
+#include "arith.h"
+#include "pathexp.h"
 
+#include <ctype.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 //lll
 
-#define READ_CHAR *(*cur_buf)++ = *(*cur)++
-#define SKIP_CHAR (*cur)++
+/* Everything a parse uses, so that parses in different contexts can run at
+   the same time */
+struct shparse_ctx {
+    struct shparse_allocator a;
+    struct pathexp_cache *glob;   /* directory listings of the current line */
+    char *(*substitute)(void *arg, const char *cmd);
+    void *substitute_arg;
+};
 
+/* The word being read. Quoted characters are stored protected by a
+   backslash, so that the word can be used as a pattern for pathname
+   expansion. */
+struct word {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int magic;    /* holds an unquoted *, ? or [ */
+    int split;    /* holds the output of an unquoted expansion, cut by FIELD_SEP */
+    int refs;     /* holds a variable, a $(...) or a $((...)), expanded by shparse_expand() */
+    struct shparse_ctx *ctx;
+};
 
-static void read_single_quote(char ** cur, char ** cur_buf) {
-    SKIP_CHAR;
-    while(1) {
-        char c = **cur;
-        switch(c) {
-            case '\'':
-                SKIP_CHAR;
-            return;
-            case '\0':
-                fprintf(stderr, "Missing closing '\n");
-            return;
-            default:
-                READ_CHAR;
-            break;
-        }
+/* Put where the output of an unquoted $(...) has blanks. The word is cut
+   there into several words once read. */
+#define FIELD_SEP '\036'
+
+/* Threads of shparse_batch() at most, whatever the caller asks: their
+   slices and ids are on the stack */
+#define BATCH_THREADS_MAX 256
+
+/* The words the tokenizer gives for operators. They are told apart from
+   typed words by address, so a quoted "|" is an ordinary argument. */
+static char op_bg[] = "&", op_in[] = "<", op_here_doc[] = "<<", op_here_string[] = "<<<",
+            op_out[] = ">", op_pipe[] = "|", op_fanout[] = "|+", op_list[] = ";";
+
+/* First character of w if it is an operator, 0 for an ordinary word */
+static char op(const char *w) {
+    if (w == op_bg || w == op_in || w == op_here_doc || w == op_here_string ||
+        w == op_out || w == op_pipe || w == op_fanout || w == op_list)
+        return w[0];
+    return 0;
+}
+
+static void *p_alloc(struct shparse_ctx *ctx, size_t size) {
+    return ctx->a.alloc(ctx->a.opaque, size);
+}
+
+static void *p_realloc(struct shparse_ctx *ctx, void *p, size_t size) {
+    return ctx->a.realloc(ctx->a.opaque, p, size);
+}
+
+static void p_free(struct shparse_ctx *ctx, void *p) {
+    if (p) ctx->a.free(ctx->a.opaque, p);
+}
+
+static char *p_strdup(struct shparse_ctx *ctx, const char *s) {
+    size_t n = strlen(s) + 1;
+    return memcpy(p_alloc(ctx, n), s, n);
+}
+
+/* malloc() for a context made without an allocator */
+static void *std_alloc(void *opaque, size_t size) {
+    void *p = malloc(size);
+    (void)opaque;
+    if (p == 0) abort();
+    return p;
+}
+
+static void *std_realloc(void *opaque, void *p, size_t size) {
+    (void)opaque;
+    if ((p = realloc(p, size)) == 0) abort();
+    return p;
+}
+
+static void std_free(void *opaque, void *p) {
+    (void)opaque;
+    free(p);
+}
+
+static const struct shparse_allocator std_allocator = {std_alloc, std_realloc, std_free, 0};
+
+struct shparse_ctx *shparse_new(const struct shparse_allocator *a) {
+    if (a == 0) a = &std_allocator;
+    struct shparse_ctx *ctx = a->alloc(a->opaque, sizeof(struct shparse_ctx));
+    ctx->a = *a;
+    ctx->glob = pathexp_cache_new(a);
+    ctx->substitute = 0;
+    ctx->substitute_arg = 0;
+    return ctx;
+}
+
+void shparse_free(struct shparse_ctx *ctx) {
+    pathexp_cache_free(ctx->glob);
+    p_free(ctx, ctx);
+}
+
+void shparse_set_substitution(struct shparse_ctx *ctx, char *(*run)(void *arg, const char *cmd), void *arg) {
+    ctx->substitute = run;
+    ctx->substitute_arg = arg;
+}
+
+static void put_char(struct word *w, char c) {
+    if (w->len + 2 > w->cap) {  /* always keep room for the final '\0' */
+        w->cap *= 2;
+        w->buf = p_realloc(w->ctx, w->buf, w->cap);
     }
+    w->buf[w->len++] = c;
 }
 
-static void read_double_quote(char ** cur, char ** cur_buf) {
-    SKIP_CHAR;
-    while(1) {
-        char c = **cur;
-        switch(c) {
-            case '"':
-                SKIP_CHAR;
-            return;
-            case '\\':
-                SKIP_CHAR;
-            READ_CHAR;
-            break;
-            case '\0':
-                fprintf(stderr, "Missing closing \"\n");
-            return;
-            default:
-                READ_CHAR;
-            break;
+/* Quoted characters are protected by a backslash from pathname expansion */
+static void put_quoted(struct word *w, char c) {
+    if (strchr("*?[]\\", c)) put_char(w, '\\');
+    put_char(w, c);
+}
+
+/* Put the output of a $(...) or the value of a variable in the word.
+   Quoted, it is kept as is; unquoted, it is split in several words on
+   blanks. */
+static void put_output(struct word *w, const char *out, int quoted) {
+    for (; *out; out++) {
+        if (quoted) {
+            put_quoted(w, *out);
+        } else if (*out == ' ' || *out == '\t' || *out == '\n' || *out == FIELD_SEP) {
+            if (w->len == 0 || w->buf[w->len - 1] != FIELD_SEP) put_char(w, FIELD_SEP);
+        } else {
+            if (*out == '*' || *out == '?' || *out == '[') w->magic = 1;
+            if (*out == '\\') put_char(w, '\\');
+            put_char(w, *out);
         }
     }
 }
 
+/* Append a word to tab, or the paths it matches if it is a pattern */
+static void add_word(struct shparse_ctx *ctx, char ***tab, size_t *l, char *text, int magic)
+{
+    if (magic && pathexp_expand(ctx->glob, text, tab, l) != 0) return;
+    *tab = p_realloc(ctx, *tab, (*l + 1) * sizeof(char *));
+    (*tab)[(*l)++] = p_strdup(ctx, pathexp_unescape(text));
+}
 
-static void read_word(char ** cur, char ** cur_buf) {
-    while(1) {
-        char c = **cur;
-        switch (c) {
-            case '\0':
-            case ' ':
-            case '\t':
-            case '<':
-            case '>':
-            case '|':
-            case '&':
-                **cur_buf = '\0';
-            return;
-            case '\'':
-                read_single_quote(cur, cur_buf);
-            break;
-            case '"':
-                read_double_quote(cur, cur_buf);
+/* Append the word in w to tab, as add_word() does */
+static void add_fields(struct shparse_ctx *ctx, char ***tab, size_t *l, struct word *w)
+{
+    w->buf[w->len] = '\0';
+    if (!w->split) {
+        add_word(ctx, tab, l, w->buf, w->magic);
+        return;
+    }
+    /* one word per field of the expansion, empty ones are dropped */
+    char *field = w->buf, *sep;
+    do {
+        sep = strchr(field, FIELD_SEP);
+        if (sep) *sep = 0;
+        if (*field) add_word(ctx, tab, l, field, w->magic);
+        field = sep + 1;
+    } while (sep);
+}
+
+//------------------------------------------TOKENIZER--------------------------------------------
+
+/* The tokenizer reads one character at a time and keeps everything it needs
+   between two characters in its state, so the input can come in pieces cut
+   anywhere. A word is added to the line as soon as it ends: only the word
+   being read, or the text of a $(...), is buffered. */
+enum {
+    T_BLANK,      /* between words */
+    T_BLANK_ESC,  /* after a backslash between words */
+    T_LT,         /* after "<" */
+    T_LT2,        /* after "<<" */
+    T_PIPE,       /* after "|" */
+    T_WORD,       /* in a word, out of quotes */
+    T_ESC,        /* after a backslash in a word */
+    T_DOLLAR,     /* after "$" in a word */
+    T_SQUOTE,     /* in '...' */
+    T_DQUOTE,     /* in "..." */
+    T_DQ_ESC,     /* after a backslash in "..." */
+    T_DQ_DOLLAR,  /* after "$" in "..." */
+    T_SUBST,      /* in $(...) */
+    T_VAR,        /* in the name of a $NAME or ${NAME} */
+};
+
+/* States in the text of a $(...), only scanned for the matching parenthesis
+   (the text is parsed when its command runs) */
+enum { S_PLAIN, S_ESC, S_SQUOTE, S_DQUOTE, S_DQ_ESC };
+
+struct shparse_stream {
+    struct shparse_ctx *ctx;
+    int oneline;        /* a newline is an ordinary character, for shparse_parse() */
+    int state;
+    struct word word;
+    char *sub;          /* text of the $(...) being read */
+    size_t sub_len;
+    size_t sub_cap;
+    int sub_state;
+    int sub_depth;      /* parentheses open */
+    int sub_quoted;     /* the $(...) is in "..." */
+    int var_quoted;     /* the variable being read is in "..." */
+    int var_brace;      /* it is a ${NAME} */
+    char **tab;         /* words of the line so far */
+    size_t len;
+    int complete;       /* the line ended, for shparse_stream_next() */
+};
+
+static void emit(struct shparse_stream *st, char *w)
+{
+    st->tab = p_realloc(st->ctx, st->tab, (st->len + 1) * sizeof(char *));
+    st->tab[st->len++] = w;
+}
+
+static void start_word(struct shparse_stream *st)
+{
+    st->word.len = 0;
+    st->word.magic = 0;
+    st->word.split = 0;
+    st->word.refs = 0;
+}
+
+/* Add the word just read, replaced by the matching paths if any. A word
+   with references is kept as read, its quoted characters still protected,
+   and only expanded by shparse_expand(). The file name of a redirection
+   is not a pattern: it names one file. */
+static void end_word(struct shparse_stream *st)
+{
+    struct word *w = &st->word;
+    char last = st->len > 0 ? op(st->tab[st->len - 1]) : 0;
+
+    w->buf[w->len] = '\0';
+    if (w->refs) emit(st, p_strdup(st->ctx, w->buf));
+    else if (last == '<' || last == '>') add_word(st->ctx, &st->tab, &st->len, w->buf, 0);
+    else add_fields(st->ctx, &st->tab, &st->len, w);
+}
+
+static void put_sub(struct shparse_stream *st, char c)
+{
+    if (st->sub_len == st->sub_cap) {
+        st->sub_cap = st->sub_cap ? 2 * st->sub_cap : 64;
+        st->sub = p_realloc(st->ctx, st->sub, st->sub_cap);
+    }
+    st->sub[st->sub_len++] = c;
+}
+
+/* Keep the $(...) just read in the word, its command runs when the word is
+   expanded. A $((...)) is arithmetic, evaluated then as well. */
+static void end_substitution(struct shparse_stream *st)
+{
+    struct word *w = &st->word;
+    int arith = st->sub_len >= 2 && st->sub[0] == '(' && st->sub[st->sub_len - 1] == ')';
+    char mark = arith ? SHPARSE_ARITH : SHPARSE_SUBST;
+
+    put_char(w, mark);
+    put_char(w, st->sub_quoted ? '"' : ' ');
+    for (size_t k = 0; k < st->sub_len; k++) put_char(w, st->sub[k]);
+    put_char(w, mark);
+    w->refs = 1;
+}
+
+/* Read c in the text of a $(...), skipping quoted parentheses */
+static void step_substitution(struct shparse_stream *st, char c)
+{
+    switch (st->sub_state) {
+        case S_ESC:
+        case S_DQ_ESC:
+            st->sub_state = st->sub_state == S_ESC ? S_PLAIN : S_DQUOTE;
+            if (c == '\n' && !st->oneline) {  /* continuation, drop the backslash too */
+                st->sub_len--;
+                return;
+            }
             break;
-            case '\\':
-                SKIP_CHAR;
-            READ_CHAR;
+        case S_SQUOTE:
+            if (c == '\'') st->sub_state = S_PLAIN;
             break;
-            default:
-                READ_CHAR;
+        case S_DQUOTE:
+            if (c == '"') st->sub_state = S_PLAIN;
+            else if (c == '\\') st->sub_state = S_DQ_ESC;
             break;
-        }
+        default:
+            if (c == '\\') {
+                st->sub_state = S_ESC;
+            } else if (c == '\'') {
+                st->sub_state = S_SQUOTE;
+            } else if (c == '"') {
+                st->sub_state = S_DQUOTE;
+            } else if (c == '(') {
+                st->sub_depth++;
+            } else if (c == ')' && --st->sub_depth == 0) {
+                end_substitution(st);
+                st->state = st->sub_quoted ? T_DQUOTE : T_WORD;
+                return;
+            }
     }
+    put_sub(st, c);
 }
 
-/* Split the string in words, according to the simple shell grammar. */
-static char **split_in_words(char *line)
+/* Read c in the current state. Returns 0 when c is left for the new state. */
+static int step(struct shparse_stream *st, char c)
 {
-    char *cur = line;
-    char *buf = xmalloc(strlen(line) + 1);
-    char *cur_buf;
-    char **tab = 0;
-    size_t l = 0;
-    char c;
-
-    while ((c = *cur) != 0) {
-        char *w = 0;
-        switch (c) {
-            case ' ':
-            case '\t':
-                /* Ignore any whitespace */
-                cur++;
+    struct word *w = &st->word;
+    int quoted;
+
+    switch (st->state) {
+        case T_BLANK:
+            switch (c) {
+                case ' ':
+                case '\t':
+                    /* Ignore any whitespace */
+                    return 1;
+                case '\n':
+                    if (st->oneline) break;
+                    st->complete = 1;
+                    return 1;
+                case ';':
+                    /* ends a command as a newline does, when lines are read */
+                    if (st->oneline) emit(st, op_list);
+                    else st->complete = 1;
+                    return 1;
+                case '&':
+                    emit(st, op_bg);
+                    return 1;
+                case '>':
+                    emit(st, op_out);
+                    return 1;
+                case '<':
+                    /* "<", "<<" (here-document) or "<<<" (here-string) */
+                    st->state = T_LT;
+                    return 1;
+                case '|':
+                    /* "|" or "|+" (fan-out) */
+                    st->state = T_PIPE;
+                    return 1;
+                case '\\':
+                    st->state = T_BLANK_ESC;
+                    return 1;
+            }
+            start_word(st);
+            st->state = T_WORD;
+            return 0;
+        case T_BLANK_ESC:
+            if (c == '\n' && !st->oneline) {  /* continuation */
+                st->state = T_BLANK;
+                return 1;
+            }
+            start_word(st);
+            put_quoted(w, c);
+            st->state = T_WORD;
+            return 1;
+        case T_LT:
+            if (c == '<') {
+                st->state = T_LT2;
+                return 1;
+            }
+            emit(st, op_in);
+            st->state = T_BLANK;
+            return 0;
+        case T_LT2:
+            st->state = T_BLANK;
+            if (c == '<') {
+                emit(st, op_here_string);
+                return 1;
+            }
+            emit(st, op_here_doc);
+            return 0;
+        case T_PIPE:
+            st->state = T_BLANK;
+            if (c == '+') {
+                emit(st, op_fanout);
+                return 1;
+            }
+            emit(st, op_pipe);
+            return 0;
+        case T_WORD:
+            switch (c) {
+                case '\n':
+                    if (st->oneline) break;
+                    // fall through
+                case ' ':
+                case '\t':
+                case '<':
+                case '>':
+                case '|':
+                case '&':
+                case ';':
+                    end_word(st);
+                    st->state = T_BLANK;
+                    return 0;
+                case '\'':
+                    st->state = T_SQUOTE;
+                    return 1;
+                case '"':
+                    st->state = T_DQUOTE;
+                    return 1;
+                case '\\':
+                    st->state = T_ESC;
+                    return 1;
+                case '$':
+                    st->state = T_DOLLAR;
+                    return 1;
+                case '*':
+                case '?':
+                case '[':
+                    w->magic = 1;
+                    break;
+            }
+            put_char(w, c);
+            return 1;
+        case T_ESC:
+        case T_DQ_ESC:
+            st->state = st->state == T_ESC ? T_WORD : T_DQUOTE;
+            if (c != '\n' || st->oneline) put_quoted(w, c);  /* else a continuation */
+            return 1;
+        case T_DOLLAR:
+        case T_DQ_DOLLAR:
+            quoted = st->state == T_DQ_DOLLAR;
+            if (c == '(') {
+                st->sub_len = 0;
+                st->sub_state = S_PLAIN;
+                st->sub_depth = 1;
+                st->sub_quoted = quoted;
+                st->state = T_SUBST;
+                return 1;
+            }
+            if (c == '{' || c == '?' || c == '_' || isalpha((unsigned char)c)) {
+                /* kept as a reference, expanded when the line runs */
+                put_char(w, SHPARSE_VAR);
+                put_char(w, quoted ? '"' : ' ');
+                w->refs = 1;
+                st->var_quoted = quoted;
+                st->var_brace = c == '{';
+                if (c == '?') {
+                    put_char(w, c);
+                    put_char(w, SHPARSE_VAR);
+                    st->state = quoted ? T_DQUOTE : T_WORD;
+                    return 1;
+                }
+                st->state = T_VAR;
+                return c == '{';
+            }
+            if (quoted) put_quoted(w, '$');
+            else put_char(w, '$');
+            st->state = quoted ? T_DQUOTE : T_WORD;
+            return 0;
+        case T_SQUOTE:
+            if (c == '\'') st->state = T_WORD;
+            else put_quoted(w, c);
+            return 1;
+        case T_DQUOTE:
+            if (c == '"') st->state = T_WORD;
+            else if (c == '\\') st->state = T_DQ_ESC;
+            else if (c == '$') st->state = T_DQ_DOLLAR;
+            else put_quoted(w, c);
+            return 1;
+        case T_SUBST:
+            step_substitution(st, c);
+            return 1;
+        case T_VAR:
+            if (c == '_' || isalnum((unsigned char)c)) {
+                put_char(w, c);
+                return 1;
+            }
+            put_char(w, SHPARSE_VAR);
+            st->state = st->var_quoted ? T_DQUOTE : T_WORD;
+            if (!st->var_brace) return 0;
+            if (c != '}') fprintf(stderr, "Missing closing }\n");
+            return c == '}';
+    }
+    return 1;
+}
+
+/* End of the input: end the word being read, if any */
+static void step_end(struct shparse_stream *st)
+{
+    struct word *w = &st->word;
+
+    switch (st->state) {
+        case T_BLANK:
+            return;
+        case T_BLANK_ESC:
+            start_word(st);  /* a lone backslash is an empty word */
+            break;
+        case T_LT:
+            emit(st, op_in);
+            st->state = T_BLANK;
+            return;
+        case T_LT2:
+            emit(st, op_here_doc);
+            st->state = T_BLANK;
+            return;
+        case T_PIPE:
+            emit(st, op_pipe);
+            st->state = T_BLANK;
+            return;
+        case T_DOLLAR:
+            put_char(w, '$');
             break;
-            case '&':
-                w = "&";
-            cur++;
+        case T_SQUOTE:
+            fprintf(stderr, "Missing closing '\n");
             break;
-            case '<':
-                w = "<";
-            cur++;
+        case T_DQ_DOLLAR:
+            put_quoted(w, '$');
+            // fall through
+        case T_DQUOTE:
+        case T_DQ_ESC:
+            fprintf(stderr, "Missing closing \"\n");
             break;
-            case '>':
-                w = ">";
-            cur++;
+        case T_SUBST:
+            fprintf(stderr, "Missing closing )\n");
+            if (st->sub_quoted) fprintf(stderr, "Missing closing \"\n");
             break;
-            case '|':
-                w = "|";
-            cur++;
+        case T_VAR:
+            put_char(w, SHPARSE_VAR);
+            if (st->var_brace) fprintf(stderr, "Missing closing }\n");
+            if (st->var_quoted) fprintf(stderr, "Missing closing \"\n");
             break;
-            default:
-                /* Another word */
-                    cur_buf = buf;
-            read_word(&cur, &cur_buf);
-            w = strdup(buf);
-        }
-        if (w) {
-            tab = xrealloc(tab, (l + 1) * sizeof(char *));
-            tab[l++] = w;
-        }
     }
-    tab = xrealloc(tab, (l + 1) * sizeof(char *));
-    tab[l++] = 0; //last word is zero to signal the end of the command
-    free(buf);
-    return tab;
+    end_word(st);
+    st->state = T_BLANK;
+}
+
+static void stream_init(struct shparse_stream *st, struct shparse_ctx *ctx, int oneline)
+{
+    st->ctx = ctx;
+    st->oneline = oneline;
+    st->state = T_BLANK;
+    st->word.cap = 64;
+    st->word.buf = p_alloc(ctx, st->word.cap);
+    st->word.ctx = ctx;
+    start_word(st);
+    st->sub = 0;
+    st->sub_len = st->sub_cap = 0;
+    st->tab = 0;
+    st->len = 0;
+    st->complete = 0;
+}
+
+static void stream_release(struct shparse_stream *st)
+{
+    for (size_t i = 0; i < st->len; i++)
+        if (!op(st->tab[i])) p_free(st->ctx, st->tab[i]);
+    p_free(st->ctx, st->tab);
+    p_free(st->ctx, st->word.buf);
+    p_free(st->ctx, st->sub);
+}
+
+/* The words of the line, ending with 0, for parse_words(). The directories
+   listed for this line are forgotten. */
+static char **take_words(struct shparse_stream *st)
+{
+    emit(st, 0);  //last word is zero to signal the end of the command
+    char **words = st->tab;
+    st->tab = 0;
+    st->len = 0;
+    pathexp_cache_reset(st->ctx->glob);
+    return words;
 }
 
-static void freeseq(char ***seq)
+static void freeseq(struct shparse_ctx *ctx, char ***seq)
 {
     int i, j;
 
     for (i=0; seq[i]!=0; i++) {
         char **cmd = seq[i];
 
-        for (j=0; cmd[j]!=0; j++) free(cmd[j]);
-        free(cmd);
+        for (j=0; cmd[j]!=0; j++) p_free(ctx, cmd[j]);
+        p_free(ctx, cmd);
     }
-    free(seq);
+    p_free(ctx, seq);
 }
 
 
 /* Free the fields of the structure but not the structure itself */
-static void freecmd(struct cmdline *s)
+static void freecmd(struct shparse_ctx *ctx, struct cmdline *s)
 {
-    if (s->in) free(s->in);
-    if (s->out) free(s->out);
-    if (s->seq) freeseq(s->seq);
-}
-
-
-struct cmdline *parsecmd(char **pline) {
-    char *line = *pline; //get the input from the user in the command line
-
-    /*create return value */
-    static struct cmdline *static_cmdline = 0;
-    struct cmdline *s = static_cmdline;
-    if (s == 0) {
-        /* if s has not been allocated memory */
-        static_cmdline = s = xmalloc(sizeof(struct cmdline));
-    }
-    else {
-        /** if s has been allocated, then free its fields*/
-        freecmd(s);
+    if (s->in) p_free(ctx, s->in);
+    if (s->out) p_free(ctx, s->out);
+    if (s->tee_out) {
+        for (int i = 0; s->tee_out[i] != 0; i++) p_free(ctx, s->tee_out[i]);
+        p_free(ctx, s->tee_out);
     }
+    if (s->here) p_free(ctx, s->here);
+    if (s->here_end) p_free(ctx, s->here_end);
+    if (s->seq) freeseq(ctx, s->seq);
+}
 
+static void clearcmd(struct cmdline *s)
+{
     s->err = 0;
     s->in = 0;
     s->out = 0;
+    s->tee_out = 0;
+    s->here = 0;
+    s->here_end = 0;
     s->seq = 0;
     s->bg = 0;
+    s->fanout = 0;
+}
 
+void shparse_clear(struct shparse_ctx *ctx, struct cmdline *s)
+{
+    freecmd(ctx, s);
+    clearcmd(s);
+}
 
-    if (line == NULL) {
-        freecmd(s);
-        free(s);
-        return static_cmdline = 0;
-    }
 
-    char** words = split_in_words(line);
-    free(line);
-    *pline = NULL;
+/* Build s from the words of a line (freed or kept in s) */
+static int parse_words(struct shparse_ctx *ctx, char **words, struct cmdline *s) {
+    clearcmd(s);
 
     /*To save each command in user input, initially an empty command (lenght 0) */
-    char **cmd = xmalloc(sizeof(char *));
+    char **cmd = p_alloc(ctx, sizeof(char *));
     cmd[0] = 0;
     size_t cmd_len = 0;
 
     /* to save the sequence (a list) of commands, initially empty (lenght 0)*/
-    char ***seq = xmalloc(sizeof(char **));
+    char ***seq = p_alloc(ctx, sizeof(char **));
     seq[0] = 0;
     size_t seq_len = 0;
 
@@ -209,50 +638,72 @@ struct cmdline *parsecmd(char **pline) {
     char *w;
 
     while ((w = words[i++]) != 0) {
-        switch (w[0]) {
+        switch (op(w)) {
 		case '<':
-			/* Tricky : the word can only be "<", defines input file, which should come next */
-			if (s->in != 0) { //input file already define
+			/* Tricky : the word can only be "<", "<<" or "<<<", all define the standard input
+			   (input file, here-document delimiter or here-string), which should come next */
+			if (s->in != 0 || s->here != 0 || s->here_end != 0) { //input already defined
 				s->err = "only one input file supported";
 				goto error;
 			}
 			if (words[i] == 0) { //next word is empty
-				s->err = "filename missing for input redirection";
+				s->err = w[1] == 0 ? "filename missing for input redirection"
+				       : w[2] == 0 ? "delimiter missing for here-document"
+				       : "word missing for here-string";
 				goto error;
 			}
-			switch(words[i][0]){
+			switch(op(words[i])){
 				case '<':
 				case '>':
 				case '&':
 				case '|':
+				case ';':
 				  s->err = "incorrect filename for input redirection";
 				  goto error;
 				default:
 					break;
 			}
-        	s->in = words[i++]; //define input file and go to next word
-        	break;
-		case '>':
-			/* Tricky : the word can only be ">", defines the output file */
-			if (s->out != 0) { //output file already defined
-				s->err = "only one output file supported";
-				goto error;
+			if (w[1] == 0) {
+				s->in = words[i++]; //define input file and go to next word
+			} else if (w[2] == 0) {
+				s->here_end = words[i++]; //body is read by the caller, up to this line
+			} else {
+				/* a here-string is the word followed by a newline */
+				size_t len = strlen(words[i]);
+				s->here = p_alloc(ctx, len + 2);
+				memcpy(s->here, words[i], len);
+				s->here[len] = '\n';
+				s->here[len + 1] = 0;
+				p_free(ctx, words[i++]);
 			}
+			break;
+		case '>':
+			/* Tricky : the word can only be ">", defines an output file. The output
+			   is copied to each of them when there are several */
 			if (words[i] == 0) { //next word is empty
 				s->err = "filename missing for output redirection";
 				goto error;
 			}
-			switch(words[i][0]){ //next word is a "reserved word"
+			switch(op(words[i])){ //next word is a "reserved word"
 				case '<':
 				case '>':
 				case '&':
 				case '|':
+				case ';':
 					s->err = "incorrect filename for output redirection";
 					goto error;
 				default:
 					break;
 			}
-			s->out = words[i++]; //get output file from words[i] and go to the next word
+			if (s->out == 0) {
+				s->out = words[i++]; //get output file from words[i] and go to the next word
+			} else {
+				size_t n = 0;
+				while (s->tee_out && s->tee_out[n]) n++;
+				s->tee_out = p_realloc(ctx, s->tee_out, (n + 2) * sizeof(char *));
+				s->tee_out[n++] = words[i++];
+				s->tee_out[n] = 0;
+			}
 			break;
 		case '&':
 			/* Tricky : the word can only be "&", defines that it should run in background*/
@@ -266,45 +717,56 @@ struct cmdline *parsecmd(char **pline) {
 			}
 			s->bg = 1;
 			break;
+		case ';':
+			/* only the lines read by the shell are cut by ";", into commands */
+			s->err = "command list not supported here";
+			goto error;
 		case '|':
-			/* Tricky : the word can only be "|", defines a piped process*/
+			/* Tricky : the word can only be "|", defines a piped process, or "|+",
+			   defines one more branch reading a copy of the output before the first "|+" */
 			if (cmd_len == 0) { //before a | there must be a command.
 				s->err = "misplaced pipe";
 				goto error;
 			}
+			if (s->fanout != 0 && w == op_pipe) { //branches are single commands
+				s->err = "pipe in a fan-out branch not supported";
+				goto error;
+			}
 			if (words[i] == 0) { //next word is empty
 				s->err = "second command missing for pipe redirection";
 				goto error;
 			}
-			switch(words[i][0]){
+			switch(op(words[i])){
 				case '<':
 				case '>':
 				case '&':
 				case '|':
+				case ';':
 					s->err = "incorrect pipe usage";
 					goto error;
 				default:
 					break;
 			}
         	/* add command to the sequence */
-			seq = xrealloc(seq, (seq_len + 2) * sizeof(char **));
+			seq = p_realloc(ctx, seq, (seq_len + 2) * sizeof(char **));
 			seq[seq_len++] = cmd;
 			seq[seq_len] = 0;
+			if (w == op_fanout && s->fanout == 0) s->fanout = seq_len;
 
-			cmd = xmalloc(sizeof(char *));
+			cmd = p_alloc(ctx, sizeof(char *));
 			cmd[0] = 0;
 			cmd_len = 0;
 			break;
 		default:
 			/* the word is part of a command, add it to the command*/
-			cmd = xrealloc(cmd, (cmd_len + 2) * sizeof(char *));
+			cmd = p_realloc(ctx, cmd, (cmd_len + 2) * sizeof(char *));
 			cmd[cmd_len++] = w;
 			cmd[cmd_len] = 0;
 		}
 	}
 
 	if (cmd_len != 0) { //add the last command to the sequence of commands to execute
-		seq = xrealloc(seq, (seq_len + 2) * sizeof(char **));
+		seq = p_realloc(ctx, seq, (seq_len + 2) * sizeof(char **));
 		seq[seq_len++] = cmd;
 		seq[seq_len] = 0;
 	} else if (seq_len != 0) { //if cmd_len is 0, seq len must be 0 too
@@ -312,34 +774,261 @@ struct cmdline *parsecmd(char **pline) {
 		i--;
 		goto error;
 	} else
-		free(cmd);
-	free(words);
+		p_free(ctx, cmd);
+	p_free(ctx, words);
 	s->seq = seq;
-	return s;
+	return 0;
 error:
 	/* free words memory and s fields, return with error filled only*/
 	while ((w = words[i++]) != 0) {
-		switch (w[0]) {
+		switch (op(w)) {
 		case '&':
 		case '<':
 		case '>':
 		case '|':
+		case ';':
 			break;
 		default:
-			free(w);
+			p_free(ctx, w);
 		}
 	}
-	free(words);
-	freeseq(seq);
-	for (i=0; cmd[i]!=0; i++) free(cmd[i]);
-	free(cmd);
-	if (s->in) {
-		free(s->in);
-		s->in = 0;
-	}
-	if (s->out) {
-		free(s->out);
-		s->out = 0;
-	}
-	return s;
+	p_free(ctx, words);
+	freeseq(ctx, seq);
+	for (i=0; cmd[i]!=0; i++) p_free(ctx, cmd[i]);
+	p_free(ctx, cmd);
+	const char *err = s->err;
+	freecmd(ctx, s);
+	clearcmd(s);
+	s->err = err;
+	return -1;
+}
+
+int shparse_parse(struct shparse_ctx *ctx, const char *line, struct cmdline *s) {
+    struct shparse_stream st;
+
+    stream_init(&st, ctx, 1);
+    while (*line)
+        if (step(&st, *line)) line++;
+    step_end(&st);
+    int r = parse_words(ctx, take_words(&st), s);
+    stream_release(&st);
+    return r;
+}
+
+//------------------------------------------STREAM-----------------------------------------------
+
+struct shparse_stream *shparse_stream_new(struct shparse_ctx *ctx)
+{
+    struct shparse_stream *st = p_alloc(ctx, sizeof(struct shparse_stream));
+    stream_init(st, ctx, 0);
+    return st;
+}
+
+void shparse_stream_free(struct shparse_stream *st)
+{
+    struct shparse_ctx *ctx = st->ctx;
+    stream_release(st);
+    p_free(ctx, st);
+}
+
+size_t shparse_feed(struct shparse_stream *st, const char *data, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n && !st->complete)
+        if (step(st, data[i])) i++;
+    return i;
+}
+
+int shparse_stream_end(struct shparse_stream *st)
+{
+    step_end(st);
+    if (st->len > 0) st->complete = 1;
+    return st->complete;
+}
+
+int shparse_stream_pending(const struct shparse_stream *st)
+{
+    return st->state != T_BLANK || st->len > 0;
+}
+
+int shparse_stream_next(struct shparse_stream *st, struct cmdline *s)
+{
+    if (!st->complete) return 0;
+    st->complete = 0;
+    parse_words(st->ctx, take_words(st), s);
+    return 1;
+}
+
+//------------------------------------------EXPANSION--------------------------------------------
+
+/* Rebuild in w the word text, kept with its references (see end_word()).
+   Their values are put as in "..." if they were quoted or if one is set,
+   for a file name. The first arithmetic error is left in *err. */
+static void expand_refs(struct shparse_ctx *ctx, struct word *w, const char *text,
+                        const char *(*lookup)(void *arg, const char *name), void *arg, int one,
+                        const char **err)
+{
+    for (const char *p = text; *p; ) {
+        char mark = *p;
+
+        if (mark != SHPARSE_VAR && mark != SHPARSE_SUBST && mark != SHPARSE_ARITH) {
+            if (*p == '\\' && p[1]) put_char(w, *p++);  /* quoted, still protected */
+            else if (*p == '*' || *p == '?' || *p == '[') w->magic = 1;
+            put_char(w, *p++);
+            continue;
+        }
+        int quoted = one || p[1] == '"';
+        const char *ref = p + 2, *end = strchr(ref, mark);
+        size_t len = end ? (size_t)(end - ref) : strlen(ref);
+        char *name = memcpy(p_alloc(ctx, len + 1), ref, len);
+        name[len] = 0;
+        p = ref + len + (end != 0);
+
+        if (mark == SHPARSE_VAR) {
+            const char *value = lookup ? lookup(arg, name) : 0;
+            if (value) put_output(w, value, quoted);
+        } else if (mark == SHPARSE_ARITH) {
+            long long value;
+            const char *failed;
+            char digits[24];
+            if (arith_eval(name, lookup, arg, &value, &failed) == 0) {
+                snprintf(digits, sizeof(digits), "%lld", value);
+                put_output(w, digits, quoted);
+            } else if (*err == 0) {
+                *err = failed;
+            }
+        } else {
+            char *out = ctx->substitute ? ctx->substitute(ctx->substitute_arg, name) : 0;
+            if (out) put_output(w, out, quoted);
+            p_free(ctx, out);
+        }
+        if (!quoted) w->split = 1;  /* even empty, so that a lone $(true) is no word at all */
+        p_free(ctx, name);
+    }
+    w->buf[w->len] = 0;
+}
+
+static int has_refs(const char *text)
+{
+    return strpbrk(text, (char[]){SHPARSE_VAR, SHPARSE_SUBST, SHPARSE_ARITH, 0}) != 0;
+}
+
+/* Expand a file name in place */
+static void expand_name(struct shparse_ctx *ctx, char **text,
+                        const char *(*lookup)(void *arg, const char *name), void *arg,
+                        const char **err)
+{
+    if (*text == 0 || !has_refs(*text)) return;
+    struct word w = {p_alloc(ctx, 64), 0, 64, 0, 0, 0, ctx};
+    expand_refs(ctx, &w, *text, lookup, arg, 1, err);
+    p_free(ctx, *text);
+    *text = pathexp_unescape(w.buf);
+}
+
+/* The words of a command once expanded, replacing words (freed) */
+static char **expand_command(struct shparse_ctx *ctx, char **words,
+                             const char *(*lookup)(void *arg, const char *name), void *arg,
+                             const char **err)
+{
+    char **tab = 0;
+    size_t len = 0, k;
+
+    for (k = 0; words[k] && !has_refs(words[k]); k++);
+    if (words[k] == 0) return words;  /* nothing to expand */
+
+    for (k = 0; words[k]; k++) {
+        if (!has_refs(words[k])) {
+            tab = p_realloc(ctx, tab, (len + 1) * sizeof(char *));
+            tab[len++] = words[k];
+            continue;
+        }
+        struct word w = {p_alloc(ctx, 64), 0, 64, 0, 0, 0, ctx};
+        expand_refs(ctx, &w, words[k], lookup, arg, 0, err);
+        add_fields(ctx, &tab, &len, &w);
+        p_free(ctx, w.buf);
+        p_free(ctx, words[k]);
+    }
+    p_free(ctx, words);
+    tab = p_realloc(ctx, tab, (len + 1) * sizeof(char *));
+    tab[len] = 0;
+    pathexp_cache_reset(ctx->glob);
+    return tab;
+}
+
+int shparse_expand(struct shparse_ctx *ctx, struct cmdline *s,
+                   const char *(*lookup)(void *arg, const char *name), void *arg)
+{
+    const char *err = 0;
+
+    expand_name(ctx, &s->in, lookup, arg, &err);
+    expand_name(ctx, &s->out, lookup, arg, &err);
+    expand_name(ctx, &s->here, lookup, arg, &err);
+    for (int i = 0; s->tee_out && s->tee_out[i]; i++) expand_name(ctx, &s->tee_out[i], lookup, arg, &err);
+    for (int i = 0; s->seq && s->seq[i]; i++) {
+        s->seq[i] = expand_command(ctx, s->seq[i], lookup, arg, &err);
+        if (s->seq[i][0] != 0) continue;
+        if (i == 0 && s->seq[1] == 0) {  /* nothing left, as for an empty line */
+            p_free(ctx, s->seq[0]);
+            s->seq[0] = 0;
+            break;
+        }
+        s->seq[i] = p_realloc(ctx, s->seq[i], 2 * sizeof(char *));  /* a command that is not found */
+        s->seq[i][0] = p_strdup(ctx, "");
+        s->seq[i][1] = 0;
+    }
+    if (err == 0) return 0;
+    shparse_clear(ctx, s);  /* nothing of the line runs */
+    s->err = err;
+    return -1;
+}
+
+//------------------------------------------BATCH------------------------------------------------
+
+/* The lines [begin, end) parsed by one thread */
+struct slice {
+    const struct shparse_allocator *a;
+    const char *const *lines;
+    struct cmdline *out;
+    size_t begin, end;
+    long errors;
+};
+
+static void *parse_slice(void *arg)
+{
+    struct slice *sl = arg;
+    struct shparse_ctx *ctx = shparse_new(sl->a);
+
+    for (size_t i = sl->begin; i < sl->end; i++)
+        if (shparse_parse(ctx, sl->lines[i], &sl->out[i]) != 0) sl->errors++;
+    shparse_free(ctx);
+    return 0;
+}
+
+long shparse_batch(const struct shparse_allocator *a, const char *const *lines, size_t n,
+                   struct cmdline *out, int threads)
+{
+    long errors = 0;
+
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    if (threads > BATCH_THREADS_MAX) threads = BATCH_THREADS_MAX;
+    if ((size_t)threads > n) threads = n > 0 ? n : 1;
+
+    struct slice slices[threads];
+    pthread_t tids[threads];
+    int started[threads];
+
+    for (int t = 0; t < threads; t++) {
+        slices[t] = (struct slice){a, lines, out, n * t / threads, n * (t + 1) / threads, 0};
+        /* the calling thread takes the first slice, and any that could not be started */
+        started[t] = t > 0 && pthread_create(&tids[t], 0, parse_slice, &slices[t]) == 0;
+    }
+    for (int t = 0; t < threads; t++)
+        if (!started[t]) parse_slice(&slices[t]);
+    for (int t = 0; t < threads; t++) {
+        if (started[t]) pthread_join(tids[t], 0);
+        errors += slices[t].errors;
+    }
+    return errors;
 }
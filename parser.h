@@ -4,17 +4,112 @@
 
 #ifndef PARSER_H
 #define PARSER_H
-#endif //PARSER_H
 
-struct cmdline *parsecmd(char **pline) ;
+#include <stddef.h>
+
+/* libshparse: the command line parser of the shell, usable by other tools.
+   Everything a parse needs is kept in a context, so separate contexts can
+   be used by separate threads at the same time. */
+
+/* Memory functions of a context, given opaque. They must not return NULL.
+   One allocator shared by several threads must be thread-safe. */
+struct shparse_allocator {
+    void *(*alloc)(void *opaque, size_t size);
+    void *(*realloc)(void *opaque, void *p, size_t size);
+    void (*free)(void *opaque, void *p);
+    void *opaque;
+};
+
+struct shparse_ctx;
+struct cmdline;
+
+/* New context allocating with a, or with malloc() (aborting when it fails)
+   if a is 0 */
+struct shparse_ctx *shparse_new(const struct shparse_allocator *a);
+void shparse_free(struct shparse_ctx *ctx);
+
+/* Set the function running the command line of a $(...) substitution, for
+   shparse_expand(). It returns what the command wrote on its standard
+   output, in a string allocated with the allocator of ctx, or 0 on failure.
+   Without it, a substitution expands to nothing. */
+void shparse_set_substitution(struct shparse_ctx *ctx, char *(*run)(void *arg, const char *cmd), void *arg);
+
+/* Parse line into s, a newline in it being an ordinary character. Returns
+   0, or -1 with only s->err set. The fields of s are allocated from ctx,
+   and freed (and zeroed) by shparse_clear(). */
+int shparse_parse(struct shparse_ctx *ctx, const char *line, struct cmdline *s);
+void shparse_clear(struct shparse_ctx *ctx, struct cmdline *s);
+
+/* Variables ($NAME, ${NAME} and $?), substitutions ($(...)) and
+   arithmetic ($((...))) are not expanded by a parse, so that a parsed line
+   can run again with other values. A word holding one is kept as read, its
+   quoted characters protected by a backslash. A variable is kept in it as
+   SHPARSE_VAR, '"' if it is in "..." or else ' ', its name and SHPARSE_VAR;
+   a substitution is kept the same way with SHPARSE_SUBST around the text
+   of its command, and arithmetic with SHPARSE_ARITH around "(EXPR)". */
+#define SHPARSE_VAR '\035'
+#define SHPARSE_SUBST '\034'
+#define SHPARSE_ARITH '\037'
+
+/* Expand the variables, substitutions and arithmetic in the words and file
+   names of s. lookup() gives the value of a variable, NULL when it is not
+   set, and the function of shparse_set_substitution() runs the
+   substitutions. Unquoted in a word, what they give is split on blanks and
+   is a pattern for pathname expansion; a word with nothing left is removed.
+   Returns 0, or -1 with only s->err set when an arithmetic expression
+   fails (see arith_eval()). */
+int shparse_expand(struct shparse_ctx *ctx, struct cmdline *s,
+                   const char *(*lookup)(void *arg, const char *name), void *arg);
 
-/* Structure returned by parsecmd() function. seq is the sequence of commands */
+/* Streaming parse: the input is fed in pieces of any size, and parsed as it
+   comes, so a long line is never held whole. A line ends at a newline or a
+   ";" out of quotes; a backslash-newline continues it, and so does a
+   newline in quotes or in a $(...), which is kept. shparse_parse() does not
+   take ";": the line has an error. */
+struct shparse_stream;
+struct shparse_stream *shparse_stream_new(struct shparse_ctx *ctx);
+void shparse_stream_free(struct shparse_stream *st);
+
+/* Feed n bytes of input. Returns how many were used: all of them, or up to
+   the end of a line, which shparse_stream_next() must take first. */
+size_t shparse_feed(struct shparse_stream *st, const char *data, size_t n);
+
+/* The input ended: a line in progress ends too. Returns 1 if there is a
+   line for shparse_stream_next(). */
+int shparse_stream_end(struct shparse_stream *st);
+
+/* Whether a line is in progress, so more input is needed to end it */
+int shparse_stream_pending(const struct shparse_stream *st);
+
+/* If a line ended, parse it into s (as shparse_parse() does) and return 1,
+   otherwise return 0 */
+int shparse_stream_next(struct shparse_stream *st, struct cmdline *s);
+
+/* Parse lines[0..n-1] into out[0..n-1] with up to threads threads (one per
+   online processor if threads is 0, 256 at most), each with its own
+   context on a. The results are not expanded. Returns the number of lines
+   with an error. Each result is freed by shparse_clear() on any context
+   using a. */
+long shparse_batch(const struct shparse_allocator *a, const char *const *lines, size_t n,
+                   struct cmdline *out, int threads);
+
+/* Structure filled by shparse_parse(). seq is the sequence of commands */
 struct cmdline {
-    char *err;	    /* If not null, it is an error message that should be
-                        displayed. The other fields are null. */
+    const char *err; /* If not null, it is an error message (a static string)
+                        that should be displayed. The other fields are null. */
     char *in;	    /* If not null : name of file for input redirection. */
     char *out;	    /* If not null : name of file for output redirection. */
+    char **tee_out; /* If not null : null terminated array of the names of the
+                        other output files, when the line has several ">".
+                        The output is copied to all of them and to out. */
+    char *here;	    /* If not null : text fed to the standard input, from a
+                        here-string or a here-document. */
+    char *here_end; /* If not null : delimiter of a here-document. The parser
+                        only sees one line, the caller reads the body up to
+                        this delimiter and stores it in here. */
     int   bg;       /* If set the command must run in background */
+    int   fanout;   /* If not 0 : index in seq of the first branch of a
+                        fan-out, see below. */
     char ***seq;	/* See comment below */
 };
 
@@ -26,4 +121,12 @@ A command is an array of strings (char **), whose last item is a null pointer.
 A sequence is an array of commands (char ***), whose last item is a null
 pointer.
 When the user enters an empty line, seq[0] is NULL.
+
+Fan-out : "a | b |+ c |+ d" gives seq = {a, b, c, d} and fanout = 2. The
+pipeline is seq[0] to seq[fanout - 1], and each command from seq[fanout] on
+is a branch reading its own copy of the output of seq[fanout - 1], called
+the producer. A branch is a single command. The output redirections apply to
+the producer, with or without branches.
 */
+
+#endif //PARSER_H
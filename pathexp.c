@@ -0,0 +1,509 @@
+//
+// Pathname expansion (globbing) for unquoted words.
+//
+// Directories are read with large getdents64() batches instead of
+// readdir(), and each listing is cached (keyed by device, inode and mtime)
+// for the rest of the command line, so "*.log *.log.gz" lists a huge
+// directory only once. Each pattern component is compiled once into a small
+// opcode array before being matched against every name.
+//
+// The cache belongs to the caller (one per parser context), so expansions
+// in different threads share nothing. All memory comes from the allocator
+// of the context.
+//
+
+#define _GNU_SOURCE
+
+#include "pathexp.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DENTS_BUF_SIZE (1 << 20)  /* bytes asked to getdents64 per call */
+#define DIR_CACHE_SIZE 16         /* directory listings kept per command line */
+#define PATTERN_MAX 256           /* a component longer than NAME_MAX never matches */
+
+/* Record layout returned by getdents64, glibc does not export it */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Every name of a directory packed one after the other, NUL separated */
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *names;
+    size_t names_len;
+    unsigned char *types;  /* d_type of each name, in the same order */
+    size_t count;
+    int pinned;            /* in use by an expansion, must not be evicted */
+    int cached;            /* 0 for a one-shot listing the caller frees */
+};
+
+struct pathexp_cache {
+    struct shparse_allocator a;
+    struct dir_listing dir_cache[DIR_CACHE_SIZE];
+    size_t dir_cache_len;
+    char *dents_buf;
+};
+
+static void *c_alloc(struct pathexp_cache *c, size_t size)
+{
+    return c->a.alloc(c->a.opaque, size);
+}
+
+static void *c_realloc(struct pathexp_cache *c, void *p, size_t size)
+{
+    return c->a.realloc(c->a.opaque, p, size);
+}
+
+static void c_free(struct pathexp_cache *c, void *p)
+{
+    if (p) c->a.free(c->a.opaque, p);
+}
+
+enum { OP_CHAR, OP_ANY, OP_STAR, OP_CLASS };
+
+struct op {
+    unsigned char kind;
+    unsigned char c;       /* OP_CHAR: the character */
+    unsigned short cls;    /* OP_CLASS: index in classes */
+};
+
+/* One compiled path component */
+struct pattern {
+    struct op ops[PATTERN_MAX];
+    size_t n;
+    uint32_t classes[PATTERN_MAX / 3 + 1][8];  /* 256 bit sets, "[x]" is 3 chars */
+    size_t nclasses;
+    int dot;               /* pattern starts with a literal '.', may match dot files */
+};
+
+//------------------------------------------DIRECTORY LISTINGS----------------------------------
+
+static void free_listing(struct pathexp_cache *c, struct dir_listing *d)
+{
+    c_free(c, d->names);
+    c_free(c, d->types);
+    d->names = 0;
+    d->types = 0;
+    d->count = d->names_len = 0;
+}
+
+/* Read the whole directory open on fd into d */
+static int read_listing(struct pathexp_cache *c, int fd, struct dir_listing *d)
+{
+    size_t names_cap = 0, types_cap = 0;
+    char *dents_buf;
+
+    if (c->dents_buf == 0) c->dents_buf = c_alloc(c, DENTS_BUF_SIZE);
+    dents_buf = c->dents_buf;
+    d->names = 0;
+    d->types = 0;
+    d->names_len = d->count = 0;
+
+    while (1) {
+        long n = syscall(SYS_getdents64, fd, dents_buf, DENTS_BUF_SIZE);
+        if (n == -1) {
+            free_listing(c, d);
+            return -1;
+        }
+        if (n == 0) return 0;
+
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(dents_buf + off);
+            off += e->d_reclen;
+
+            const char *name = e->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+
+            size_t l = strlen(name) + 1;
+            if (d->names_len + l > names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 4096;
+                while (d->names_len + l > names_cap) names_cap *= 2;
+                d->names = c_realloc(c, d->names, names_cap);
+            }
+            if (d->count == types_cap) {
+                types_cap = types_cap ? types_cap * 2 : 256;
+                d->types = c_realloc(c, d->types, types_cap);
+            }
+            memcpy(d->names + d->names_len, name, l);
+            d->names_len += l;
+            d->types[d->count++] = e->d_type;
+        }
+    }
+}
+
+/* Return the listing of path, from the cache when the directory did not change
+   since it was read. The result is pinned and must be given back to
+   release_dir(). */
+static struct dir_listing *list_dir(struct pathexp_cache *cache, const char *path)
+{
+    struct dir_listing *dir_cache = cache->dir_cache;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct dir_listing *d = 0;
+    struct stat st;
+    size_t i;
+
+    if (fd == -1) return 0;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    for (i = 0; i < cache->dir_cache_len; i++) {
+        struct dir_listing *c = &dir_cache[i];
+        if (c->dev != st.st_dev || c->ino != st.st_ino) continue;
+        if (c->mtime.tv_sec == st.st_mtim.tv_sec && c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            close(fd);
+            c->pinned++;
+            return c;
+        }
+        /* stale: reuse the slot, unless an expansion is still walking it */
+        if (!c->pinned) {
+            free_listing(cache, c);
+            d = c;
+        }
+        break;
+    }
+
+    if (d == 0 && i == cache->dir_cache_len) {
+        if (cache->dir_cache_len < DIR_CACHE_SIZE) {
+            d = &dir_cache[cache->dir_cache_len++];
+        } else {
+            for (i = 0; i < DIR_CACHE_SIZE && d == 0; i++)
+                if (!dir_cache[i].pinned) d = &dir_cache[i];
+            if (d) free_listing(cache, d);
+        }
+    }
+    if (d) {
+        d->cached = 1;
+    } else {
+        d = c_alloc(cache, sizeof(*d));
+        d->cached = 0;
+    }
+
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    d->pinned = 1;
+    if (read_listing(cache, fd, d) == -1) {
+        d->dev = 0;
+        d->ino = 0;
+        d->pinned = 0;
+        if (!d->cached) c_free(cache, d);
+        d = 0;
+    }
+    close(fd);
+    return d;
+}
+
+static void release_dir(struct pathexp_cache *c, struct dir_listing *d)
+{
+    if (d->cached) {
+        d->pinned--;
+    } else {
+        free_listing(c, d);
+        c_free(c, d);
+    }
+}
+
+struct pathexp_cache *pathexp_cache_new(const struct shparse_allocator *a)
+{
+    struct pathexp_cache *c = a->alloc(a->opaque, sizeof(struct pathexp_cache));
+
+    memset(c, 0, sizeof(*c));
+    c->a = *a;
+    return c;
+}
+
+void pathexp_cache_reset(struct pathexp_cache *c)
+{
+    for (size_t i = 0; i < c->dir_cache_len; i++) free_listing(c, &c->dir_cache[i]);
+    c->dir_cache_len = 0;
+}
+
+void pathexp_cache_free(struct pathexp_cache *c)
+{
+    pathexp_cache_reset(c);
+    c_free(c, c->dents_buf);
+    c_free(c, c);
+}
+
+//------------------------------------------PATTERNS--------------------------------------------
+
+/* Does the component contain an unprotected *, ? or [ */
+static int has_magic(const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) s++;
+        else if (*s == '*' || *s == '?' || *s == '[') return 1;
+    }
+    return 0;
+}
+
+/* Compile a bracket expression starting after '['. Returns a pointer after the
+   closing ']', or 0 if there is none (the '[' is then an ordinary char). */
+static const char *compile_class(const char *s, uint32_t *set)
+{
+    int negate = 0, first = 1;
+
+    memset(set, 0, 8 * sizeof(uint32_t));
+    if (*s == '!' || *s == '^') {
+        negate = 1;
+        s++;
+    }
+    while (*s && (first || *s != ']')) {
+        unsigned char lo, hi;
+        if (*s == '\\' && s[1]) s++;
+        lo = hi = (unsigned char)*s++;
+        if (s[0] == '-' && s[1] && s[1] != ']') {
+            s++;
+            if (*s == '\\' && s[1]) s++;
+            hi = (unsigned char)*s++;
+        }
+        for (unsigned c = lo; c <= hi; c++) set[c >> 5] |= 1u << (c & 31);
+        first = 0;
+    }
+    if (*s != ']') return 0;
+    if (negate)
+        for (int i = 0; i < 8; i++) set[i] = ~set[i];
+    return s + 1;
+}
+
+static int compile_pattern(const char *s, struct pattern *p)
+{
+    p->n = 0;
+    p->nclasses = 0;
+    p->dot = (s[0] == '.' || (s[0] == '\\' && s[1] == '.'));
+
+    while (*s) {
+        struct op *o;
+        const char *end;
+
+        if (p->n == PATTERN_MAX) return -1;
+        o = &p->ops[p->n++];
+        switch (*s) {
+            case '*':
+                /* consecutive stars are a single one */
+                if (p->n > 1 && p->ops[p->n - 2].kind == OP_STAR) p->n--;
+                else o->kind = OP_STAR;
+                s++;
+                break;
+            case '?':
+                o->kind = OP_ANY;
+                s++;
+                break;
+            case '[':
+                /* more classes than a name of NAME_MAX chars can hold never match */
+                if (p->nclasses == sizeof(p->classes) / sizeof(p->classes[0])) return -1;
+                end = compile_class(s + 1, p->classes[p->nclasses]);
+                if (end) {
+                    o->kind = OP_CLASS;
+                    o->cls = (unsigned short)p->nclasses++;
+                    s = end;
+                    break;
+                }
+                o->kind = OP_CHAR;
+                o->c = *s++;
+                break;
+            case '\\':
+                if (s[1]) s++;
+                /* fall through */
+            default:
+                o->kind = OP_CHAR;
+                o->c = (unsigned char)*s++;
+        }
+    }
+    return 0;
+}
+
+/* Match with a single backtracking point: on mismatch, let the last star
+   swallow one more character and retry from there. */
+static int pattern_match(const struct pattern *p, const char *name)
+{
+    const unsigned char *s = (const unsigned char *)name;
+    const unsigned char *star_s = 0;
+    size_t pi = 0, star_pi = 0;
+
+    while (*s) {
+        if (pi < p->n) {
+            const struct op *o = &p->ops[pi];
+            switch (o->kind) {
+                case OP_STAR:
+                    star_pi = ++pi;
+                    star_s = s;
+                    continue;
+                case OP_ANY:
+                    pi++;
+                    s++;
+                    continue;
+                case OP_CHAR:
+                    if (*s == o->c) {
+                        pi++;
+                        s++;
+                        continue;
+                    }
+                    break;
+                case OP_CLASS:
+                    if (p->classes[o->cls][*s >> 5] & (1u << (*s & 31))) {
+                        pi++;
+                        s++;
+                        continue;
+                    }
+                    break;
+            }
+        }
+        if (star_s == 0) return 0;
+        pi = star_pi;
+        s = ++star_s;
+    }
+    while (pi < p->n && p->ops[pi].kind == OP_STAR) pi++;
+    return pi == p->n;
+}
+
+//------------------------------------------EXPANSION-------------------------------------------
+
+struct matches {
+    char **tab;
+    size_t len;
+    size_t cap;
+};
+
+static void add_match(struct pathexp_cache *c, struct matches *m, char *path)
+{
+    if (m->len == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->tab = c_realloc(c, m->tab, m->cap * sizeof(char *));
+    }
+    m->tab[m->len++] = path;
+}
+
+static char *join(struct pathexp_cache *c, const char *dir, const char *name, const char *suffix)
+{
+    size_t ld = strlen(dir), ln = strlen(name), ls = strlen(suffix);
+    char *p = c_alloc(c, ld + ln + ls + 1);
+    memcpy(p, dir, ld);
+    memcpy(p + ld, name, ln);
+    memcpy(p + ld + ln, suffix, ls + 1);
+    return p;
+}
+
+static int is_dir(struct pathexp_cache *c, const char *dir, const char *name, unsigned char type)
+{
+    struct stat st;
+    int r;
+
+    if (type == DT_DIR) return 1;
+    if (type != DT_LNK && type != DT_UNKNOWN) return 0;
+    char *p = join(c, dir, name, "");
+    r = stat(p, &st) == 0 && S_ISDIR(st.st_mode);
+    c_free(c, p);
+    return r;
+}
+
+/* dir is the already expanded prefix, empty or ending with '/'. rest is what
+   is left of the pattern. */
+static void expand_in(struct pathexp_cache *c, const char *dir, const char *rest, struct matches *m)
+{
+    const char *slash = strchr(rest, '/');
+    size_t clen = slash ? (size_t)(slash - rest) : strlen(rest);
+    const char *next = 0;
+    char *comp = c_alloc(c, clen + 1);
+
+    memcpy(comp, rest, clen);
+    comp[clen] = 0;
+    if (slash) {
+        next = slash;
+        while (*next == '/') next++;
+    }
+
+    if (!has_magic(comp)) {
+        struct stat st;
+        char *p = join(c, dir, pathexp_unescape(comp), slash ? "/" : "");
+        if (next && *next) expand_in(c, p, next, m);
+        else if (lstat(p, &st) == 0) {
+            add_match(c, m, p);
+            p = 0;
+        }
+        c_free(c, p);
+        c_free(c, comp);
+        return;
+    }
+
+    struct pattern *pat = c_alloc(c, sizeof(struct pattern));
+    struct dir_listing *d;
+    if (compile_pattern(comp, pat) == -1 || (d = list_dir(c, *dir ? dir : ".")) == 0) {
+        c_free(c, pat);
+        c_free(c, comp);
+        return;
+    }
+
+    const char *name = d->names;
+    for (size_t i = 0; i < d->count; name += strlen(name) + 1, i++) {
+        if (name[0] == '.' && !pat->dot) continue;
+        if (!pattern_match(pat, name)) continue;
+        if (!slash) {
+            add_match(c, m, join(c, dir, name, ""));
+        } else if (is_dir(c, dir, name, d->types[i])) {
+            char *p = join(c, dir, name, "/");
+            if (*next) {
+                expand_in(c, p, next, m);
+                c_free(c, p);
+            } else {
+                add_match(c, m, p);
+            }
+        }
+    }
+    release_dir(c, d);
+    c_free(c, pat);
+    c_free(c, comp);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+size_t pathexp_expand(struct pathexp_cache *c, const char *pattern, char ***tab, size_t *len)
+{
+    struct matches m = {0, 0, 0};
+
+    if (pattern[0] == '/') {
+        while (*pattern == '/') pattern++;
+        expand_in(c, "/", pattern, &m);
+    } else {
+        expand_in(c, "", pattern, &m);
+    }
+    if (m.len == 0) return 0;
+
+    qsort(m.tab, m.len, sizeof(char *), compare_paths);
+    *tab = c_realloc(c, *tab, (*len + m.len + 1) * sizeof(char *));
+    memcpy(*tab + *len, m.tab, m.len * sizeof(char *));
+    *len += m.len;
+    c_free(c, m.tab);
+    return m.len;
+}
+
+char *pathexp_unescape(char *pattern)
+{
+    char *r = pattern, *w = pattern;
+
+    while (*r) {
+        if (*r == '\\' && r[1]) r++;
+        *w++ = *r++;
+    }
+    *w = 0;
+    return pattern;
+}
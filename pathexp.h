@@ -0,0 +1,33 @@
+//
+// Pathname expansion (globbing) for unquoted words.
+//
+
+#ifndef PATHEXP_H
+#define PATHEXP_H
+
+#include <stddef.h>
+
+#include "parser.h"  /* struct shparse_allocator */
+
+/* Patterns handed to these functions use backslash to protect characters that
+   were quoted on the command line, so "a\*b" only matches the file named a*b. */
+
+/* Directory listings read by the expansions, and the allocator they use */
+struct pathexp_cache;
+
+struct pathexp_cache *pathexp_cache_new(const struct shparse_allocator *a);
+void pathexp_cache_free(struct pathexp_cache *c);
+
+/* Expand pattern and append every match (sorted) to the NULL-less array *tab
+   of length *len, growing it with the allocator of c. Returns the number of
+   matches; when it is 0, nothing was appended and the caller should keep the
+   word. */
+size_t pathexp_expand(struct pathexp_cache *c, const char *pattern, char ***tab, size_t *len);
+
+/* Remove the protecting backslashes from a pattern, in place. */
+char *pathexp_unescape(char *pattern);
+
+/* Forget cached directory listings. Called once per command line. */
+void pathexp_cache_reset(struct pathexp_cache *c);
+
+#endif //PATHEXP_H
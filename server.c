@@ -0,0 +1,443 @@
+//
+// Command server: runs command lines sent by local clients over a Unix
+// domain socket.
+//
+// One thread polls the listening socket and the idle clients. A client
+// with input is handed to a bounded pool of workers; the worker runs the
+// complete lines it sent, answers, and gives the client back to the poll
+// loop. Clients waiting for input therefore never hold a worker.
+//
+// Requests are one line each:
+//     run CMDLINE         the output of the commands is discarded
+//     capture CMDLINE     the output of the commands is sent back
+// and each is answered by
+//     status N stdout LEN stderr LEN\n<stdout bytes><stderr bytes>
+// (LEN is 0 without capture), or "error MESSAGE\n". N is the exit status of
+// the last command, 128 + the signal number if it was killed. A background
+// line is answered as soon as it started, or queued as the shell queues it
+// over set maxjobs or set maxload. Of the builtins, which share the state
+// of the shell, only test, [, set maxjobs and set maxload are run; wc -l,
+// grep -F and head -n run as in the shell.
+//
+
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "cond.h"
+#include "shell.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_LINE (1 << 20)   /* a client sending a longer line is dropped */
+#define MAX_WORKERS 256
+
+/* A connected client, with what it sent that was not handled yet */
+struct client {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct client *next;
+};
+
+/* Output of a captured command */
+struct output {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+/* parsecmd() returns a static structure: a worker copies it under this lock
+   and starts the commands of the copy without it. The capture pipes are
+   close-on-exec and the children close all but 0, 1 and 2 before running
+   anything, so none keeps the write end of another worker's pipe. */
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Clients with input, waiting for a worker */
+static struct client *ready_head = 0, *ready_tail = 0;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+/* Clients given back by the workers, to be polled again */
+static struct client *returned = 0;
+static pthread_mutex_t returned_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_fds[2];  /* a worker writes a byte here to wake the poll loop */
+
+static int null_in = -1, null_out = -1;
+
+//------------------------------------------RUNNING A LINE---------------------------------------
+
+static void append(struct output *o, const char *data, size_t n)
+{
+    if (o->len + n > o->cap) {
+        o->cap = o->cap ? o->cap : 4096;
+        while (o->len + n > o->cap) o->cap *= 2;
+        o->buf = xrealloc(o->buf, o->cap);
+    }
+    memcpy(o->buf + o->len, data, n);
+    o->len += n;
+}
+
+/* Read both pipes until the commands close them */
+static void drain(int out_fd, int err_fd, struct output *out, struct output *err)
+{
+    struct pollfd pfds[2] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}};
+    struct output *dest[2] = {out, err};
+    char buf[65536];
+    int open_fds = 2;
+
+    while (open_fds > 0) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (pfds[i].fd == -1 || pfds[i].revents == 0) continue;
+            ssize_t n = read(pfds[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                append(dest[i], buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                pfds[i].fd = -1;
+                open_fds--;
+            }
+        }
+    }
+    close(out_fd);
+    close(err_fd);
+}
+
+/* Run the builtin command argv if a worker can: test and [, whose messages
+   go to the output of the server, and set maxjobs or set maxload, which
+   take jobs_lock. Returns 0 or an error message. */
+static const char *run_builtin(char **argv, int *status)
+{
+    if (!strcmp(argv[0], "test") || !strcmp(argv[0], "[")) {
+        *status = WEXITSTATUS(cond_test(argv));
+        return 0;
+    }
+    if (!strcmp(argv[0], "set") && argv[1] != 0 && argv[2] != 0 && argv[3] == 0 &&
+        (!strcmp(argv[1], "maxjobs") || !strcmp(argv[1], "maxload"))) {
+        char option[256];
+        snprintf(option, sizeof(option), "%s %s", argv[1], argv[2]);
+        *status = WEXITSTATUS(set_option(option));
+        return 0;
+    }
+    return "this builtin is not supported by the server";
+}
+
+/* Queue the background line l as the shell does over set maxjobs or set
+   maxload. A queued line starts later with the server's own standard
+   input and output, so it reads and writes /dev/null instead unless it
+   redirects them: its output is not captured. Returns 1 if queued. */
+static int queue_line(struct cmdline *l)
+{
+    char *in = l->in, *out = l->out;
+    int queued;
+
+    if (in == 0 && l->here == 0) l->in = "/dev/null";
+    if (out == 0) l->out = "/dev/null";
+    queued = queue_job(l);  /* it takes jobs_lock */
+    l->in = in;
+    l->out = out;
+    return queued;
+}
+
+/* Run a command line and wait for it unless it is a background one.
+   Returns 0 or an error message. */
+static const char *run_line(const char *text, int capture, int *status,
+                            struct output *out, struct output *err)
+{
+    int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+    int fds[3] = {null_in, null_out, null_out};
+    const char *error = 0;
+    char *line = xstrdup(text);
+    struct cmdline *l = 0;
+    pid_t *pids = 0;
+    int n = 0, bg = 0;
+
+    *status = 0;
+    pthread_mutex_lock(&parse_lock);
+    struct cmdline *parsed = parsecmd(&line);
+    if (parsed->err != 0) error = parsed->err;
+    else if (parsed->here_end != 0) error = "here-documents are not supported by the server";
+    else if (parsed->seq[0] != 0) l = cmdline_copy(parsed);
+    pthread_mutex_unlock(&parse_lock);
+    if (error || l == 0) return error;
+    const char *name = l->seq[0][0];
+    int test = !strcmp(name, "test") || !strcmp(name, "[");
+    /* test and [ in a pipeline or in the background run the program, as in the shell */
+    if (is_builtin(name) && !(test && (l->seq[1] != 0 || l->bg))) {
+        error = run_builtin(l->seq[0], status);
+        cmdline_free(l);
+        return error;
+    }
+    if (l->bg && queue_line(l)) {
+        cmdline_free(l);
+        return 0;
+    }
+
+    if (capture) {
+        if (pipe2(out_pipe, O_CLOEXEC) == -1 || pipe2(err_pipe, O_CLOEXEC) == -1) {
+            if (out_pipe[0] != -1) {
+                close(out_pipe[0]);
+                close(out_pipe[1]);
+            }
+            cmdline_free(l);
+            return "pipe failed";
+        }
+        fds[STDOUT_FILENO] = out_pipe[1];
+        fds[STDERR_FILENO] = err_pipe[1];
+    }
+    pids = xmalloc(seq_len(l) * sizeof(pid_t));
+    n = launch_pipeline(l, fds, pids, 0, 0);
+    bg = l->bg;
+    cmdline_free(l);
+    if (capture) {
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+    }
+
+    if (capture && n > 0) {
+        drain(out_pipe[0], err_pipe[0], out, err);
+    } else if (capture) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+    }
+    if (!bg && n > 0) {
+        int st = wait_pipeline(pids, n);
+        *status = WIFSIGNALED(st) ? 128 + WTERMSIG(st) : WEXITSTATUS(st);
+    }
+    xfree(pids);
+    return 0;
+}
+
+//------------------------------------------CLIENTS----------------------------------------------
+
+static int send_all(int fd, const char *data, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = send(fd, data, n, MSG_NOSIGNAL);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static int handle_request(int fd, char *line)
+{
+    struct output out = {0, 0, 0}, err = {0, 0, 0};
+    const char *error;
+    char header[128];
+    int capture, status, r;
+
+    if (!strncmp(line, "run ", 4)) {
+        capture = 0;
+        line += 4;
+    } else if (!strncmp(line, "capture ", 8)) {
+        capture = 1;
+        line += 8;
+    } else {
+        return send_all(fd, "error unknown request\n", 22);
+    }
+
+    reap_jobs();  /* the background lines that ended since, not left as zombies */
+    error = run_line(line, capture, &status, &out, &err);
+    if (error) {
+        snprintf(header, sizeof(header), "error %s\n", error);
+        return send_all(fd, header, strlen(header));
+    }
+    snprintf(header, sizeof(header), "status %d stdout %zu stderr %zu\n", status, out.len, err.len);
+    r = send_all(fd, header, strlen(header));
+    if (r == 0 && out.len) r = send_all(fd, out.buf, out.len);
+    if (r == 0 && err.len) r = send_all(fd, err.buf, err.len);
+    xfree(out.buf);
+    xfree(err.buf);
+    return r;
+}
+
+/* Read what the client sent and run its complete lines. Returns -1 when
+   the client is gone and must be closed. */
+static int serve_client(struct client *c)
+{
+    char *nl;
+
+    if (c->cap - c->len < 4096) {
+        c->cap = c->cap ? c->cap * 2 : 8192;
+        c->buf = xrealloc(c->buf, c->cap);
+    }
+    ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return 0;
+    if (n <= 0) return -1;
+    c->len += n;
+
+    while ((nl = memchr(c->buf, '\n', c->len)) != 0) {
+        size_t used = nl + 1 - c->buf;
+        *nl = 0;
+        if (handle_request(c->fd, c->buf) == -1) return -1;
+        memmove(c->buf, nl + 1, c->len - used);
+        c->len -= used;
+    }
+    return c->len > MAX_LINE ? -1 : 0;
+}
+
+static void close_client(struct client *c)
+{
+    close(c->fd);
+    xfree(c->buf);
+    xfree(c);
+}
+
+static void *worker(void *arg)
+{
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&ready_lock);
+        while (ready_head == 0) pthread_cond_wait(&ready_cond, &ready_lock);
+        struct client *c = ready_head;
+        ready_head = c->next;
+        if (ready_head == 0) ready_tail = 0;
+        pthread_mutex_unlock(&ready_lock);
+
+        if (serve_client(c) == -1) {
+            close_client(c);
+            continue;
+        }
+        pthread_mutex_lock(&returned_lock);
+        c->next = returned;
+        returned = c;
+        pthread_mutex_unlock(&returned_lock);
+        while (write(wake_fds[1], "", 1) == -1 && errno == EINTR);
+    }
+    return 0;
+}
+
+//------------------------------------------POLL LOOP--------------------------------------------
+
+int serve(const char *path, int workers)
+{
+    struct sockaddr_un addr;
+    struct client **idle = 0;
+    struct pollfd *pfds = 0;
+    size_t idle_len = 0, idle_cap = 0;
+    pthread_t tid;
+
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd == -1) {
+        perror("socket failed");
+        return 1;
+    }
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, SOMAXCONN) == -1) {
+        perror("Error listening on socket");
+        return 1;
+    }
+    if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe failed");
+        return 1;
+    }
+    null_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    null_out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&tid, 0, worker, 0) != 0) {
+            perror("Error creating worker");
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    printf("Serving on %s with %d workers\n", path, workers);
+    fflush(stdout);
+
+    while (1) {
+        size_t i;
+
+        pfds = xrealloc(pfds, (idle_len + 2) * sizeof(struct pollfd));
+        pfds[0] = (struct pollfd){lfd, POLLIN, 0};
+        pfds[1] = (struct pollfd){wake_fds[0], POLLIN, 0};
+        for (i = 0; i < idle_len; i++) pfds[i + 2] = (struct pollfd){idle[i]->fd, POLLIN, 0};
+
+        if (poll(pfds, idle_len + 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            return 1;
+        }
+
+        /* hand the clients with input to the workers, keep the others */
+        size_t kept = 0;
+        for (i = 0; i < idle_len; i++) {
+            struct client *c = idle[i];
+            if (pfds[i + 2].revents == 0) {
+                idle[kept++] = c;
+                continue;
+            }
+            c->next = 0;
+            pthread_mutex_lock(&ready_lock);
+            if (ready_tail) ready_tail->next = c;
+            else ready_head = c;
+            ready_tail = c;
+            pthread_cond_signal(&ready_cond);
+            pthread_mutex_unlock(&ready_lock);
+        }
+        idle_len = kept;
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept4(lfd, 0, 0, SOCK_CLOEXEC);
+            if (fd != -1) {
+                struct client *c = xmalloc(sizeof(struct client));
+                c->fd = fd;
+                c->buf = 0;
+                c->len = c->cap = 0;
+                if (idle_len == idle_cap) {
+                    idle_cap = idle_cap ? idle_cap * 2 : 64;
+                    idle = xrealloc(idle, idle_cap * sizeof(struct client *));
+                }
+                idle[idle_len++] = c;
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            char drop[256];
+            while (read(wake_fds[0], drop, sizeof(drop)) > 0);
+            pthread_mutex_lock(&returned_lock);
+            struct client *c = returned;
+            returned = 0;
+            pthread_mutex_unlock(&returned_lock);
+            while (c) {
+                struct client *next = c->next;
+                if (idle_len == idle_cap) {
+                    idle_cap = idle_cap ? idle_cap * 2 : 64;
+                    idle = xrealloc(idle, idle_cap * sizeof(struct client *));
+                }
+                idle[idle_len++] = c;
+                c = next;
+            }
+        }
+    }
+}
@@ -0,0 +1,14 @@
+//
+// Command server: runs command lines sent by local clients over a Unix
+// domain socket.
+//
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Listen on the Unix socket at path and serve clients until killed.
+   workers is the size of the pool running the commands, 0 for one per
+   online CPU. Returns the exit status of the shell. */
+int serve(const char *path, int workers);
+
+#endif //SERVER_H
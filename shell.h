@@ -0,0 +1,65 @@
+//
+// Pipeline execution and job table of main.c, for the other modules.
+//
+
+#ifndef SHELL_H
+#define SHELL_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "cmdline.h"
+
+extern int verbose;                 /* print the parsed commands and the children */
+extern pthread_mutex_t jobs_lock;   /* protects the job table */
+
+/* Start one command with the given standard input, output and error (-1
+   keeps the shell's own), in process group pgid (0 for a new one, -1 for
+   the shell's), returns its pid */
+pid_t spawn_command(char **command, const int *stage_fds, pid_t pgid);
+
+/* waitpid() for a command started by spawn_command() */
+pid_t wait_child(pid_t pid, int *status, int options);
+
+/* Start the commands of l connected by pipes. fds (may be 0) replaces the
+   standard input of the first command, the standard output of the last one
+   and the standard error of all of them, for entries other than -1. These
+   fds should be close-on-exec. If group is set, the commands are put in a
+   new process group led by the first one started. A background pipeline
+   is job job_id in the job table, or a new job if it is 0. Returns the
+   number of commands, their pids are stored in pids (-1 for one whose
+   redirection failed). */
+int launch_pipeline(struct cmdline *l, const int *fds, pid_t *pids, int group, int job_id);
+
+/* Wait for the commands of a foreground pipeline, returns the wait status
+   of the last one */
+int wait_pipeline(pid_t *pids, int n);
+
+/* Redirect the standard input and output of the shell itself as asked by
+   the <, <<, <<< and > of l, the old ones being kept in saved[0] and
+   saved[1]. Returns -1 after printing an error, nothing redirected then. */
+int redirect_shell(const struct cmdline *l, int *saved);
+
+/* Put back the standard input and output that redirect_shell() saved */
+void restore_shell(const struct cmdline *l, const int *saved);
+
+/* Queue the background pipeline l, copied, if set maxjobs or set maxload
+   keeps it from starting now; it starts later with the shell's standard
+   input, output and error. Returns 0 if it may start now, 1 if it was
+   queued or refused because the job table is full. */
+int queue_job(struct cmdline *l);
+
+/* Collect the commands of background jobs that exited, without waiting */
+void reap_jobs(void);
+
+/* set NAME VALUE: change an option of the shell, args being "NAME VALUE".
+   Returns a wait status. */
+int set_option(char *args);
+
+/* Whether name is a builtin or starts a loop, run by the shell itself */
+int is_builtin(const char *name);
+
+/* Number of commands in l->seq */
+int seq_len(struct cmdline *l);
+
+#endif //SHELL_H
@@ -0,0 +1,255 @@
+//
+// Latency of the foreground pipelines of the session, by command name.
+//
+// Each name has a histogram of fixed size, as HdrHistogram does: the times,
+// in microseconds, are counted exactly below 128, then in buckets of 64
+// per power of two, so a percentile is within 1.6% of the true value from
+// 1 us to 38 hours, in 8 KB per name whatever the number of commands.
+// Histograms are merged by adding their counts, which is how a file saved
+// by other sessions is loaded.
+//
+// The names are kept in an open-addressing table. Past MAX_NAMES, the
+// commands of new names are counted under "(other)".
+//
+
+#include "stats.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SUB_BITS 6
+#define LINEAR (2 << SUB_BITS)               /* 128 values counted exactly */
+#define MAX_SHIFT 30                          /* up to 2^37 us */
+#define BUCKETS (LINEAR + MAX_SHIFT * (1 << SUB_BITS))
+#define SLOTS 1024
+#define MAX_NAMES (SLOTS * 3 / 4)
+#define FILE_HEADER "# unix_shell latency histograms 1\n"
+
+struct histogram {
+    char *name;
+    unsigned long long count;
+    unsigned long long sum;   /* us */
+    unsigned long long max;   /* us */
+    uint32_t *buckets;
+};
+
+static struct histogram table[SLOTS];
+static size_t names = 0;
+static char *file = 0;
+
+static unsigned long hash(const char *s)
+{
+    unsigned long h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+/* The histogram of name, added if it is new */
+static struct histogram *find(const char *name)
+{
+    size_t h = hash(name) % SLOTS;
+
+    while (table[h].name != 0) {
+        if (!strcmp(table[h].name, name)) return &table[h];
+        h = (h + 1) % SLOTS;
+    }
+    /* the last name left is for "(other)": the table never fills up */
+    if (names >= MAX_NAMES - 1 && strcmp(name, "(other)")) return find("(other)");
+    table[h].name = xstrdup(name);
+    table[h].buckets = xmalloc(BUCKETS * sizeof(uint32_t));
+    memset(table[h].buckets, 0, BUCKETS * sizeof(uint32_t));
+    names++;
+    return &table[h];
+}
+
+static unsigned bucket(unsigned long long us)
+{
+    if (us < LINEAR) return us;
+    int shift = 63 - __builtin_clzll(us) - SUB_BITS;
+    if (shift > MAX_SHIFT) return BUCKETS - 1;
+    return LINEAR + (shift - 1) * (1 << SUB_BITS) + (unsigned)(us >> shift) - (1 << SUB_BITS);
+}
+
+/* Highest value counted in bucket b */
+static unsigned long long bucket_top(unsigned b)
+{
+    if (b < LINEAR) return b;
+    unsigned shift = (b - LINEAR) / (1 << SUB_BITS) + 1;
+    unsigned long long sub = (b - LINEAR) % (1 << SUB_BITS) + (1 << SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static void add(struct histogram *h, unsigned b, unsigned long long n)
+{
+    unsigned long long c = h->buckets[b] + n;
+    h->buckets[b] = c > UINT32_MAX ? UINT32_MAX : c;
+}
+
+void stats_record(const char *name, long long ns)
+{
+    struct histogram *h = find(name);
+    unsigned long long us = ns > 0 ? (unsigned long long)ns / 1000 : 0;
+
+    add(h, bucket(us), 1);
+    h->count++;
+    h->sum += us;
+    if (us > h->max) h->max = us;
+}
+
+/* Value under which percent of the commands of h took, in us */
+static unsigned long long percentile(const struct histogram *h, int percent)
+{
+    unsigned long long rank = (h->count * percent + 99) / 100, seen = 0;
+
+    for (unsigned b = 0; b < BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0) return bucket_top(b) < h->max ? bucket_top(b) : h->max;
+    }
+    return h->max;
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const struct histogram *x = *(const struct histogram *const *)a, *y = *(const struct histogram *const *)b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static void print(FILE *out)
+{
+    const struct histogram **sorted = xmalloc((names + 1) * sizeof(struct histogram *));
+    size_t n = 0;
+
+    for (size_t s = 0; s < SLOTS; s++)
+        if (table[s].name && table[s].count) sorted[n++] = &table[s];
+    qsort(sorted, n, sizeof(struct histogram *), by_count);
+
+    fprintf(out, "------------------Latency------------------\n");
+    fprintf(out, "%-20s %8s %10s %10s %10s %10s %10s\n", "command", "count", "mean ms", "p50 ms", "p90 ms", "p99 ms",
+            "max ms");
+    for (size_t k = 0; k < n; k++) {
+        const struct histogram *h = sorted[k];
+        fprintf(out, "%-20s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", h->name, h->count,
+                h->sum / 1e3 / h->count, percentile(h, 50) / 1e3, percentile(h, 90) / 1e3,
+                percentile(h, 99) / 1e3, h->max / 1e3);
+    }
+    xfree(sorted);
+}
+
+/* Write the histograms to path, through a temporary file renamed over it */
+static int save(const char *path)
+{
+    char *tmp = xmalloc(strlen(path) + 5);
+    FILE *f;
+
+    sprintf(tmp, "%s.tmp", path);
+    if ((f = fopen(tmp, "we")) == 0) {
+        xfree(tmp);
+        return -1;
+    }
+    fputs(FILE_HEADER, f);
+    for (size_t s = 0; s < SLOTS; s++) {
+        const struct histogram *h = &table[s];
+        if (h->name == 0 || h->count == 0 || strpbrk(h->name, "\t\n")) continue;
+        fprintf(f, "%s\t%llu %llu %llu", h->name, h->count, h->sum, h->max);
+        for (unsigned b = 0; b < BUCKETS; b++)
+            if (h->buckets[b]) fprintf(f, " %u:%u", b, h->buckets[b]);
+        fputc('\n', f);
+    }
+    int failed = ferror(f) | (fclose(f) != 0);
+    if (!failed && rename(tmp, path) == -1) failed = 1;
+    if (failed) unlink(tmp);
+    xfree(tmp);
+    return failed ? -1 : 0;
+}
+
+/* Add the histograms of path. Returns -1 if it cannot be read, 1 if it
+   is not a file of histograms. */
+static int load(const char *path)
+{
+    FILE *f = fopen(path, "re");
+    char *line = 0;
+    size_t cap = 0;
+    int status = 0;
+
+    if (f == 0) return -1;
+    if (getline(&line, &cap, f) == -1 || strcmp(line, FILE_HEADER)) status = 1;
+    while (status == 0 && getline(&line, &cap, f) != -1) {
+        char *tab = strchr(line, '\t'), *p;
+        unsigned long long count, sum, max, n;
+        unsigned b;
+        int used;
+
+        if (tab == 0 || sscanf(tab + 1, "%llu %llu %llu%n", &count, &sum, &max, &used) != 3) {
+            status = 1;
+            break;
+        }
+        *tab = 0;
+        struct histogram *h = find(line);
+        h->count += count;
+        h->sum += sum;
+        if (max > h->max) h->max = max;
+        for (p = tab + 1 + used; sscanf(p, " %u:%llu%n", &b, &n, &used) == 2; p += used)
+            if (b < BUCKETS) add(h, b, n);
+    }
+    free(line);  /* from getline() */
+    fclose(f);
+    return status;
+}
+
+static void reset(void)
+{
+    for (size_t s = 0; s < SLOTS; s++) {
+        if (table[s].name == 0) continue;
+        xfree(table[s].name);
+        xfree(table[s].buckets);
+        memset(&table[s], 0, sizeof(struct histogram));
+    }
+    names = 0;
+}
+
+void stats_set_file(const char *path)
+{
+    xfree(file);
+    file = path ? xstrdup(path) : 0;
+    if (file && load(file) > 0) printf("stats: %s: not a file of histograms\n", file);
+}
+
+const char *stats_file(void)
+{
+    return file;
+}
+
+void stats_exit(void)
+{
+    if (file && save(file) == -1) perror("Error saving the latency histograms");
+}
+
+int stats_builtin(char **args)
+{
+    if (args[0] == 0) {
+        print(stdout);
+        return 0;
+    }
+    if (!strcmp(args[0], "reset") && args[1] == 0) {
+        reset();
+        return 0;
+    }
+    if (!strcmp(args[0], "save") && args[1] != 0 && args[2] == 0) {
+        if (save(args[1]) == 0) return 0;
+        perror("Error saving the latency histograms");
+        return 1 << 8;
+    }
+    if (!strcmp(args[0], "load") && args[1] != 0 && args[2] == 0) {
+        int status = load(args[1]);
+        if (status == 0) return 0;
+        if (status < 0) perror("Error loading the latency histograms");
+        else printf("stats: %s: not a file of histograms\n", args[1]);
+        return 1 << 8;
+    }
+    printf("usage: stats [save FILE | load FILE | reset]\n");
+    return 2 << 8;
+}
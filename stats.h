@@ -0,0 +1,31 @@
+//
+// Latency of the foreground pipelines of the session, by command name, in
+// histograms of fixed size that can be kept across sessions.
+//
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/* Record a foreground pipeline started by command name that took ns
+   nanoseconds. Called by the main thread only. */
+void stats_record(const char *name, long long ns);
+
+/* stats                 print p50, p90, p99 and max by command
+   stats save FILE       write the histograms to FILE
+   stats load FILE       add the histograms of FILE to those of the session
+   stats reset           forget them
+   Returns the wait status. */
+int stats_builtin(char **args);
+
+/* The file the histograms are loaded from now and saved to by
+   stats_exit(), NULL for none */
+void stats_set_file(const char *path);
+const char *stats_file(void);
+
+/* Save the histograms to the file of stats_set_file(), if any, when the
+   shell exits */
+void stats_exit(void);
+
+#endif //STATS_H
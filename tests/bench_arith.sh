@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Benchmark: evaluations per second of $((...)) against $(expr ...), which
+# forks the program. Each is timed in a loop whose body exports the result,
+# a builtin, with the time of the same loop exporting a constant taken off:
+# EVALUATIONS iterations for expr, ten times as many for $((...)).
+#
+#     bench_arith.sh SHELL [EVALUATIONS]
+#
+# EVALUATIONS defaults to 10000.
+#
+
+shell=${1:?usage: bench_arith.sh SHELL [EVALUATIONS]}
+n=${2:-10000}
+
+# Milliseconds for a loop of COUNT iterations running BODY
+run() {
+    start=$(date +%s%N)
+    printf 'for i in $(seq %d)\ndo %s\ndone\n' "$1" "$2" | "$shell" > /dev/null 2>&1
+    echo $((($(date +%s%N) - start) / 1000000))
+}
+
+base=$(run $((n * 10)) 'export R=1')
+arith=$(run $((n * 10)) 'export R=$((i * 3 + 7 % 5))')
+expr=$(run "$n" "export R=\$(expr \$i '*' 3 + 7 % 5)")
+
+printf "%-10s %12s %10s %14s\n" "form" "evaluations" "ms" "evaluations/s"
+for row in "\$((...)) $((n * 10)) $((arith - base))" "\$(expr) $n $((expr - base / 10))"; do
+    echo $row | awk '{ printf "%-10s %12d %10d %14.0f\n", $1, $2, $3, ($3 > 0 ? $2 * 1000 / $3 : 0) }'
+done
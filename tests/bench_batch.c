@@ -0,0 +1,97 @@
+//
+// Benchmark: shparse_batch() on a corpus of LINES command lines with 1, 2,
+// 4... threads, up to twice the online processors. The corpus is parsed in
+// chunks, which are freed between calls and not timed, so that memory stays
+// bounded. For each number of threads the lines per second and the speedup
+// over one thread are reported.
+//
+//     bench_batch [LINES] [THREADS...]
+//
+// LINES defaults to 10000000.
+//
+
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK 100000
+
+static const char *templates[] = {
+    "ls -l",
+    "cat < in.txt | grep -F x | wc -l > out.txt",
+    "sort < in.txt > a.txt > b.txt",
+    "echo a |+ wc -c |+ head -n 1",
+    "cat <<< \"a here-string\"",
+    "sleep 1 &",
+    "echo $HOME ${USER} $? '$HOME' \"$HOME\"",
+    "echo $((1 + 2 * 3)) $((X ? 1 : 2))",
+    "echo 'quoted | not a pipe' \\> not a redirection",
+    "find . -name '*.c' | xargs grep -n main | sort | uniq -c | sort -rn | head",
+    "ls |",
+    "cat < a < b",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Seconds to parse the n lines with threads threads */
+static double run(struct shparse_ctx *ctx, const char *const *lines, size_t n, struct cmdline *out, int threads)
+{
+    double total = 0;
+
+    for (size_t k = 0; k < n; k += CHUNK) {
+        size_t len = n - k < CHUNK ? n - k : CHUNK;
+        double start = now();
+        shparse_batch(0, lines + k, len, out, threads);
+        total += now() - start;
+        for (size_t i = 0; i < len; i++) shparse_clear(ctx, &out[i]);
+    }
+    return total;
+}
+
+/* Print the line of threads threads; the first one run is the base of the speedups */
+static void report(struct shparse_ctx *ctx, const char *const *lines, size_t n, struct cmdline *out, int threads)
+{
+    static double base;
+    double seconds = run(ctx, lines, n, out, threads);
+
+    if (base == 0) base = seconds;
+    printf("%7d %10.3f %14.0f %8.2f\n", threads, seconds, n / seconds, base / seconds);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], 0, 10) : 10000000, ntemplates = sizeof(templates) / sizeof(templates[0]);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const char **lines = malloc((n ? n : 1) * sizeof(char *));
+    struct cmdline *out = calloc(CHUNK, sizeof(struct cmdline));
+    struct shparse_ctx *ctx = shparse_new(0);
+
+    if (lines == 0 || out == 0) {
+        perror("bench_batch");
+        return 1;
+    }
+    for (size_t k = 0; k < n; k++) lines[k] = templates[k * 7 % ntemplates];
+    if (cpus <= 0) cpus = 1;
+
+    printf("%zu lines, %ld processors\n", n, cpus);
+    printf("%7s %10s %14s %8s\n", "threads", "seconds", "lines/s", "speedup");
+    if (argc > 2) {
+        for (int a = 2; a < argc; a++)
+            if (atoi(argv[a]) > 0) report(ctx, lines, n, out, atoi(argv[a]));
+    } else {
+        for (int threads = 1; threads <= 2 * cpus; threads *= 2) report(ctx, lines, n, out, threads);
+    }
+    shparse_free(ctx);
+    free(out);
+    free(lines);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Benchmark: the cost of spawning a command with VARIABLES variables in the
+# environment, with and without --zygote. The shell is started with them
+# exported and runs COMMANDS lines of /bin/true; the time per line is
+# reported. It only needs /bin/true lines, so that builds of the shell from
+# before the envp cache can be compared.
+#
+#     bench_env.sh SHELL [COMMANDS] [VARIABLES...]
+#
+# COMMANDS defaults to 3000 and VARIABLES to 0 500 1000.
+#
+
+shell=${1:?usage: bench_env.sh SHELL [COMMANDS] [VARIABLES...]}
+n=${2:-3000}
+[ $# -gt 2 ] && shift 2 || set -- 0 500 1000
+
+printf "%-10s %-8s %8s %12s\n" "variables" "mode" "count" "ms per line"
+for vars in "$@"; do
+    for mode in fork zygote; do
+        flag=
+        [ "$mode" = zygote ] && flag=--zygote
+        start=$(date +%s%N)
+        awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true" }' |
+            env $(awk -v n="$vars" 'BEGIN { for (i = 0; i < n; i++) printf "BENCH_VAR_%d=value_of_a_variable_%d\n", i, i }') \
+            "$shell" $flag > /dev/null 2>&1
+        ns=$(($(date +%s%N) - start))
+        awk -v v="$vars" -v m="$mode" -v n="$n" -v ns="$ns" \
+            'BEGIN { printf "%-10s %-8s %8d %12.3f\n", v, m, n, ns / n / 1e6 }'
+    done
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Benchmark: pathname expansion in a directory of ENTRIES files. Each
+# pattern is expanded on RUNS command lines; the time of the same lines
+# with a word that is not a pattern is taken off, which leaves the listing
+# of the directory and the matching.
+#
+#     bench_glob.sh SHELL [ENTRIES] [RUNS]
+#
+# ENTRIES defaults to 1000000 and RUNS to 20.
+#
+
+shell=${1:?usage: bench_glob.sh SHELL [ENTRIES] [RUNS]}
+entries=${2:-1000000}
+runs=${3:-20}
+dir=${TMPDIR:-/tmp}/bench_glob.$$
+
+mkdir -p "$dir" || exit 1
+echo "creating $entries files in $dir"
+(cd "$dir" && awk -v n="$entries" 'BEGIN { for (i = 0; i < n; i++) printf "f%07d.txt\n", i }' | xargs touch)
+
+# Milliseconds to run RUNS lines "true WORD"
+run() {
+    start=$(date +%s%N)
+    awk -v n="$runs" -v w="$1" 'BEGIN { for (i = 0; i < n; i++) print "true " w }' | "$shell" > /dev/null 2>&1
+    echo $((($(date +%s%N) - start) / 1000000))
+}
+
+base=$(run "$dir/f0000001.txt")
+printf "%-24s %12s\n" "pattern" "ms per line"
+for pattern in 'f0012345*' '*99999.txt' 'f00[0-4]?123.txt' '*.log'; do
+    ms=$(run "$dir/$pattern")
+    awk -v p="$pattern" -v ms="$ms" -v base="$base" -v n="$runs" \
+        'BEGIN { printf "%-24s %12.1f\n", p, (ms - base) / n }'
+done
+rm -rf "$dir"
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Benchmark: ITERATIONS iterations of a for and of a while loop against the
+# same commands generated one line per iteration, which the shell reads and
+# parses each time. The bodies are builtins, so that no fork hides the cost
+# of reading and parsing.
+#
+#     bench_loop.sh SHELL [ITERATIONS]
+#
+# ITERATIONS defaults to 100000.
+#
+
+shell=${1:?usage: bench_loop.sh SHELL [ITERATIONS]}
+n=${2:-100000}
+
+# Milliseconds for the shell to run its standard input
+run() {
+    start=$(date +%s%N)
+    "$shell" > /dev/null 2>&1
+    echo $((($(date +%s%N) - start) / 1000000))
+}
+
+for_loop=$(printf 'for i in $(seq %d)\ndo [ $i -gt 0 ]\ndone\n' "$n" | run)
+for_lines=$(awk -v n="$n" 'BEGIN { for (i = 1; i <= n; i++) print "[ " i " -gt 0 ]" }' | run)
+while_loop=$(printf 'export I=0\nwhile [ $I -lt %d ]\ndo export I=$((I + 1))\ndone\n' "$n" | run)
+while_lines=$(awk -v n="$n" 'BEGIN {
+    for (i = 0; i < n; i++) { print "[ " i " -lt " n " ]"; print "export I=$((" i " + 1))" }
+}' | run)
+
+printf "%-8s %12s %12s %8s\n" "loop" "loop ms" "lines ms" "speedup"
+for row in "for $for_loop $for_lines" "while $while_loop $while_lines"; do
+    echo $row | awk '{ printf "%-8s %12d %12d %8.2f\n", $1, $2, $3, $3 / ($2 ? $2 : 1) }'
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Benchmark: the latency of spawning a command from a shell grown to SIZE
+# megabytes, with and without --zygote. The shell is grown by reading a
+# line of SIZE megabytes into a variable; then COMMANDS runs of /bin/true
+# are timed by the stats builtin.
+#
+#     bench_spawn.sh SHELL [COMMANDS] [SIZES...]
+#
+# COMMANDS defaults to 2000 and SIZES to 10 1024.
+#
+
+shell=${1:?usage: bench_spawn.sh SHELL [COMMANDS] [SIZES...]}
+n=${2:-2000}
+[ $# -gt 2 ] && shift 2 || set -- 10 1024
+tmp=${TMPDIR:-/tmp}/bench_spawn.$$
+
+printf "%-10s %-8s %8s %10s %10s %10s\n" "size MB" "mode" "count" "mean ms" "p50 ms" "p99 ms"
+for size in "$@"; do
+    head -c $((size * 1024 * 1024)) /dev/zero | tr '\0' x > "$tmp"
+    echo >> "$tmp"
+    for mode in fork zygote; do
+        flag=
+        [ "$mode" = zygote ] && flag=--zygote
+        {
+            echo "read -r BIG < $tmp"
+            echo "stats reset"
+            awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true" }'
+            echo "stats"
+        } | "$shell" $flag 2>&1 | awk -v size="$size" -v mode="$mode" \
+            '$1 == "/bin/true" { printf "%-10s %-8s %8s %10s %10s %10s\n", size, mode, $2, $3, $4, $6 }'
+    done
+done
+rm -f "$tmp"
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Test: the shell has as many fds open after PIPELINES pipelines as before
+# them, with pipes, redirections, here-strings and fan-outs among them.
+#
+#     fd_count.sh SHELL [PIPELINES]
+#
+# PIPELINES defaults to 100000. Exits with 1 if the count changed.
+#
+
+shell=${1:?usage: fd_count.sh SHELL [PIPELINES]}
+n=${2:-100000}
+tmp=${TMPDIR:-/tmp}/fd_count.$$
+
+{
+    echo memstats
+    awk -v n="$n" -v tmp="$tmp" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            if (i % 5 == 0) print "true | true";
+            else if (i % 5 == 1) print "echo x > " tmp;
+            else if (i % 5 == 2) print "wc -c < " tmp " > /dev/null";
+            else if (i % 5 == 3) print "cat <<< x | wc -c > /dev/null";
+            else print "echo x |+ wc -c |+ wc -l > /dev/null";
+        }
+    }'
+    echo memstats
+} | "$shell" 2>&1 | sed -n 's/^.*open: \([0-9]*\)$/\1/p' > "$tmp.counts"
+
+before=$(sed -n 1p "$tmp.counts")
+after=$(sed -n 2p "$tmp.counts")
+rm -f "$tmp" "$tmp.counts"
+
+echo "$n pipelines: $before fds open before, $after after"
+[ -n "$before" ] && [ "$before" = "$after" ]
@@ -0,0 +1,84 @@
+//
+// Test: the bytes allocated through xmalloc() stay flat while command
+// lines are parsed, expanded, copied and freed, errors included.
+//
+//     parse_leak [LINES]
+//
+// LINES defaults to 1000000. Exits with 1 if the live bytes grew.
+//
+
+#include "cmdline.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *lines[] = {
+    "ls -l",
+    "cat < in.txt | grep -F x | wc -l > out.txt",
+    "sort < in.txt > a.txt > b.txt",
+    "echo a |+ wc -c |+ head -n 1",
+    "cat <<< \"a here-string\"",
+    "cat << EOF",
+    "sleep 1 &",
+    "echo $HOME ${USER} $? '$HOME' \"$HOME\"",
+    "echo $((1 + 2 * 3)) $((X ? 1 : 2))",
+    "echo $(date) \"$(date)\"",
+    "echo /nonexistent/*.c /nonexistent/[ab]?",
+    "echo 'quoted | not a pipe' \\> not a redirection",
+    "ls |",
+    "| ls",
+    "cat <",
+    "cat < a < b",
+    "echo >",
+    "echo $((1 +))",
+    "echo $((1 / 0))",
+    "",
+};
+
+static const char *variable(const char *name)
+{
+    return strcmp(name, "X") ? "value with  blanks" : "1";
+}
+
+static char *substitution(const char *cmd)
+{
+    (void)cmd;
+    return xstrdup("substituted output");
+}
+
+/* Parse line as the shell does, and copy it as a queued job would */
+static void parse(const char *line)
+{
+    char *text = xstrdup(line);
+    struct cmdline *l = parsecmd(&text);
+
+    if (l->err == 0 && cmdline_expand(l) == 0 && l->seq[0] != 0) {
+        struct cmdline *copy = cmdline_copy(l);
+        shift_words(copy, 1);
+        cmdline_free(copy);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long count = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t n = sizeof(lines) / sizeof(lines[0]), before, after;
+
+    parser_set_variables(variable);
+    parser_set_substitution(substitution);
+
+    /* the first lines allocate what is kept for good: the context, its caches */
+    for (size_t k = 0; k < 2 * n; k++) parse(lines[k % n]);
+    before = memstats_live_bytes();
+    for (long k = 0; k < count; k++) parse(lines[k % n]);
+    after = memstats_live_bytes();
+
+    printf("%ld lines: %zu live bytes before, %zu after\n", count, before, after);
+    if (after > before) {
+        memstats_print(stdout);
+        return 1;
+    }
+    return 0;
+}
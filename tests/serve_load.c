@@ -0,0 +1,188 @@
+//
+// Load generator for unix_shell --serve: each client sends "run COMMAND" on
+// its own connection, one request at a time, for a few seconds. For each
+// number of clients the commands per second and the latency percentiles of
+// the requests are reported.
+//
+//     serve_load [-d SECONDS] [-c COMMAND] SOCKET [CLIENTS...]
+//
+// CLIENTS defaults to 1 2 4 8 16 32 and COMMAND to "true". Exits with 1 if
+// a request failed.
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+struct client {
+    pthread_t tid;
+    const char *path;
+    const char *request;
+    double deadline;
+    double *latency;   /* seconds, one per request */
+    size_t len, cap;
+    int failed;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read the answer to one request: its header, then the output it gives
+   the length of. Returns -1 on error or if the request failed. */
+static int read_answer(int fd)
+{
+    char header[256], buf[4096];
+    size_t len = 0, out, err;
+    int status;
+
+    while (len == 0 || header[len - 1] != '\n') {
+        if (len == sizeof(header) - 1) return -1;
+        ssize_t n = read(fd, header + len, 1);
+        if (n <= 0) return -1;
+        len++;
+    }
+    header[len] = 0;
+    if (sscanf(header, "status %d stdout %zu stderr %zu", &status, &out, &err) != 3) return -1;
+    for (size_t left = out + err; left > 0;) {
+        ssize_t n = read(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (n <= 0) return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+static void *run_client(void *arg)
+{
+    struct client *c = arg;
+    size_t n = strlen(c->request);
+    int fd = connect_to(c->path);
+
+    if (fd == -1) {
+        c->failed = 1;
+        return 0;
+    }
+    while (!c->failed && now() < c->deadline) {
+        double start = now();
+        if (write(fd, c->request, n) != (ssize_t)n || read_answer(fd) == -1) {
+            c->failed = 1;
+            break;
+        }
+        if (c->len == c->cap) {
+            c->cap = c->cap ? 2 * c->cap : 1024;
+            c->latency = realloc(c->latency, c->cap * sizeof(double));
+        }
+        c->latency[c->len++] = now() - start;
+    }
+    close(fd);
+    return 0;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Run clients clients for seconds, print their line. Returns -1 if a
+   request failed. */
+static int run(const char *path, const char *request, int clients, double seconds)
+{
+    struct client *c = calloc(clients, sizeof(struct client));
+    double start = now(), *all;
+    size_t total = 0;
+    int failed = 0;
+
+    for (int k = 0; k < clients; k++) {
+        c[k] = (struct client){0, path, request, start + seconds, 0, 0, 0, 0};
+        if (pthread_create(&c[k].tid, 0, run_client, &c[k]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int k = 0; k < clients; k++) {
+        pthread_join(c[k].tid, 0);
+        total += c[k].len;
+        failed |= c[k].failed;
+    }
+    double elapsed = now() - start;
+
+    all = malloc((total ? total : 1) * sizeof(double));
+    total = 0;
+    for (int k = 0; k < clients; k++) {
+        memcpy(all + total, c[k].latency, c[k].len * sizeof(double));
+        total += c[k].len;
+        free(c[k].latency);
+    }
+    qsort(all, total, sizeof(double), by_value);
+    if (total > 0)
+        printf("%7d %10zu %12.0f %10.3f %10.3f %10.3f\n", clients, total, total / elapsed,
+               all[total / 2] * 1e3, all[total * 99 / 100] * 1e3, all[total - 1] * 1e3);
+    else
+        printf("%7d %10d %12s\n", clients, 0, "-");
+    free(all);
+    free(c);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const int default_clients[] = {1, 2, 4, 8, 16, 32};
+    const char *command = "true";
+    double seconds = 2;
+    int a = 1, failed = 0;
+
+    for (; a + 1 < argc && argv[a][0] == '-'; a += 2) {
+        if (!strcmp(argv[a], "-d")) seconds = atof(argv[a + 1]);
+        else if (!strcmp(argv[a], "-c")) command = argv[a + 1];
+        else break;
+    }
+    if (a >= argc || argv[a][0] == '-' || seconds <= 0) {
+        fprintf(stderr, "usage: serve_load [-d SECONDS] [-c COMMAND] SOCKET [CLIENTS...]\n");
+        return 2;
+    }
+    const char *path = argv[a++];
+    char *request = malloc(strlen(command) + 6);
+    sprintf(request, "run %s\n", command);
+
+    printf("%7s %10s %12s %10s %10s %10s\n", "clients", "requests", "commands/s", "p50 ms", "p99 ms", "max ms");
+    if (a == argc) {
+        for (size_t k = 0; k < sizeof(default_clients) / sizeof(default_clients[0]); k++)
+            failed |= run(path, request, default_clients[k], seconds) == -1;
+    }
+    for (; a < argc; a++) {
+        int clients = atoi(argv[a]);
+        if (clients > 0) failed |= run(path, request, clients, seconds) == -1;
+    }
+    fflush(stdout);
+    if (failed) fprintf(stderr, "serve_load: a request failed: %s\n", strerror(errno));
+    free(request);
+    return failed;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Soak: drive the shell with COMMANDS mixed command lines (pipelines,
+# redirections, here-strings, background jobs, builtins and parse errors),
+# then fail if its resident memory, open fds, live bytes or p99 latency
+# kept growing over the run, as the health builtin judges them from the
+# windows it sampled.
+#
+#     soak.sh SHELL [COMMANDS]
+#
+# COMMANDS defaults to 2000000, in 64 windows. Exits with 1 if a metric
+# kept growing.
+#
+
+shell=${1:?usage: soak.sh SHELL [COMMANDS]}
+n=${2:-2000000}
+tmp=${TMPDIR:-/tmp}/soak.$$
+window=$((n / 64))
+[ "$window" -gt 0 ] || window=1
+
+{
+    echo "set health $window"
+    awk -v n="$n" -v tmp="$tmp" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            k = i % 10;
+            if (k == 0) print "true | true";
+            else if (k == 1) print "echo line " i " > " tmp;
+            else if (k == 2) print "wc -c < " tmp " | head -n 1 > /dev/null";
+            else if (k == 3) print "cat <<< x |+ wc -c |+ wc -l > /dev/null";
+            else if (k == 4) print "true &";
+            else if (k == 5) print "ls |";
+            else if (k == 6) print "cat < a < b";
+            else if (k == 7) print "export SOAK=" i;
+            else if (k == 8) print "[ $SOAK -gt 0 ]";
+            else print "echo $((SOAK % 7)) > /dev/null";
+        }
+    }'
+    echo "wait"
+    echo "health"
+    echo 'echo "health status $?"'
+} | "$shell" > "$tmp.out" 2>&1
+
+sed -n '/------------------Health/,/^$/p' "$tmp.out" | sed 's/^myshell>//'
+status=$(sed -n 's/^.*health status \([0-9]*\)$/\1/p' "$tmp.out")
+rm -f "$tmp" "$tmp.out"
+[ "$status" = 0 ]
@@ -0,0 +1,506 @@
+//
+// Text builtins: wc -l, grep -F and head -n, run in a forked child of the
+// shell instead of executing the program.
+//
+// Regular files are mapped in memory, pipes and terminals are read in large
+// blocks. Counting newlines and looking for a literal use AVX2 or SSE2 when
+// the processor has them, chosen once at run time, or plain C otherwise.
+// The literal search compares the first and the last byte of the pattern
+// with 32 (or 16) positions at once and only checks the rest of the pattern
+// where both match.
+//
+
+#define _GNU_SOURCE
+
+#include "textcmd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define READ_SIZE (1 << 20)   /* block read from a pipe, grown for longer lines */
+
+//------------------------------------------KERNELS----------------------------------------------
+
+static size_t count_scalar(const char *p, size_t n)
+{
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++) c += p[i] == '\n';
+    return c;
+}
+
+static const char *find_scalar(const char *p, size_t n, const char *pat, size_t m)
+{
+    return memmem(p, n, pat, m);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2,popcnt")))
+static size_t count_sse2(const char *p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t c = 0, i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+    return c + count_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const char *p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t c = 0, i = 0;
+
+    for (; i + 64 <= n; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        c += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)));
+        c += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)));
+    }
+    return c + count_sse2(p + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *p, size_t n, const char *pat, size_t m)
+{
+    if (m < 2) return find_scalar(p, n, pat, m);
+    const __m128i first = _mm_set1_epi8(pat[0]), last = _mm_set1_epi8(pat[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(p + i + bit + 1, pat + 1, m - 2) == 0) return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(p + i, n - i, pat, m);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *p, size_t n, const char *pat, size_t m)
+{
+    if (m < 2) return find_scalar(p, n, pat, m);
+    const __m256i first = _mm256_set1_epi8(pat[0]), last = _mm256_set1_epi8(pat[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                              _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(p + i + bit + 1, pat + 1, m - 2) == 0) return p + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(p + i, n - i, pat, m);
+}
+#endif
+
+static size_t (*count_newlines)(const char *p, size_t n) = count_scalar;
+static const char *(*find_literal)(const char *p, size_t n, const char *pat, size_t m) = find_scalar;
+
+static void select_kernels(void)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        count_newlines = count_avx2;
+        find_literal = find_avx2;
+    } else if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) {
+        count_newlines = count_sse2;
+        find_literal = find_sse2;
+    }
+#endif
+}
+
+//------------------------------------------INPUT AND OUTPUT-------------------------------------
+
+/* An input: the whole mapped file, or a block read from a stream */
+struct input {
+    const char *name;
+    int fd;
+    char *map;        /* mapped regular file, its size is len */
+    char *buf;        /* block buffer of a stream */
+    size_t cap;
+    size_t len;       /* bytes in buf or map */
+    int eof;
+};
+
+static char out_buf[1 << 16];
+static size_t out_len = 0;
+
+static void write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) _exit(2);  /* nobody reads our output any more */
+        p += w;
+        n -= w;
+    }
+}
+
+static void flush_out(void)
+{
+    write_all(STDOUT_FILENO, out_buf, out_len);
+    out_len = 0;
+}
+
+static void put(const char *p, size_t n)
+{
+    if (out_len + n > sizeof(out_buf)) flush_out();
+    if (n >= sizeof(out_buf)) {
+        write_all(STDOUT_FILENO, p, n);
+        return;
+    }
+    memcpy(out_buf + out_len, p, n);
+    out_len += n;
+}
+
+static void put_str(const char *s)
+{
+    put(s, strlen(s));
+}
+
+static void put_num(size_t v, int width)
+{
+    char digits[24];
+    int n = 0;
+
+    do digits[sizeof(digits) - ++n] = '0' + v % 10;
+    while ((v /= 10) != 0);
+    while (width-- > n) put(" ", 1);
+    put(digits + sizeof(digits) - n, n);
+}
+
+/* "cmd: name: reason" on the standard error */
+static void error(const char *cmd, const char *name, int err)
+{
+    const char *reason = strerror(err);
+    flush_out();
+    write_all(STDERR_FILENO, cmd, strlen(cmd));
+    write_all(STDERR_FILENO, ": ", 2);
+    write_all(STDERR_FILENO, name, strlen(name));
+    write_all(STDERR_FILENO, ": ", 2);
+    write_all(STDERR_FILENO, reason, strlen(reason));
+    write_all(STDERR_FILENO, "\n", 1);
+}
+
+/* Open name ("-" or 0 for the standard input) and map it if it is a
+   regular file. Returns -1 with errno set on failure. */
+static int open_input(struct input *in, const char *name)
+{
+    struct stat st;
+
+    memset(in, 0, sizeof(*in));
+    in->name = name;
+    in->fd = name == 0 || !strcmp(name, "-") ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+    if (in->fd == -1 || fstat(in->fd, &st) == -1) return -1;
+    if (S_ISDIR(st.st_mode)) {
+        if (in->fd > STDERR_FILENO) close(in->fd);
+        errno = EISDIR;
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && lseek(in->fd, 0, SEEK_CUR) == 0) {
+        in->map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (in->map != MAP_FAILED) {
+            in->len = st.st_size;
+            in->eof = 1;
+            madvise(in->map, in->len, MADV_SEQUENTIAL);
+            return 0;
+        }
+        in->map = 0;
+    }
+    in->cap = READ_SIZE;
+    in->buf = mmap(0, in->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return in->buf == MAP_FAILED ? -1 : 0;
+}
+
+/* Close in. The standard input is left just after the bytes used, as
+   coreutils does when it is a file, for what reads it next: the unused
+   bytes at the end of the map or of the last block go back. */
+static void close_input(struct input *in, size_t unused)
+{
+    if (in->fd == STDIN_FILENO) {
+        if (in->map) lseek(in->fd, in->len - unused, SEEK_SET);
+        else if (unused > 0) lseek(in->fd, -(off_t)unused, SEEK_CUR);  /* fails on a pipe, which is fine */
+    }
+    if (in->map) munmap(in->map, in->len);
+    if (in->buf && in->buf != MAP_FAILED) munmap(in->buf, in->cap);
+    if (in->fd > STDERR_FILENO) close(in->fd);
+}
+
+/* Read more of a stream after the keep bytes at the start of buf, growing
+   the buffer when it is full. Returns 0 at end of file, -1 on error. */
+static ssize_t fill(struct input *in, size_t keep)
+{
+    if (keep == in->cap) {
+        char *bigger = mremap(in->buf, in->cap, in->cap * 2, MREMAP_MAYMOVE);
+        if (bigger == MAP_FAILED) return -1;
+        in->buf = bigger;
+        in->cap *= 2;
+    }
+    in->len = keep;
+    while (1) {
+        ssize_t r = read(in->fd, in->buf + keep, in->cap - keep);
+        if (r == -1 && errno == EINTR) continue;
+        if (r > 0) in->len += r;
+        else in->eof = 1;
+        return r;
+    }
+}
+
+//------------------------------------------BUILTINS---------------------------------------------
+
+/* Width of the counts of wc: coreutils sizes it from the total size of the
+   files when there are several, 7 when one is not a regular file */
+static int wc_width(char **files, int nfiles)
+{
+    size_t size = 0;
+    int least = 1, digits = 1;
+    struct stat st;
+
+    if (nfiles < 2) return 1;
+    for (int f = 0; f < nfiles; f++) {
+        if ((!strcmp(files[f], "-") ? fstat(STDIN_FILENO, &st) : stat(files[f], &st)) == -1) continue;
+        if (!S_ISREG(st.st_mode)) least = 7;
+        else size += st.st_size;
+    }
+    for (; size >= 10; size /= 10) digits++;
+    return digits > least ? digits : least;
+}
+
+/* wc -l [FILE...] */
+static int wc_lines(char **files, int nfiles)
+{
+    size_t total = 0;
+    int status = 0, width = wc_width(files, nfiles);
+    struct input in;
+
+    for (int f = 0; f < (nfiles ? nfiles : 1); f++) {
+        if (open_input(&in, nfiles ? files[f] : 0) == -1) {
+            error("wc", nfiles ? files[f] : "-", errno);
+            status = 1;
+            continue;
+        }
+        size_t c = 0;
+        if (in.map) {
+            c = count_newlines(in.map, in.len);
+        } else {
+            while (fill(&in, 0) > 0) c += count_newlines(in.buf, in.len);
+        }
+        close_input(&in, 0);
+        total += c;
+        put_num(c, width);
+        if (nfiles) {
+            put(" ", 1);
+            put_str(files[f]);
+        }
+        put("\n", 1);
+    }
+    if (nfiles > 1) {
+        put_num(total, width);
+        put_str(" total\n");
+    }
+    flush_out();
+    return status;
+}
+
+/* Print or count the lines of [p, end) holding pat. Returns the count. */
+static size_t grep_block(const char *p, const char *end, const char *pat, size_t m,
+                         const char *prefix, int count_only)
+{
+    size_t c = 0;
+
+    while (p < end) {
+        const char *hit = m ? find_literal(p, end - p, pat, m) : p;
+        if (hit == 0) break;
+        const char *start = hit > p ? memrchr(p, '\n', hit - p) : 0;
+        const char *stop = memchr(hit, '\n', end - hit);
+        start = start ? start + 1 : p;
+        if (stop == 0) stop = end;
+        c++;
+        if (!count_only) {
+            if (prefix) {
+                put_str(prefix);
+                put(":", 1);
+            }
+            put(start, stop - start);
+            put("\n", 1);
+        }
+        p = stop + 1;
+    }
+    return c;
+}
+
+/* grep -F [-c] PATTERN [FILE...] */
+static int grep_fixed(const char *pat, int count_only, char **files, int nfiles)
+{
+    size_t m = strlen(pat), total = 0;
+    int status = 0;
+    struct input in;
+
+    for (int f = 0; f < (nfiles ? nfiles : 1); f++) {
+        const char *prefix = nfiles > 1 ? files[f] : 0;
+        size_t c = 0;
+
+        if (open_input(&in, nfiles ? files[f] : 0) == -1) {
+            error("grep", nfiles ? files[f] : "-", errno);
+            status = 2;
+            continue;
+        }
+        if (in.map) {
+            c = grep_block(in.map, in.map + in.len, pat, m, prefix, count_only);
+        } else {
+            size_t keep = 0;
+            while (!in.eof && fill(&in, keep) >= 0) {
+                /* complete lines only, the last one is kept for the next block */
+                char *last = in.eof ? in.buf + in.len : memrchr(in.buf, '\n', in.len);
+                if (last == 0) {
+                    keep = in.len;
+                    continue;
+                }
+                c += grep_block(in.buf, last, pat, m, prefix, count_only);
+                keep = in.eof ? 0 : in.buf + in.len - last - 1;
+                memmove(in.buf, last + 1, keep);
+            }
+        }
+        close_input(&in, 0);
+        if (count_only) {
+            if (prefix) {
+                put_str(prefix);
+                put(":", 1);
+            }
+            put_num(c, 0);
+            put("\n", 1);
+        }
+        total += c;
+    }
+    flush_out();
+    return status ? status : total ? 0 : 1;
+}
+
+/* head -n N [FILE] */
+static int head_lines(size_t n, const char *file)
+{
+    struct input in;
+
+    if (open_input(&in, file) == -1) {
+        error("head", file ? file : "-", errno);
+        return 1;
+    }
+    const char *p = in.map;
+    size_t len = in.len, unused = 0;
+    do {
+        if (!in.map) {
+            if (fill(&in, 0) <= 0) break;
+            p = in.buf;
+            len = in.len;
+        }
+        /* whole blocks while they hold fewer newlines than still wanted */
+        size_t i = 0;
+        while (n > 0 && i < len) {
+            size_t k = len - i < 4096 ? len - i : 4096, c = count_newlines(p + i, k);
+            if (c < n) {
+                n -= c;
+                i += k;
+                continue;
+            }
+            while (n > 0) {
+                const char *nl = memchr(p + i, '\n', len - i);
+                i = nl - p + 1;
+                n--;
+            }
+        }
+        put(p, i);
+        unused = len - i;
+    } while (n > 0 && !in.map);
+    close_input(&in, unused);
+    flush_out();
+    return 0;
+}
+
+//------------------------------------------DISPATCH---------------------------------------------
+
+/* Parse the count of "-n N", "-nN" or "-N", -1 if it is not one */
+static long head_count(char **argv, int *used)
+{
+    const char *s;
+    char *end;
+
+    if (argv[1] == 0 || argv[1][0] != '-') {
+        *used = 0;
+        return 10;
+    }
+    if (!strcmp(argv[1], "-n")) {
+        s = argv[2];
+        *used = 2;
+    } else {
+        s = argv[1] + (argv[1][1] == 'n' ? 2 : 1);
+        *used = 1;
+    }
+    if (s == 0 || *s < '0' || *s > '9') return -1;
+    long v = strtol(s, &end, 10);
+    return *end == 0 ? v : -1;
+}
+
+int textcmd_supported(char **argv)
+{
+    int used;
+
+    if (!strcmp(argv[0], "wc")) {
+        if (argv[1] == 0 || strcmp(argv[1], "-l")) return 0;
+        for (int i = 2; argv[i]; i++)
+            if (argv[i][0] == '-' && argv[i][1]) return 0;
+        return 1;
+    }
+    if (!strcmp(argv[0], "grep")) {
+        int i = 1, fixed = 0;
+        for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+            if (!strcmp(argv[i], "-F")) fixed = 1;
+            else if (strcmp(argv[i], "-c")) return 0;
+        }
+        return fixed && argv[i] != 0;
+    }
+    if (!strcmp(argv[0], "head")) {
+        if (head_count(argv, &used) < 0) return 0;
+        return argv[1 + used] == 0 || (argv[2 + used] == 0 && argv[1 + used][0] != '-');
+    }
+    return 0;
+}
+
+int textcmd_run(char **argv)
+{
+    int argc = 0, used;
+    while (argv[argc]) argc++;
+
+    select_kernels();
+    if (!strcmp(argv[0], "wc")) return wc_lines(argv + 2, argc - 2);
+    if (!strcmp(argv[0], "head")) {
+        long n = head_count(argv, &used);
+        return head_lines(n, argv[1 + used]);
+    }
+
+    int i = 1, count_only = 0;
+    for (; argv[i][0] == '-' && argv[i][1]; i++) count_only |= !strcmp(argv[i], "-c");
+    return grep_fixed(argv[i], count_only, argv + i + 1, argc - i - 1);
+}
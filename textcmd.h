@@ -0,0 +1,18 @@
+//
+// Text builtins: wc -l, grep -F and head -n, run in a forked child of the
+// shell instead of executing the program.
+//
+
+#ifndef TEXTCMD_H
+#define TEXTCMD_H
+
+/* Is argv a text builtin with options it supports. Anything else, or the
+   program called by its path (/usr/bin/wc), is executed as usual. */
+int textcmd_supported(char **argv);
+
+/* Run the builtin argv on the standard input, output and error, returns its
+   exit status. It does not allocate with xmalloc() nor use stdio, so it is
+   safe in a child forked while other threads of the shell hold locks. */
+int textcmd_run(char **argv);
+
+#endif //TEXTCMD_H
@@ -2,11 +2,48 @@
 // Created by Paula on 2024-07-27.
 //
 
+#define _GNU_SOURCE     // for strerrordesc_np()
+
 #include "utils.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MAX_SITES 256  /* call sites beyond this are counted together */
+
+/* Put in front of every block, so xfree() and xrealloc() know its size and
+   the call site it is accounted to. Sized to keep the block aligned. */
+union header {
+    struct {
+        size_t size;
+        unsigned site;
+    } h;
+    max_align_t align;
+};
+
+struct site {
+    const char *file;
+    int line;
+    unsigned long calls;
+    size_t live;
+    size_t peak;
+};
+
+static struct site sites[MAX_SITES];
+static unsigned site_count = 0;
+
+static unsigned long malloc_calls = 0, realloc_calls = 0, free_calls = 0;
+static size_t live_bytes = 0, live_blocks = 0, peak_bytes = 0;
+
+/* The counters are shared by the server workers */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void memory_error(void)
 {
@@ -15,16 +52,191 @@ void memory_error(void)
     exit(1);
 }
 
-void *xmalloc(size_t size)
+/* Index of the call site. The last slot is "(other)", line 0: the sites
+   beyond the others are counted there, not credited to a real one. */
+static unsigned find_site(const char *file, int line)
+{
+    unsigned i;
+
+    for (i = 0; i < site_count; i++)
+        if (sites[i].line == line && (sites[i].file == file || !strcmp(sites[i].file, file)))
+            return i;
+    if (site_count == MAX_SITES - 1) {
+        sites[site_count].file = "(other)";
+        sites[site_count].line = 0;
+        site_count++;
+    }
+    if (site_count == MAX_SITES) return MAX_SITES - 1;
+    sites[site_count].file = file;
+    sites[site_count].line = line;
+    return site_count++;
+}
+
+static void account(unsigned site, size_t size)
+{
+    sites[site].calls++;
+    sites[site].live += size;
+    if (sites[site].live > sites[site].peak) sites[site].peak = sites[site].live;
+    live_bytes += size;
+    if (live_bytes > peak_bytes) peak_bytes = live_bytes;
+}
+
+void *xmalloc_at(size_t size, const char *file, int line)
 {
-    void *p = malloc(size);
+    union header *p = malloc(sizeof(union header) + size);
     if (!p) memory_error();
-    return p;
+    p->h.size = size;
+    pthread_mutex_lock(&stats_lock);
+    p->h.site = find_site(file, line);
+    malloc_calls++;
+    live_blocks++;
+    account(p->h.site, size);
+    pthread_mutex_unlock(&stats_lock);
+    return p + 1;
 }
 
-void *xrealloc(void *ptr, size_t size)
+void *xrealloc_at(void *ptr, size_t size, const char *file, int line)
 {
-    void *p = realloc(ptr, size);
+    union header *p = ptr ? (union header *)ptr - 1 : 0;
+    size_t old_size = p ? p->h.size : 0;
+    unsigned old_site = p ? p->h.site : 0;
+
+    p = realloc(p, sizeof(union header) + size);
     if (!p) memory_error();
+    p->h.size = size;
+    pthread_mutex_lock(&stats_lock);
+    if (ptr) {
+        sites[old_site].live -= old_size;
+        live_bytes -= old_size;
+    } else {
+        live_blocks++;
+    }
+    p->h.site = find_site(file, line);
+    realloc_calls++;
+    account(p->h.site, size);
+    pthread_mutex_unlock(&stats_lock);
+    return p + 1;
+}
+
+char *xstrdup_at(const char *s, const char *file, int line)
+{
+    size_t l = strlen(s) + 1;
+    char *p = xmalloc_at(l, file, line);
+    memcpy(p, s, l);
     return p;
 }
+
+void xfree(void *ptr)
+{
+    union header *p;
+
+    if (!ptr) return;
+    p = (union header *)ptr - 1;
+    pthread_mutex_lock(&stats_lock);
+    sites[p->h.site].live -= p->h.size;
+    live_bytes -= p->h.size;
+    live_blocks--;
+    free_calls++;
+    pthread_mutex_unlock(&stats_lock);
+    free(p);
+}
+
+size_t memstats_live_bytes(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    size_t l = live_bytes;
+    pthread_mutex_unlock(&stats_lock);
+    return l;
+}
+
+static int by_live_bytes(const void *a, const void *b)
+{
+    const struct site *x = a, *y = b;
+    if (x->live != y->live) return x->live < y->live ? 1 : -1;
+    return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+void memstats_print(FILE *out)
+{
+    struct site sorted[MAX_SITES];
+    unsigned long calls[3];
+    size_t live[3];
+    unsigned count;
+
+    pthread_mutex_lock(&stats_lock);
+    count = site_count;
+    memcpy(sorted, sites, count * sizeof(struct site));
+    calls[0] = malloc_calls;
+    calls[1] = realloc_calls;
+    calls[2] = free_calls;
+    live[0] = live_bytes;
+    live[1] = live_blocks;
+    live[2] = peak_bytes;
+    pthread_mutex_unlock(&stats_lock);
+    qsort(sorted, count, sizeof(struct site), by_live_bytes);
+
+    fprintf(out, "------------------Memory statistics------------------\n");
+    fprintf(out, "calls: %lu malloc, %lu realloc, %lu free\n", calls[0], calls[1], calls[2]);
+    fprintf(out, "live: %zu bytes in %zu blocks, peak %zu bytes\n", live[0], live[1], live[2]);
+    for (unsigned i = 0; i < count; i++) {
+        if (sorted[i].line == 0)  /* "(other)" */
+            fprintf(out, "%16s %-5s", sorted[i].file, "");
+        else
+            fprintf(out, "%16s:%-5d", sorted[i].file, sorted[i].line);
+        fprintf(out, " calls %-10lu live %-10zu peak %zu\n", sorted[i].calls, sorted[i].live, sorted[i].peak);
+    }
+}
+
+//------------------------------------------FILE DESCRIPTORS-------------------------------------
+
+/* Call f for each fd open in the shell, as listed by the kernel */
+static int each_fd(void (*f)(int fd, FILE *out), FILE *out)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *e;
+    int n = 0;
+
+    if (dir == 0) return -1;
+    while ((e = readdir(dir)) != 0) {
+        if (e->d_name[0] == '.') continue;
+        int fd = atoi(e->d_name);
+        if (fd == dirfd(dir)) continue;
+        if (f) f(fd, out);
+        n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+static void print_fd(int fd, FILE *out)
+{
+    char link[64], target[256];
+    int flags = fcntl(fd, F_GETFD);
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    target[n > 0 ? n : 0] = 0;
+    fprintf(out, "%5d %s %s\n", fd, flags != -1 && (flags & FD_CLOEXEC) ? "cloexec" : "       ", target);
+}
+
+void child_error(const char *what)
+{
+    const char *msg = strerrordesc_np(errno);
+
+    if (msg == 0) msg = "Unknown error";
+    struct iovec parts[] = {{(char *)what, strlen(what)}, {": ", 2}, {(char *)msg, strlen(msg)}, {"\n", 1}};
+
+    writev(STDERR_FILENO, parts, 4);
+}
+
+int open_fds(void)
+{
+    return each_fd(0, 0);
+}
+
+void fdstats_print(FILE *out)
+{
+    fprintf(out, "------------------File descriptors------------------\n");
+    fprintf(out, "open: %d\n", open_fds());
+    each_fd(print_fd, out);
+}
@@ -5,9 +5,37 @@
 #ifndef UTILS_H
 #define UTILS_H
 #include <stddef.h>
+#include <stdio.h>
 
 #endif //UTILS_H
 
 void memory_error(void);
-void *xmalloc(size_t size);
-void *xrealloc(void *ptr, size_t size);
\ No newline at end of file
+
+/* Allocation functions which exit on failure. Every block they return is
+   accounted to the file and line of the call, and must be released with
+   xfree(), not free(). */
+#define xmalloc(size) xmalloc_at((size), __FILE__, __LINE__)
+#define xrealloc(ptr, size) xrealloc_at((ptr), (size), __FILE__, __LINE__)
+#define xstrdup(s) xstrdup_at((s), __FILE__, __LINE__)
+
+void *xmalloc_at(size_t size, const char *file, int line);
+void *xrealloc_at(void *ptr, size_t size, const char *file, int line);
+char *xstrdup_at(const char *s, const char *file, int line);
+void xfree(void *ptr);
+
+/* Bytes currently allocated through the functions above */
+size_t memstats_live_bytes(void);
+
+/* Print the allocation counters, globally and by call site */
+void memstats_print(FILE *out);
+
+/* Print "what: " and the message of errno with write(), for a child forked
+   by the shell, whose other threads may have held the locks of stdio */
+void child_error(const char *what);
+
+/* Number of fds open in the shell, -1 if unknown */
+int open_fds(void);
+
+/* Print the fds open in the shell, with what they refer to and whether
+   they are closed at exec */
+void fdstats_print(FILE *out);
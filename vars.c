@@ -0,0 +1,319 @@
+//
+// Variables of the shell and the environment of the commands.
+//
+// The variables are "NAME=value" strings. The exported ones are copied into
+// one block, the envp array followed by its strings, that every command is
+// given as is: nothing is done per command until an exported variable
+// changes, and the zygote is sent the block only when it is a new one. A
+// block is freed once it is replaced and no spawn in progress uses it.
+//
+// The lock keeps the table, the block and the paths consistent for the
+// spawns of the server threads; vars_get() does not take it.
+//
+// The paths of the commands found in PATH are kept in a small hash table,
+// emptied when PATH changes. Commands not found are not kept, so one
+// installed later is found.
+//
+
+#define _GNU_SOURCE     // for strchrnul()
+
+#include "vars.h"
+#include "utils.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PATH_SLOTS 256
+#define DEFAULT_PATH "/bin:/usr/bin"  // as execvp() without PATH
+
+extern char **environ;
+
+struct var {
+    char *entry;      /* "NAME=value" */
+    size_t name_len;
+    int exported;
+};
+
+static struct var *vars = 0;
+static size_t vars_len = 0, vars_cap = 0;
+static struct env *current = 0;  /* 0 when it must be rebuilt */
+static unsigned versions = 0;
+
+/* Resolved paths, by command name */
+static struct {
+    char *name;
+    char *path;
+} paths[PATH_SLOTS];
+static size_t paths_len = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long find(const char *name, size_t len)
+{
+    for (size_t i = 0; i < vars_len; i++)
+        if (vars[i].name_len == len && !memcmp(vars[i].entry, name, len)) return i;
+    return -1;
+}
+
+static int valid_name(const char *name, size_t len)
+{
+    if (len == 0 || isdigit((unsigned char)name[0])) return 0;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_') return 0;
+    return 1;
+}
+
+static void add(char *entry, size_t name_len, int exported)
+{
+    if (vars_len == vars_cap) {
+        vars_cap = vars_cap ? 2 * vars_cap : 64;
+        vars = xrealloc(vars, vars_cap * sizeof(struct var));
+    }
+    vars[vars_len++] = (struct var){entry, name_len, exported};
+}
+
+static void forget_paths(void)
+{
+    for (size_t h = 0; h < PATH_SLOTS; h++) {
+        if (paths[h].name == 0) continue;
+        xfree(paths[h].name);
+        xfree(paths[h].path);
+        paths[h].name = paths[h].path = 0;
+    }
+    paths_len = 0;
+}
+
+/* Variable i changed or is about to be removed. Called with the lock held. */
+static void changed(size_t i)
+{
+    if (vars[i].exported && current) {
+        if (--current->refs == 0) xfree(current);
+        current = 0;
+    }
+    if (vars[i].name_len == 4 && !memcmp(vars[i].entry, "PATH", 4)) forget_paths();
+}
+
+void vars_init(void)
+{
+    pthread_mutex_lock(&lock);
+    for (char **e = environ; *e; e++) {
+        char *eq = strchr(*e, '=');
+        if (eq && find(*e, eq - *e) == -1) add(xstrdup(*e), eq - *e, 1);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* No lock: the pointer returned would outlive it anyway, see vars.h */
+const char *vars_get(const char *name)
+{
+    long i = find(name, strlen(name));
+    return i == -1 ? 0 : vars[i].entry + vars[i].name_len + 1;
+}
+
+int vars_set(const char *name, const char *value, int export)
+{
+    size_t len = strlen(name);
+
+    if (!valid_name(name, len)) return -1;
+    pthread_mutex_lock(&lock);
+    long i = find(name, len);
+    if (i == -1 && value) {
+        char *entry = xmalloc(len + strlen(value) + 2);
+        sprintf(entry, "%s=%s", name, value);
+        add(entry, len, export);
+        changed(vars_len - 1);
+    } else if (i != -1 && (value || (export && !vars[i].exported))) {
+        vars[i].exported |= export;
+        changed(i);
+        if (value) {
+            xfree(vars[i].entry);
+            vars[i].entry = xmalloc(len + strlen(value) + 2);
+            sprintf(vars[i].entry, "%s=%s", name, value);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void vars_unset(const char *name)
+{
+    pthread_mutex_lock(&lock);
+    long i = find(name, strlen(name));
+    if (i != -1) {
+        changed(i);
+        xfree(vars[i].entry);
+        memmove(vars + i, vars + i + 1, (vars_len - i - 1) * sizeof(struct var));
+        vars_len--;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Copy the exported variables into a new block. Called with the lock held. */
+static struct env *build(void)
+{
+    size_t count = 0, size = 0;
+
+    for (size_t i = 0; i < vars_len; i++) {
+        if (!vars[i].exported) continue;
+        count++;
+        size += strlen(vars[i].entry) + 1;
+    }
+    struct env *e = xmalloc(sizeof(struct env) + (count + 1) * sizeof(char *) + size);
+    char *s = (char *)((char **)(e + 1) + count + 1);
+
+    e->version = ++versions;
+    e->envp = (char **)(e + 1);
+    e->count = count;
+    e->strings = s;
+    e->size = size;
+    e->refs = 1;  /* as the current block */
+    count = 0;
+    for (size_t i = 0; i < vars_len; i++) {
+        if (!vars[i].exported) continue;
+        size_t l = strlen(vars[i].entry) + 1;
+        e->envp[count++] = memcpy(s, vars[i].entry, l);
+        s += l;
+    }
+    e->envp[count] = 0;
+    return e;
+}
+
+struct env *vars_env(void)
+{
+    pthread_mutex_lock(&lock);
+    if (current == 0) current = build();
+    struct env *e = current;
+    e->refs++;
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+void vars_release(struct env *e)
+{
+    pthread_mutex_lock(&lock);
+    if (--e->refs == 0) xfree(e);
+    pthread_mutex_unlock(&lock);
+}
+
+//------------------------------------------PATH------------------------------------------------
+
+/* Put in buf the path of file in the first directory of the list dirs (an
+   empty one is the current directory), or "" if it is too long. Returns
+   the rest of the list, 0 after the last directory. */
+static const char *candidate(const char *dirs, const char *file, char *buf, size_t size)
+{
+    const char *end = strchrnul(dirs, ':');
+    size_t len = end - dirs, flen = strlen(file);
+
+    if (len == 0) {
+        dirs = ".";
+        len = 1;
+    }
+    if (len + flen + 2 > size) {
+        buf[0] = 0;
+    } else {
+        memcpy(buf, dirs, len);
+        buf[len] = '/';
+        memcpy(buf + len + 1, file, flen + 1);
+    }
+    return *end ? end + 1 : 0;
+}
+
+static unsigned long hash(const char *s)
+{
+    unsigned long h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+int vars_resolve(const char *file, char *path, size_t size)
+{
+    struct stat st;
+    int found = -1;
+
+    if (strchr(file, '/')) {
+        if (strlen(file) >= size) return -1;
+        strcpy(path, file);
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    size_t h = hash(file) % PATH_SLOTS;
+    for (; paths[h].name; h = (h + 1) % PATH_SLOTS) {
+        if (strcmp(paths[h].name, file)) continue;
+        if (strlen(paths[h].path) < size) {
+            strcpy(path, paths[h].path);
+            found = 0;
+        }
+        pthread_mutex_unlock(&lock);
+        return found;
+    }
+
+    long i = find("PATH", 4);
+    const char *dirs = i != -1 ? vars[i].entry + 5 : DEFAULT_PATH;
+    do {
+        dirs = candidate(dirs, file, path, size);
+        if (path[0] && stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) found = 0;
+    } while (found == -1 && dirs);
+
+    if (found == 0) {
+        if (paths_len >= PATH_SLOTS / 2) {  /* keep the table sparse */
+            forget_paths();
+            h = hash(file) % PATH_SLOTS;
+        }
+        paths[h].name = xstrdup(file);
+        paths[h].path = xstrdup(path);
+        paths_len++;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/* execve(), and /bin/sh for a file without "#!" as execvp() does */
+static void try_exec(const char *path, char **argv, char **envp)
+{
+    execve(path, argv, envp);
+    if (errno == ENOEXEC) {
+        size_t n = 0;
+        while (argv[n]) n++;
+        char *sh[n + 2];
+        sh[0] = "/bin/sh";
+        sh[1] = (char *)path;
+        memcpy(sh + 2, argv + 1, n * sizeof(char *));
+        execve("/bin/sh", sh, envp);
+        errno = ENOEXEC;
+    }
+}
+
+void vars_exec(const char *path, char **argv, char **envp)
+{
+    char buf[PATH_MAX];
+    const char *dirs = DEFAULT_PATH;
+    int err = ENOENT;
+
+    if (path) {
+        try_exec(path, argv, envp);
+        if (strchr(argv[0], '/') || (errno != ENOENT && errno != ENOTDIR && errno != EACCES)) return;
+    } else if (strchr(argv[0], '/')) {
+        try_exec(argv[0], argv, envp);
+        return;
+    }
+
+    /* not resolved, or no longer there: look again */
+    for (char **e = envp; *e; e++)
+        if (!strncmp(*e, "PATH=", 5)) dirs = *e + 5;
+    do {
+        dirs = candidate(dirs, argv[0], buf, sizeof(buf));
+        if (!buf[0]) continue;
+        try_exec(buf, argv, envp);
+        if (errno == EACCES) err = EACCES;
+        else if (errno != ENOENT && errno != ENOTDIR) return;
+    } while (dirs);
+    errno = err;
+}
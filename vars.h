@@ -0,0 +1,52 @@
+//
+// Variables of the shell, the environment of the commands built from them,
+// and the paths of the commands found in PATH.
+//
+
+#ifndef VARS_H
+#define VARS_H
+
+#include <stddef.h>
+
+/* The environment of the commands: envp and its strings in one block,
+   rebuilt only when an exported variable changes */
+struct env {
+    unsigned version;      /* different for each block */
+    char **envp;
+    size_t count;          /* strings in envp */
+    const char *strings;   /* the strings of envp, one after the other */
+    size_t size;           /* bytes of strings, final NULs included */
+    int refs;
+};
+
+/* Take the variables of the environment of the shell, all exported */
+void vars_init(void);
+
+/* Value of variable name, or NULL if it is not set. It points into the
+   variable, freed when it is set again or unset: only the thread that sets
+   and unsets the variables (the main one; the server refuses export and
+   unset) may call it, or any thread while none does. */
+const char *vars_get(const char *name);
+
+/* Set variable name to value, exported if export is set (an exported
+   variable stays exported). With value NULL, only export it. Returns -1
+   if name is not a valid name. */
+int vars_set(const char *name, const char *value, int export);
+void vars_unset(const char *name);
+
+/* The current environment block, kept until vars_release() */
+struct env *vars_env(void);
+void vars_release(struct env *e);
+
+/* Put in path the file run for command file, as execvp() would find it in
+   PATH. The paths found are cached until PATH changes. Returns -1 if it is
+   not found. */
+int vars_resolve(const char *file, char *path, size_t size);
+
+/* Execute argv with envp, at path if not NULL (from vars_resolve()), else
+   or if it fails looking in the PATH of envp, as execvpe() does. Returns
+   only on failure, with errno set. Safe in a child forked by a thread:
+   it does not allocate. */
+void vars_exec(const char *path, char **argv, char **envp);
+
+#endif //VARS_H
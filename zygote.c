@@ -0,0 +1,447 @@
+//
+// Zygote: a small helper process, forked at startup while the shell is
+// still small, which does the fork and exec of the commands.
+//
+// Forking copies the page tables of the parent, so its cost grows with the
+// memory of the shell. The zygote never grows: the shell sends it argv and
+// the path of the program over a socketpair, with the standard fds of the
+// command attached as SCM_RIGHTS, and gets the pid back. The environment is
+// sent only when it is not the one sent last, the zygote keeps it. The commands are children
+// of the zygote, which reaps them and reports their wait status on the same
+// socket.
+//
+
+#define _GNU_SOURCE
+
+#include "zygote.h"
+#include "utils.h"
+#include "vars.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum { ZY_SPAWNED, ZY_EXITED };
+
+#define ENV_SAME UINT32_MAX  /* envc: the environment sent last */
+
+/* Sent by the shell with the fds of the command attached, followed by len
+   bytes: the path of the program ("" if not found) and the argc arguments,
+   then by env_len bytes: the envc environment strings, each one NUL
+   terminated */
+struct spawn_request {
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;
+    uint32_t env_len;
+    uint32_t fd_mask;  /* bit k set: an fd for k is attached, in order */
+    int32_t pgid;      /* process group to join, 0 for a new one, -1 for the zygote's */
+};
+
+/* Sent by the zygote */
+struct zygote_msg {
+    uint32_t type;
+    int32_t pid;       /* ZY_SPAWNED: the pid, or -errno if fork failed */
+    int32_t status;    /* ZY_EXITED: the wait status */
+};
+
+/* A command started by the zygote, until the shell waits for it */
+struct owned {
+    pid_t pid;
+    int status;
+    int exited;
+};
+
+static int zsock = -1;
+static int dead = 0;   /* the zygote is gone, the shell forks again */
+
+static struct owned *owned = 0;
+static size_t owned_len = 0, owned_cap = 0;
+
+/* zlock protects the state above. One thread at a time reads the socket,
+   the others wait on zcond for the message they need to be recorded. */
+static pthread_mutex_t zlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zcond = PTHREAD_COND_INITIALIZER;
+static int reading = 0;
+
+/* Spawn requests are sent one at a time, so the next ZY_SPAWNED answers
+   the pending one */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int reply_ready = 0;
+static pid_t reply_pid = -1;
+static unsigned env_sent = 0;  /* version of the environment the zygote has */
+
+static int read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+//------------------------------------------ZYGOTE PROCESS---------------------------------------
+
+/* The environment last sent by the shell, in the zygote */
+static char *env_strings = 0;
+static char **envp = 0;
+
+/* Read a new environment of envc strings in len bytes */
+static int read_env(int sock, uint32_t envc, uint32_t len)
+{
+    xfree(env_strings);
+    xfree(envp);
+    env_strings = xmalloc(len + 1);
+    envp = xmalloc((envc + 1) * sizeof(char *));
+    if (read_full(sock, env_strings, len) == -1) return -1;
+    env_strings[len] = 0;
+
+    char *p = env_strings;
+    for (uint32_t i = 0; i < envc; i++, p += strlen(p) + 1) envp[i] = p;
+    envp[envc] = 0;
+    return 0;
+}
+
+/* Receive one spawn request and start the command. Returns -1 when the
+   shell closed the socket. */
+static int zygote_request(int sock, const sigset_t *child_mask)
+{
+    struct spawn_request req;
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    int received[3], nreceived = 0, stage_fds[3] = {-1, -1, -1};
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    ssize_t r;
+    do r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    while (r == -1 && errno == EINTR);
+    if (r <= 0) return -1;
+    if ((size_t)r < sizeof(req) && read_full(sock, (char *)&req + r, sizeof(req) - r) == -1) return -1;
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        nreceived = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (nreceived > 3) nreceived = 3;
+        memcpy(received, CMSG_DATA(c), nreceived * sizeof(int));
+    }
+    for (int k = 0, j = 0; k < 3; k++)
+        if ((req.fd_mask & (1u << k)) && j < nreceived) stage_fds[k] = received[j++];
+
+    char *payload = xmalloc(req.len + 1);
+    char **argv = xmalloc((req.argc + 1) * sizeof(char *));
+    if (read_full(sock, payload, req.len) == -1) return -1;
+    payload[req.len] = 0;
+    if (req.envc != ENV_SAME && read_env(sock, req.envc, req.env_len) == -1) return -1;
+
+    char *path = payload, *p = payload + strlen(payload) + 1;
+    for (uint32_t i = 0; i < req.argc; i++, p += strlen(p) + 1) argv[i] = p;
+    argv[req.argc] = 0;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, child_mask, 0);
+        if (req.pgid != -1) setpgid(0, req.pgid);
+        for (int k = 0; k < 3; k++) {
+            if (stage_fds[k] == -1) continue;
+            if (stage_fds[k] == k) fcntl(k, F_SETFD, 0);
+            else if (dup2(stage_fds[k], k) == -1) {
+                perror("Error redirecting input or output");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        close_range(3, ~0U, 0);  /* the socket and signalfd, and what the shell inherited */
+        vars_exec(path[0] ? path : 0, argv, envp);
+        perror("execvp failed");
+        _exit(EXIT_FAILURE);
+    }
+    if (pid > 0 && req.pgid != -1) setpgid(pid, req.pgid ? req.pgid : pid);  /* no race with the kill */
+
+    struct zygote_msg m = {ZY_SPAWNED, pid == -1 ? -errno : pid, 0};
+    for (int j = 0; j < nreceived; j++) close(received[j]);
+    xfree(payload);
+    xfree(argv);
+    return write_full(sock, &m, sizeof(m));
+}
+
+static void zygote_main(int sock)
+{
+    sigset_t chld, old;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC);
+    if (sfd == -1) _exit(1);
+
+    struct pollfd pfds[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+    while (1) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            _exit(1);
+        }
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            int status;
+            pid_t pid;
+            if (read(sfd, &si, sizeof(si)) == -1 && errno != EAGAIN) _exit(1);
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                struct zygote_msg m = {ZY_EXITED, pid, status};
+                if (write_full(sock, &m, sizeof(m)) == -1) _exit(0);
+            }
+        }
+        if (pfds[0].revents && zygote_request(sock, &old) == -1) _exit(0);
+    }
+}
+
+int zygote_start(void)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) return -1;
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+    zsock = sv[0];
+    return 0;
+}
+
+//------------------------------------------SHELL SIDE-------------------------------------------
+
+static long find_owned(pid_t pid)
+{
+    for (size_t i = 0; i < owned_len; i++)
+        if (owned[i].pid == pid) return (long)i;
+    return -1;
+}
+
+/* Called with zlock held */
+static void record(const struct zygote_msg *m)
+{
+    if (m->type == ZY_SPAWNED) {
+        reply_pid = m->pid > 0 ? m->pid : -1;
+        reply_ready = 1;
+        if (m->pid <= 0) return;
+        if (owned_len == owned_cap) {
+            owned_cap = owned_cap ? owned_cap * 2 : 64;
+            owned = xrealloc(owned, owned_cap * sizeof(struct owned));
+        }
+        owned[owned_len].pid = m->pid;
+        owned[owned_len].status = 0;
+        owned[owned_len].exited = 0;
+        owned_len++;
+    } else if (m->type == ZY_EXITED) {
+        long i = find_owned(m->pid);
+        if (i != -1) {
+            owned[i].exited = 1;
+            owned[i].status = m->status;
+        }
+    }
+}
+
+/* The zygote died: its commands can not be waited for any more */
+static void zygote_lost(void)
+{
+    dead = 1;
+    reply_ready = 1;
+    for (size_t i = 0; i < owned_len; i++) {
+        if (owned[i].exited) continue;
+        owned[i].exited = 1;
+        owned[i].status = SIGKILL;
+    }
+}
+
+static int spawn_answered(pid_t pid)
+{
+    (void)pid;
+    return reply_ready;
+}
+
+static int exited_or_unknown(pid_t pid)
+{
+    long i = find_owned(pid);
+    return i == -1 || owned[i].exited;
+}
+
+/* Record the messages of the zygote until done(pid). Called with zlock
+   held, which is released while blocked on the socket. */
+static void pump(int (*done)(pid_t), pid_t pid)
+{
+    while (!dead && !done(pid)) {
+        if (reading) {
+            pthread_cond_wait(&zcond, &zlock);
+            continue;
+        }
+        struct zygote_msg m;
+        reading = 1;
+        pthread_mutex_unlock(&zlock);
+        int r = read_full(zsock, &m, sizeof(m));
+        pthread_mutex_lock(&zlock);
+        reading = 0;
+        if (r == -1) zygote_lost();
+        else record(&m);
+        pthread_cond_broadcast(&zcond);
+    }
+}
+
+int zygote_active(void)
+{
+    return zsock != -1 && !dead;
+}
+
+pid_t zygote_spawn(char **argv, const int *fds, pid_t pgid)
+{
+    struct spawn_request req = {0, ENV_SAME, 0, 0, 0, pgid};
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    char path[PATH_MAX];
+    int attached[3], nattached = 0;
+    size_t i, off = 0;
+
+    if (vars_resolve(argv[0], path, sizeof(path)) == -1) path[0] = 0;
+    req.len = strlen(path) + 1;
+    for (i = 0; argv[i]; i++) req.len += strlen(argv[i]) + 1;
+    req.argc = i;
+
+    char *payload = xmalloc(req.len);
+    memcpy(payload, path, strlen(path) + 1);
+    off = strlen(path) + 1;
+    for (i = 0; argv[i]; i++) {
+        size_t l = strlen(argv[i]) + 1;
+        memcpy(payload + off, argv[i], l);
+        off += l;
+    }
+    for (int k = 0; k < 3; k++) {
+        if (fds[k] == -1) continue;
+        req.fd_mask |= 1u << k;
+        attached[nattached++] = fds[k];
+    }
+
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nattached > 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nattached * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nattached * sizeof(int));
+        memcpy(CMSG_DATA(c), attached, nattached * sizeof(int));
+    }
+
+    pid_t pid = -1;
+    struct env *env = vars_env();
+    pthread_mutex_lock(&spawn_lock);
+    if (env->version != env_sent) {
+        req.envc = env->count;
+        req.env_len = env->size;
+    }
+    pthread_mutex_lock(&zlock);
+    reply_ready = 0;
+    pthread_mutex_unlock(&zlock);
+
+    ssize_t sent;
+    do sent = sendmsg(zsock, &msg, MSG_NOSIGNAL);
+    while (sent == -1 && errno == EINTR);
+    if (sent != -1 && write_full(zsock, (char *)&req + sent, sizeof(req) - sent) == 0 &&
+        write_full(zsock, payload, req.len) == 0 &&
+        (req.envc == ENV_SAME || write_full(zsock, env->strings, env->size) == 0)) {
+        env_sent = env->version;
+        pthread_mutex_lock(&zlock);
+        pump(spawn_answered, 0);
+        if (!dead) pid = reply_pid;
+        pthread_mutex_unlock(&zlock);
+    } else {
+        pthread_mutex_lock(&zlock);
+        zygote_lost();
+        pthread_mutex_unlock(&zlock);
+    }
+    pthread_mutex_unlock(&spawn_lock);
+    vars_release(env);
+    xfree(payload);
+    return pid;
+}
+
+int zygote_owns(pid_t pid)
+{
+    if (zsock == -1) return 0;
+    pthread_mutex_lock(&zlock);
+    int r = find_owned(pid) != -1;
+    pthread_mutex_unlock(&zlock);
+    return r;
+}
+
+pid_t zygote_wait(pid_t pid, int *status, int options)
+{
+    pthread_mutex_lock(&zlock);
+    if (options & WNOHANG) {
+        /* record what already arrived, unless another thread is reading */
+        struct pollfd p = {zsock, POLLIN, 0};
+        while (!dead && !reading && poll(&p, 1, 0) == 1) {
+            struct zygote_msg m;
+            if (read_full(zsock, &m, sizeof(m)) == -1) zygote_lost();
+            else record(&m);
+        }
+    } else {
+        pump(exited_or_unknown, pid);
+    }
+
+    long i = find_owned(pid);
+    pid_t r;
+    if (i == -1) {
+        errno = ECHILD;
+        r = -1;
+    } else if (!owned[i].exited) {
+        r = 0;
+    } else {
+        if (status) *status = owned[i].status;
+        owned[i] = owned[--owned_len];
+        r = pid;
+    }
+    pthread_mutex_unlock(&zlock);
+    return r;
+}
@@ -0,0 +1,30 @@
+//
+// Zygote: a small helper process, forked at startup while the shell is
+// still small, which does the fork and exec of the commands.
+//
+
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <sys/types.h>
+
+/* Fork the zygote. Returns -1 on failure, the shell then forks itself. */
+int zygote_start(void);
+
+/* Is there a zygote to spawn commands */
+int zygote_active(void);
+
+/* Have the zygote start argv with the given standard input, output and
+   error (-1 keeps the one the shell had at startup), in the current
+   environment and in process group pgid (0 for a new one, -1 for the
+   shell's). Returns the pid, or -1. */
+pid_t zygote_spawn(char **argv, const int *fds, pid_t pgid);
+
+/* Is pid a command started by the zygote and not waited for yet */
+int zygote_owns(pid_t pid);
+
+/* waitpid() for a command started by the zygote, only WNOHANG is
+   supported in options */
+pid_t zygote_wait(pid_t pid, int *status, int options);
+
+#endif //ZYGOTE_H